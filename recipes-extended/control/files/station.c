@@ -24,6 +24,7 @@
 #include "config.h"
 #include "utils.h"
 #include "shmem.h"
+#include "rtsched.h"
 
 // Chip 0 on older Pi models, chip 4 on Pi 5.
 #define CHIP "/dev/gpiochip0"
@@ -158,11 +159,19 @@ static struct sockets sockets;
 
 static void send_message(struct gpio_data *data);
 
+static struct rt_config gpio_rt;    // Scheduling of the GPIO reader thread
+static struct rt_config osd_rt;     // Scheduling of the OSD drawing thread
+
 static void help()
 {
     printf("Usage: station [options]\n");
     printf("Options:\n");
     printf("  -p, --IP port             Set UART device (default: %d)\n", DEFAULT_PORT);
+    printf("  -g, --rt-gpio <spec>      Scheduling of the GPIO reader, e.g. fifo=50,cpus=0,mlock,stack=64k:\n");
+    printf("                            fifo=<priority> or other=<nice>, cpus=<list> ('+' separated),\n");
+    printf("                            mlock, stack=<bytes> to prefault, jitter to measure the wakeup\n");
+    printf("                            latency (default: inherited)\n");
+    printf("  -o, --rt-osd <spec>       Scheduling of the OSD drawing thread, same format (default: inherited)\n");
     printf("  -v, --verbose             Increase verbosity level (can be used multiple times)\n");
     printf("  -h, --help                Show this help message\n");
     printf("  -V, --version             Show version information\n");
@@ -333,6 +342,7 @@ void *reader(void *arg)
     struct gpio_v2_line_event event;
     unsigned i;
 
+    rt_setup_thread(&gpio_rt, "GPIO reader");
     for (i = 0; i < NUM_PINS; i++) {
         poll_descriptors[i].fd = data->pins[i].fd;
         poll_descriptors[i].events = POLLIN;
@@ -668,6 +678,8 @@ int main(int argc, char *argv[])
 
     static struct option long_options[] = {
         {"tcp-port", required_argument, NULL, 'p'},
+        {"rt-gpio", required_argument, NULL, 'g'},
+        {"rt-osd", required_argument, NULL, 'o'},
         {"help", no_argument, NULL, 'h'},
         {"version", no_argument, NULL, 'V'},
         {"verbose", no_argument, NULL, 'v'},
@@ -675,7 +687,9 @@ int main(int argc, char *argv[])
     };
 
     tcp_port = DEFAULT_PORT;
-    while ((opt = getopt_long(argc, argv, "vVhp:", long_options, &long_index)) != -1) {
+    rt_config_init(&gpio_rt);
+    rt_config_init(&osd_rt);
+    while ((opt = getopt_long(argc, argv, "vVhp:g:o:", long_options, &long_index)) != -1) {
         switch (opt) {
             case 'V':
                 printf("Version %s\n", VERSION);
@@ -690,6 +704,14 @@ int main(int argc, char *argv[])
                 tcp_port = atoi(optarg);
                 printf("TCP port set to: %d\n", tcp_port);
                 break;
+            case 'g': // Scheduling of the GPIO reader
+                if (rt_config_parse(&gpio_rt, optarg))
+                    return 1;
+                break;
+            case 'o': // Scheduling of the OSD thread
+                if (rt_config_parse(&osd_rt, optarg))
+                    return 1;
+                break;
             case '?':
                 break;
             default:
@@ -753,7 +775,7 @@ int main(int argc, char *argv[])
     load_config(CONFIG_FILE);
     pthread_create(&reader_thread, NULL, &reader, (void *)&data);
     init_shared(DEFAULT_SHARED_NAME, &antenna_status.shm);
-    visualisation_init();
+    visualisation_init(&osd_rt);
     if (start_server(tcp_port, pipe_fds[0], &data) != 0)
         run = 0;
     pthread_join(reader_thread, NULL);
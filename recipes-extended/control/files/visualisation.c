@@ -17,6 +17,7 @@
 #include "common.h"
 #include "utils.h"
 #include "config.h"
+#include "rtsched.h"
 
 static volatile int run;
 
@@ -47,7 +48,7 @@ static void draw_text(cairo_t *cr, const char *text, double *y, int inverted)
     cairo_show_text(cr, text);
 }
 
-static void *thread(void *arg MAYBE_UNUSED)
+static void *thread(void *arg)
 {
     int fbfd = 0;
     struct fb_var_screeninfo vinfo;
@@ -62,6 +63,7 @@ static void *thread(void *arg MAYBE_UNUSED)
     uint64_t timestamp = 0;
     static uint64_t last_flag_timestamp = 0;
 
+    rt_setup_thread((const struct rt_config *)arg, "OSD");
     // open the frame buffer file for reading & writing
     fbfd = open ( "/dev/fb0", O_RDWR );
     if (!fbfd) {
@@ -255,12 +257,12 @@ static void *thread(void *arg MAYBE_UNUSED)
     return NULL;
 }
 
-int visualisation_init(void)
+int visualisation_init(const struct rt_config *rt)
 {
     int ret;
 
     run = 1;
-    ret = pthread_create(&pthread, NULL, thread,NULL);
+    ret = pthread_create(&pthread, NULL, thread, (void *)rt);
     if (ret) {
         fprintf(stderr, "pthread_create error %d\n", ret);
         run = 0;
@@ -25,7 +25,10 @@
 #define M_PI        3.14159265358979323846
 #endif
 
-int visualisation_init(void);
+struct rt_config;
+
+/* rt is the scheduling of the drawing thread, it has to stay valid while the thread runs */
+int visualisation_init(const struct rt_config *rt);
 void visualisation_stop(void);
 
 #endif // _VISUALISATION_H_INCLUDED
@@ -17,6 +17,7 @@
 #include "shmem.h"
 #include "utils.h"
 #include "crsf_protocol.h"
+#include "rtsched.h"
 
 #define UART_DEVICE "/dev/ttyS0"
 #define BAUD_RATE 115200
@@ -80,6 +81,10 @@ void help()
     printf("  -t, --tx mode             Enable TX mode\n");
     printf("  -v, --verbose             Increase verbosity level (can be used multiple times)\n");
     printf("  -d, --diag                Output diagnostic data (packet counters)\n");
+    printf("  -r, --rt <spec>           Scheduling of the poll loop, e.g. fifo=70,cpus=0,mlock,stack=64k:\n");
+    printf("                            fifo=<priority> or other=<nice>, cpus=<list> ('+' separated),\n");
+    printf("                            mlock, stack=<bytes> to prefault, jitter to measure the wakeup\n");
+    printf("                            latency (default: inherited)\n");
     printf("  -h, --help                Show this help message\n");
     printf("  -V, --version             Show version information\n");
 }
@@ -542,6 +547,7 @@ int main(int argc, char *argv[])
     int baud_rate = BAUD_RATE;
     int ret;
     uint8_t *cbuffers;
+    struct rt_config rt;
 
     static struct option long_options[] = {
         {"uart", required_argument, NULL, 'u'},
@@ -549,6 +555,7 @@ int main(int argc, char *argv[])
         {"tcp-port", required_argument, NULL, 'p'},
         {"tx mode", no_argument, NULL, 't'},
         {"diag", no_argument, NULL, 'd'},
+        {"rt", required_argument, NULL, 'r'},
         {"help", no_argument, NULL, 'h'},
         {"version", no_argument, NULL, 'V'},
         {"verbose", no_argument, NULL, 'v'},
@@ -556,7 +563,8 @@ int main(int argc, char *argv[])
     };
     int long_index = 0;
     strncpy(uart_device, UART_DEVICE, sizeof(uart_device) - 1);
-    while ((opt = getopt_long(argc, argv, "vVhu:p:b:td", long_options, &long_index)) != -1) {
+    rt_config_init(&rt);
+    while ((opt = getopt_long(argc, argv, "vVhu:p:b:tdr:", long_options, &long_index)) != -1) {
         switch (opt) {
             case 'V':
                 printf("Version %s\n", VERSION);
@@ -582,6 +590,10 @@ int main(int argc, char *argv[])
                 baud_rate = atoi(optarg);
                 printf("Baud rate set to: %d\n", baud_rate);
                 break;
+            case 'r': // Scheduling of the poll loop
+                if (rt_config_parse(&rt, optarg))
+                    return 1;
+                break;
             case 't': // TX mode
                 tx_mode = 1;
                 printf("TX mode enabled.\n");
@@ -625,6 +637,8 @@ int main(int argc, char *argv[])
     }
     signal(SIGINT, sigint_handler);
     run = 1;
+    // After the buffers are allocated, so mlock covers them
+    rt_setup_thread(&rt, "poll loop");
     ret = main_loop(peer_ip, udp_port, uart_fd);
     printf("Exiting...\n");
     if (tx_mode)
@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "frame_ring.h"
+
+#define FRAME_RING_MAGIC 0x474e5246     // "FRNG"
+#define FRAME_RING_VERSION 1
+// Attempts to copy a frame before the reader gives up on a writer lapping it
+#define READ_TRIES 4
+#define ALIGN(x) (((x) + 63) & ~(size_t)63)
+
+struct ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t futex;             // Bumped for every frame, readers wait on it
+    uint32_t closed;            // Set by the writer before it removes the ring
+    uint64_t frame;             // Newest complete frame, 0 before the first one
+};
+
+struct ring_slot {
+    uint32_t seq;               // Odd while the writer is in the slot
+    uint32_t size;
+    uint64_t frame;
+    uint64_t timestamp;
+    struct frame_ring_format format;
+    // slot_size bytes of frame data follow
+};
+
+struct frame_ring {
+    int fd;
+    void *map;
+    size_t map_size;
+    struct ring_header *header;
+    char *name;                 // Writer only, to remove the ring
+};
+
+static size_t slot_stride(uint32_t slot_size)
+{
+    return ALIGN(sizeof(struct ring_slot) + slot_size);
+}
+
+static struct ring_slot *slot_at(const struct frame_ring *ring, uint64_t frame)
+{
+    const struct ring_header *header = ring->header;
+
+    return (struct ring_slot *)((char *)ring->map + ALIGN(sizeof(*header)) +
+                                (frame % header->slots) * slot_stride(header->slot_size));
+}
+
+static struct frame_ring *map_ring(int fd, size_t size, int prot)
+{
+    struct frame_ring *ring;
+    void *addr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        perror("calloc");
+        munmap(addr, size);
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->map = addr;
+    ring->map_size = size;
+    ring->header = addr;
+    return ring;
+}
+
+struct frame_ring *frame_ring_create(const char *name, uint32_t slots, uint32_t slot_size)
+{
+    struct frame_ring *ring;
+    size_t size = ALIGN(sizeof(struct ring_header)) + slots * slot_stride(slot_size);
+    int fd;
+
+    if (!slots)
+        return NULL;
+    // Readers of a previous ring keep their mapping, new ones get this one
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("shm_open");
+        return NULL;
+    }
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    ring = map_ring(fd, size, PROT_READ | PROT_WRITE);
+    if (!ring) {
+        shm_unlink(name);
+        return NULL;
+    }
+    ring->name = strdup(name);
+    if (!ring->name) {
+        perror("strdup");
+        frame_ring_close(ring);
+        shm_unlink(name);
+        return NULL;
+    }
+    ring->header->version = FRAME_RING_VERSION;
+    ring->header->slots = slots;
+    ring->header->slot_size = slot_size;
+    __atomic_store_n(&ring->header->magic, FRAME_RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+int frame_ring_publish(struct frame_ring *ring, const void *data, uint32_t size, uint64_t timestamp,
+                       const struct frame_ring_format *format)
+{
+    struct ring_header *header = ring->header;
+    uint64_t frame = header->frame + 1;
+    struct ring_slot *slot = slot_at(ring, frame);
+    uint32_t seq = slot->seq;
+
+    if (size > header->slot_size)
+        return -1;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->size = size;
+    slot->frame = frame;
+    slot->timestamp = timestamp;
+    slot->format = *format;
+    memcpy(slot + 1, data, size);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->frame, frame, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->futex, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    return 0;
+}
+
+void frame_ring_destroy(struct frame_ring *ring)
+{
+    if (!ring)
+        return;
+    if (ring->name) {
+        struct ring_header *header = ring->header;
+
+        __atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&header->futex, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        shm_unlink(ring->name);
+        free(ring->name);
+    }
+    frame_ring_close(ring);
+}
+
+struct frame_ring *frame_ring_open(const char *name)
+{
+    struct frame_ring *ring;
+    struct ring_header *header;
+    struct stat st;
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < ALIGN(sizeof(*header))) {
+        close(fd);
+        return NULL;
+    }
+    ring = map_ring(fd, st.st_size, PROT_READ);
+    if (!ring)
+        return NULL;
+    header = ring->header;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != FRAME_RING_MAGIC ||
+        header->version != FRAME_RING_VERSION || !header->slots ||
+        ALIGN(sizeof(*header)) + header->slots * slot_stride(header->slot_size) > ring->map_size) {
+        fprintf(stderr, "%s is not a frame ring\n", name);
+        frame_ring_close(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+uint64_t frame_ring_wait(struct frame_ring *ring, uint64_t last, int timeout_ms)
+{
+    struct ring_header *header = ring->header;
+    struct timespec now, deadline, left;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    for (;;) {
+        // The futex first: a frame published after the check changes it and the wait returns at once
+        uint32_t futex = __atomic_load_n(&header->futex, __ATOMIC_ACQUIRE);
+        uint64_t frame = __atomic_load_n(&header->frame, __ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+            return UINT64_MAX;
+        if (frame != last)
+            return frame;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = deadline.tv_sec - now.tv_sec;
+            left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (left.tv_nsec < 0) {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000L;
+            }
+            if (left.tv_sec < 0)
+                return 0;
+        }
+        if (syscall(SYS_futex, &header->futex, FUTEX_WAIT, futex, timeout_ms >= 0 ? &left : NULL, NULL, 0) == -1 &&
+            errno == ETIMEDOUT)
+            return 0;
+    }
+}
+
+int frame_ring_read(struct frame_ring *ring, void *buf, size_t len, struct frame_ring_info *info)
+{
+    struct ring_header *header = ring->header;
+
+    for (int i = 0; i < READ_TRIES; i++) {
+        uint64_t frame = __atomic_load_n(&header->frame, __ATOMIC_ACQUIRE);
+        struct ring_slot *slot;
+        uint32_t seq;
+
+        if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+            return FRAME_RING_CLOSED;
+        if (!frame)
+            return 0;
+        slot = slot_at(ring, frame);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        info->frame = slot->frame;
+        info->timestamp = slot->timestamp;
+        info->size = slot->size;
+        info->format = slot->format;
+        if (info->frame != frame || info->size > header->slot_size)
+            continue;
+        if (info->size > len)
+            return -1;
+        memcpy(buf, slot + 1, info->size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            return info->size;
+    }
+    return -1;
+}
+
+uint32_t frame_ring_slot_size(const struct frame_ring *ring)
+{
+    return ring->header->slot_size;
+}
+
+void frame_ring_close(struct frame_ring *ring)
+{
+    if (!ring)
+        return;
+    munmap(ring->map, ring->map_size);
+    close(ring->fd);
+    free(ring);
+}
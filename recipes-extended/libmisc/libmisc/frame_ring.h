@@ -0,0 +1,78 @@
+#ifndef _FRAME_RING_H_INCLUDED
+#define _FRAME_RING_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Raw video frames in POSIX shared memory, one writer and any number of
+ * readers. The writer overwrites the oldest slot and never waits for
+ * anybody; readers map the ring read-only, copy a frame out and check the
+ * slot's sequence count afterwards to see whether it was overwritten
+ * meanwhile. A reader which falls behind just misses frames.
+ *
+ * Readers sleep on a futex in the header which the writer bumps for every
+ * frame. A writer which needs larger slots destroys the ring and creates a
+ * new one under the same name; it marks the old one closed first, so its
+ * readers wake up and know to reopen.
+ */
+
+#define DEFAULT_FRAME_RING_NAME "/video_frames"
+#define FRAME_RING_MAX_PLANES 4
+// frame_ring_read() result once the writer has closed the ring
+#define FRAME_RING_CLOSED (-2)
+
+/* Layout of the frame in a slot */
+struct frame_ring_format {
+    uint32_t fourcc;            // V4L2/GStreamer fourcc, e.g. NV12, I420, UYVY
+    uint32_t width, height;
+    uint32_t planes;
+    uint32_t offset[FRAME_RING_MAX_PLANES];
+    uint32_t stride[FRAME_RING_MAX_PLANES];
+};
+
+/* What came with a frame read from the ring */
+struct frame_ring_info {
+    uint64_t frame;             // Counts up from 1, gaps are frames the reader missed
+    uint64_t timestamp;         // CLOCK_MONOTONIC, ns
+    uint32_t size;              // bytes
+    struct frame_ring_format format;
+};
+
+struct frame_ring;
+
+/* Writer: create the ring with the given number of slots of slot_size bytes each */
+struct frame_ring *frame_ring_create(const char *name, uint32_t slots, uint32_t slot_size);
+/* Copy a frame to the next slot and wake the readers. Returns -1 if it is larger than a slot */
+int frame_ring_publish(struct frame_ring *ring, const void *data, uint32_t size, uint64_t timestamp,
+                       const struct frame_ring_format *format);
+/* Writer: mark the ring closed, wake the readers, unmap and remove it */
+void frame_ring_destroy(struct frame_ring *ring);
+
+/* Reader: map an existing ring read-only */
+struct frame_ring *frame_ring_open(const char *name);
+/*
+ * Wait until a frame newer than last was published, timeout in ms, -1
+ * waits forever. Returns the newest frame number, 0 on timeout, or
+ * UINT64_MAX once the writer has closed the ring.
+ */
+uint64_t frame_ring_wait(struct frame_ring *ring, uint64_t last, int timeout_ms);
+/*
+ * Copy the newest frame into buf. Returns its size, 0 if there is none
+ * yet, -1 if buf is too small or the writer kept overwriting it, and
+ * FRAME_RING_CLOSED if the writer has closed the ring. Open it again then,
+ * the writer may have created a new one.
+ */
+int frame_ring_read(struct frame_ring *ring, void *buf, size_t len, struct frame_ring_info *info);
+uint32_t frame_ring_slot_size(const struct frame_ring *ring);
+void frame_ring_close(struct frame_ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _FRAME_RING_H_INCLUDED
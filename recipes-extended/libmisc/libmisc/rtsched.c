@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <alloca.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "rtsched.h"
+
+// Jitter measured by rt_setup_thread() on request: 200 wakeups 1 ms apart
+#define JITTER_PERIOD_US 1000
+#define JITTER_LOOPS 200
+#define STACK_PAGE 4096
+
+void rt_config_init(struct rt_config *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->policy = SCHED_OTHER;
+}
+
+static int parse_cpus(const char *list, uint64_t *cpus)
+{
+    char *copy = strdup(list);
+    char *save = NULL;
+    int ret = 0;
+
+    *cpus = 0;
+    if (!copy)
+        return -1;
+    for (char *part = strtok_r(copy, "+", &save); part && !ret; part = strtok_r(NULL, "+", &save)) {
+        char *end;
+        long first = strtol(part, &end, 10);
+        long last = first;
+
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        if (end == part || *end || first < 0 || first > last || last >= 64) {
+            ret = -1;
+            break;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+            *cpus |= 1ULL << cpu;
+    }
+    free(copy);
+    return ret || !*cpus ? -1 : 0;
+}
+
+static long parse_size(const char *value)
+{
+    char *end;
+    long size = strtol(value, &end, 10);
+
+    if (*end == 'k' || *end == 'K') {
+        size *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        size *= 1024 * 1024;
+        end++;
+    }
+    return end == value || *end || size < 0 ? -1 : size;
+}
+
+int rt_config_parse(struct rt_config *config, const char *spec)
+{
+    char *copy = strdup(spec);
+    char *save = NULL;
+    int ret = 0;
+
+    if (!copy) {
+        perror("strdup");
+        return -1;
+    }
+    // CPU lists use '+' inside the spec so the commas stay unambiguous: cpus=0+2-3
+    for (char *item = strtok_r(copy, ",", &save); item && !ret; item = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(item, '=');
+        long size;
+
+        if (value)
+            *value++ = '\0';
+        if (!strcmp(item, "fifo") && value) {
+            config->policy = SCHED_FIFO;
+            config->priority = atoi(value);
+            config->set_policy = 1;
+            if (config->priority < sched_get_priority_min(SCHED_FIFO) ||
+                config->priority > sched_get_priority_max(SCHED_FIFO))
+                ret = -1;
+        } else if (!strcmp(item, "other") && value) {
+            config->policy = SCHED_OTHER;
+            config->priority = atoi(value);
+            config->set_policy = 1;
+        } else if (!strcmp(item, "cpus") && value) {
+            ret = parse_cpus(value, &config->cpus);
+        } else if (!strcmp(item, "mlock") && !value) {
+            config->lock_memory = 1;
+        } else if (!strcmp(item, "stack") && value && (size = parse_size(value)) >= 0) {
+            config->prefault_stack = size;
+        } else if (!strcmp(item, "jitter") && !value) {
+            config->measure_jitter = 1;
+        } else {
+            ret = -1;
+        }
+    }
+    free(copy);
+    if (ret)
+        fprintf(stderr, "Bad scheduling spec %s\n", spec);
+    return ret;
+}
+
+/* Touch the stack pages the thread is going to use, so they don't fault later */
+static void prefault_stack(size_t size)
+{
+    volatile unsigned char *stack = alloca(size);
+
+    for (size_t i = 0; i < size; i += STACK_PAGE)
+        stack[i] = 0;
+}
+
+/*
+ * mlockall() covers the whole process, not only the calling thread. With
+ * MCL_ONFAULT the pages are locked as they are touched instead of all at
+ * once, so the reserved stacks of the other threads and large buffers
+ * mapped later don't take up RAM until they are used.
+ */
+static int lock_memory(void)
+{
+#ifdef MCL_ONFAULT
+    if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == 0)
+        return 0;
+    // Kernels before 4.4 reject the flag
+    if (errno != EINVAL)
+        return -1;
+#endif
+    return mlockall(MCL_CURRENT | MCL_FUTURE);
+}
+
+int rt_apply(const struct rt_config *config, const char *name)
+{
+    int ret = 0;
+    int err;
+
+    if (config->lock_memory && lock_memory() == -1) {
+        fprintf(stderr, "%s: mlockall: %s\n", name, strerror(errno));
+        ret = -1;
+    }
+    if (config->prefault_stack)
+        prefault_stack(config->prefault_stack);
+    if (config->cpus) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; cpu++)
+            if (config->cpus & (1ULL << cpu))
+                CPU_SET(cpu, &cpus);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err) {
+            fprintf(stderr, "%s: CPU affinity: %s\n", name, strerror(err));
+            ret = -1;
+        }
+    }
+    if (config->set_policy) {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        if (config->policy == SCHED_FIFO)
+            param.sched_priority = config->priority;
+        err = pthread_setschedparam(pthread_self(), config->policy, &param);
+        if (err) {
+            fprintf(stderr, "%s: scheduling policy: %s\n", name, strerror(err));
+            ret = -1;
+        }
+        // The nice value is per thread on Linux
+        if (config->policy == SCHED_OTHER &&
+            setpriority(PRIO_PROCESS, syscall(SYS_gettid), config->priority) == -1) {
+            fprintf(stderr, "%s: nice: %s\n", name, strerror(errno));
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+void rt_measure_jitter(unsigned int period_us, unsigned int loops, struct rt_jitter *jitter)
+{
+    struct timespec next, now;
+    uint64_t sum = 0;
+
+    memset(jitter, 0, sizeof(*jitter));
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (unsigned int i = 0; i < loops; i++) {
+        int64_t late;
+
+        next.tv_nsec += period_us * 1000L;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL))
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        late = ((int64_t)(now.tv_sec - next.tv_sec) * 1000000000LL + now.tv_nsec - next.tv_nsec) / 1000;
+        if (late < 0)
+            late = 0;
+        sum += late;
+        if (late > jitter->max)
+            jitter->max = late;
+        jitter->count++;
+    }
+    jitter->avg = jitter->count ? sum / jitter->count : 0;
+}
+
+int rt_setup_thread(const struct rt_config *config, const char *name)
+{
+    struct rt_jitter jitter;
+    char measured[64] = "";
+    int ret;
+
+    if (!config->set_policy && !config->cpus && !config->lock_memory && !config->prefault_stack &&
+        !config->measure_jitter)
+        return 0;
+    ret = rt_apply(config, name);
+    if (config->measure_jitter) {
+        rt_measure_jitter(JITTER_PERIOD_US, JITTER_LOOPS, &jitter);
+        snprintf(measured, sizeof(measured), ", wakeup jitter avg %u us max %u us", jitter.avg, jitter.max);
+    }
+    printf("%s: %s %d, %d CPUs%s%s\n", name, config->policy == SCHED_FIFO ? "fifo" : "other", config->priority,
+           config->cpus ? __builtin_popcountll(config->cpus) : (int)sysconf(_SC_NPROCESSORS_ONLN),
+           config->lock_memory ? ", memory locked" : "", measured);
+    return ret;
+}
@@ -0,0 +1,57 @@
+#ifndef _RTSCHED_H_INCLUDED
+#define _RTSCHED_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Scheduling of one thread: policy and priority, CPU affinity, memory
+ * locking and stack prefaulting. Given on the command line as a comma
+ * separated list, e.g. "fifo=60,cpus=1,mlock,stack=256k":
+ *
+ *   fifo=<1..99>      SCHED_FIFO with the priority
+ *   other=<nice>      SCHED_OTHER with the nice value of the thread
+ *   cpus=<list>       CPUs 0..63 the thread may run on, '+' separated, e.g. 0+2-3
+ *   mlock             Lock the memory of the whole process, every thread,
+ *                     as it is touched (MCL_ONFAULT where the kernel has it)
+ *   stack=<bytes>     Touch this much stack up front, k and M suffixes work
+ *   jitter            Measure the wakeup latency once set up, takes 200 ms
+ */
+struct rt_config {
+    int policy;                 // SCHED_OTHER or SCHED_FIFO from <sched.h>
+    int priority;               // SCHED_FIFO priority or SCHED_OTHER nice value
+    int set_policy;             // Policy given, otherwise it is left alone
+    uint64_t cpus;              // Bit per CPU, 0 leaves the affinity alone
+    int lock_memory;
+    size_t prefault_stack;
+    int measure_jitter;
+};
+
+/* Wakeup latency of a thread: how late its timer wakeups were, in us */
+struct rt_jitter {
+    unsigned int count;
+    unsigned int avg, max;
+};
+
+void rt_config_init(struct rt_config *config);
+/* Returns -1 on a bad spec */
+int rt_config_parse(struct rt_config *config, const char *spec);
+/* Apply to the calling thread, name is for the messages. Returns -1 if a part failed */
+int rt_apply(const struct rt_config *config, const char *name);
+/* Sleep loops times for period_us on absolute deadlines and measure how late the wakeups were */
+void rt_measure_jitter(unsigned int period_us, unsigned int loops, struct rt_jitter *jitter);
+/*
+ * rt_apply() and, if the spec asks for it, a short jitter measurement, both
+ * reported on stdout. Does nothing without a spec.
+ */
+int rt_setup_thread(const struct rt_config *config, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _RTSCHED_H_INCLUDED
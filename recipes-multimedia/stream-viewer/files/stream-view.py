@@ -5,8 +5,13 @@ Simple GStreamer RTP Stream Viewer with Recording (Command Line Version)
 This application receives an RTP stream and displays it on screen.
 Press Ctrl+C to quit, or send SIGUSR1 to toggle recording.
 
+RTCP runs on the next port. Receiver reports go back to the sender given
+with --sender, which uses them to adapt the bitrate. Lost packets and
+decode errors send a PLI, so the picture recovers with the next key frame.
+With --fec, ULPFEC packets from the sender repair lost packets first.
+
 Usage:
-    python3 rtp_viewer_cli.py --port 5600 --payload 96
+    python3 rtp_viewer_cli.py --port 5600 --payload 96 --sender 192.168.1.10
 """
 
 import gi
@@ -23,6 +28,13 @@ from gi.repository import Gst, GObject, GLib
 PID_FILE_PATH = "/tmp/stream-viewer.pid"
 MOUNT_HELPER_PATH = "/sys/kernel/mount_helper/mount_point"
 SHARED_NAME = "/dev/shm/channel_data"
+RTCP_INTERVAL_MS = 500
+# Own key frame requests, at most once per this interval
+KEYFRAME_REQUEST_MS = 200
+# FEC packets come after the packets they protect, the jitter buffer has to wait for them
+FEC_LATENCY_MS = 50
+FEC_STORAGE_MS = 250
+STATS_INTERVAL_S = 10
 
 class GstElementError(Exception):
     def __init__(self, plugin):
@@ -30,19 +42,24 @@ class GstElementError(Exception):
         super().__init__(f'No such element or plugin "{plugin}"')
 
 class RTPStreamViewerCLI:
-    def __init__(self, port=5600, payload_type=96, codec='H264'):
+    def __init__(self, port=5600, payload_type=96, codec='H264', sender=None, latency=0, fec_pt=0):
         Gst.init(None)
         GObject.threads_init()
 
         self.port = port
         self.payload_type = payload_type
         self.codec = codec
+        self.sender = sender
+        self.latency = latency
+        self.fec_pt = fec_pt
+        self.fec_decoder = None
         self.is_recording = False
         self.pipeline = None
         self.tee = None
         self.record_elements = []
         self.main_loop = None
         self.bus_id = None
+        self.last_keyframe_request = 0
         shm_fd = os.open(SHARED_NAME, os.O_RDWR)
         self.shared_buffer = mmap.mmap(shm_fd, 2048)
         os.close(shm_fd)
@@ -83,8 +100,29 @@ class RTPStreamViewerCLI:
         # RTP receiver elements
         self.udpsrc = self.make_element("udpsrc", "udp-source")
         self.udpsrc.set_property("port", self.port)
-        self.udpsrc.set_property("caps", 
-            Gst.Caps.from_string(f"application/x-rtp,payload={self.payload_type}"))
+        self.udpsrc.set_property("caps",
+            Gst.Caps.from_string(f"application/x-rtp,media=video,clock-rate=90000,"
+                                 f"encoding-name={self.codec.upper()},payload={self.payload_type}"))
+
+        # RTP session: receiver reports to the sender, the jitter buffer tracks loss
+        self.rtpbin = self.make_element("rtpbin", "rtpbin")
+        self.rtpbin.set_property("latency", max(self.latency, FEC_LATENCY_MS) if self.fec_pt else self.latency)
+        self.rtpbin.set_property("do-lost", True)
+        self.rtpbin.connect("request-pt-map", self.on_request_pt_map)
+        if self.fec_pt:
+            self.rtpbin.connect("request-fec-decoder", self.on_request_fec_decoder)
+        Gst.util_set_object_arg(self.rtpbin, "rtp-profile", "avpf")
+        self.rtpbin.connect("pad-added", self.on_rtpbin_pad_added)
+        self.rtcp_src = self.make_element("udpsrc", "rtcp-source")
+        self.rtcp_src.set_property("port", self.port + 1)
+        self.rtcp_src.set_property("caps", Gst.Caps.from_string("application/x-rtcp"))
+        self.rtcp_sink = None
+        if self.sender:
+            self.rtcp_sink = self.make_element("udpsink", "rtcp-sink")
+            self.rtcp_sink.set_property("host", self.sender)
+            self.rtcp_sink.set_property("port", self.port + 1)
+            self.rtcp_sink.set_property("sync", False)
+            self.rtcp_sink.set_property("async", False)
 
         # RTP depayloader (adjust based on codec)
         if self.codec.upper() == 'H264':
@@ -98,6 +136,14 @@ class RTPStreamViewerCLI:
         else:
             print(f"Unsupported codec: {self.codec}")
             sys.exit(1)
+        # Ask for a key frame when packets are lost, rtpbin sends it as PLI
+        if self.rtpdepay.find_property("request-keyframe"):
+            self.rtpdepay.set_property("request-keyframe", True)
+        if self.rtpdepay.find_property("wait-for-keyframe"):
+            self.rtpdepay.set_property("wait-for-keyframe", True)
+        # Decode errors are reported as warnings and handled here
+        if self.decoder.find_property("max-errors"):
+            self.decoder.set_property("max-errors", -1)
 
         # Tee for splitting stream
         self.tee = self.make_element("tee", "tee")
@@ -117,10 +163,12 @@ class RTPStreamViewerCLI:
         self.videosink.set_property("x-offset", 0)
         # Add elements to pipeline
         elements = [
-            self.udpsrc, self.rtpdepay, self.parser, self.decoder,
-            self.tee, self.queue_display, self.videoconvert, 
+            self.udpsrc, self.rtpbin, self.rtcp_src, self.rtpdepay, self.parser, self.decoder,
+            self.tee, self.queue_display, self.videoconvert,
             self.videosink
         ]
+        if self.rtcp_sink:
+            elements.append(self.rtcp_sink)
 
         for element in elements:
             if not element:
@@ -128,10 +176,19 @@ class RTPStreamViewerCLI:
                 sys.exit(1)
             self.pipeline.add(element)
 
-        # Link main display chain
-        if not self.udpsrc.link(self.rtpdepay):
-            print("Could not link udpsrc to rtpdepay")
+        # Link main display chain, rtpdepay is linked once rtpbin sees the stream
+        if not self.udpsrc.link_pads("src", self.rtpbin, "recv_rtp_sink_0"):
+            print("Could not link udpsrc to rtpbin")
+            sys.exit(1)
+        if not self.rtcp_src.link_pads("src", self.rtpbin, "recv_rtcp_sink_0"):
+            print("Could not link rtcp-source to rtpbin")
             sys.exit(1)
+        if self.rtcp_sink and not self.rtpbin.link_pads("send_rtcp_src_0", self.rtcp_sink, "sink"):
+            print("Could not link rtpbin to rtcp-sink")
+            sys.exit(1)
+        session = self.rtpbin.emit("get-internal-session", 0)
+        if session:
+            session.set_property("rtcp-min-interval", RTCP_INTERVAL_MS * Gst.MSECOND)
         if not self.rtpdepay.link(self.parser):
             print("Could not link rtpdepay to parser")
             sys.exit(1)
@@ -163,6 +220,52 @@ class RTPStreamViewerCLI:
         self.bus_id = bus.add_signal_watch()
         bus.connect("message", self.on_message)
 
+    def on_request_pt_map(self, rtpbin, session, pt):
+        """Caps of the payload types in the session"""
+        if pt == self.payload_type:
+            return Gst.Caps.from_string(f"application/x-rtp,media=video,clock-rate=90000,"
+                                        f"encoding-name={self.codec.upper()},payload={pt}")
+        if self.fec_pt and pt == self.fec_pt:
+            return Gst.Caps.from_string(f"application/x-rtp,media=video,clock-rate=90000,payload={pt}")
+        return None
+
+    def on_request_fec_decoder(self, rtpbin, session):
+        """ULPFEC decoder, it recovers packets from those kept in the session storage"""
+        storage = rtpbin.emit("get-storage", session)
+        storage.set_property("size-time", FEC_STORAGE_MS * Gst.MSECOND)
+        self.fec_decoder = self.make_element("rtpulpfecdec", "fec-decoder")
+        self.fec_decoder.set_property("storage", storage)
+        self.fec_decoder.set_property("pt", self.fec_pt)
+        return self.fec_decoder
+
+    def print_stats(self):
+        """Packets repaired by FEC and those it could not repair"""
+        if self.fec_decoder:
+            print(f"fec: recovered {self.fec_decoder.get_property('recovered')} "
+                  f"unrecovered {self.fec_decoder.get_property('unrecovered')}")
+        return True
+
+    def on_rtpbin_pad_added(self, rtpbin, pad):
+        """Link the received stream to the depayloader"""
+        if not pad.get_name().startswith("recv_rtp_src_"):
+            return
+        sink_pad = self.rtpdepay.get_static_pad("sink")
+        if sink_pad.is_linked():
+            # New SSRC after the sender restarted
+            sink_pad.get_peer().unlink(sink_pad)
+        if pad.link(sink_pad) != Gst.PadLinkReturn.OK:
+            print("Could not link rtpbin to rtpdepay")
+
+    def request_keyframe(self):
+        """Send a key frame request upstream to rtpbin, which turns it into PLI"""
+        now = GLib.get_monotonic_time()
+        if now - self.last_keyframe_request < KEYFRAME_REQUEST_MS * 1000:
+            return
+        self.last_keyframe_request = now
+        event = Gst.Event.new_custom(Gst.EventType.CUSTOM_UPSTREAM,
+                                     Gst.Structure.new_from_string("GstForceKeyUnit, all-headers=(boolean)true"))
+        self.rtpdepay.get_static_pad("sink").push_event(event)
+
     def toggle_recording(self):
         """Toggle recording on/off"""
         if not self.is_recording:
@@ -275,6 +378,12 @@ class RTPStreamViewerCLI:
             source_name = message.src.get_name() if message.src else "unknown"
             if source_name == 'file-sink':
                 self.stop_recording()
+            elif source_name == 'decoder':
+                self.request_keyframe()
+        elif t == Gst.MessageType.WARNING:
+            source_name = message.src.get_name() if message.src else "unknown"
+            if source_name == 'decoder':
+                self.request_keyframe()
 
     def run(self):
         """Start the application"""
@@ -290,6 +399,9 @@ class RTPStreamViewerCLI:
             print("Unable to set pipeline to playing state")
             sys.exit(1)
 
+        if self.fec_pt:
+            GLib.timeout_add_seconds(STATS_INTERVAL_S, self.print_stats)
+
         # Create and run main loop
         self.main_loop = GLib.MainLoop()
         try:
@@ -310,10 +422,16 @@ def main():
     parser.add_argument('--port', type=int, default=5600, help='UDP port to listen on (default: 5600)')
     parser.add_argument('--payload', type=int, default=96, help='RTP payload type (default: 96)')
     parser.add_argument('--codec', default='H264', choices=['H264', 'H265'], help='Video codec (default: H264)')
+    parser.add_argument('--sender', help='Address to send RTCP receiver reports to (default: none)')
+    parser.add_argument('--latency', type=int, default=0, help='Jitter buffer latency in ms (default: 0)')
+    parser.add_argument('--fec', type=int, default=0, metavar='PT',
+                        help=f'Payload type of ULPFEC packets, 0 disables FEC (default: 0, '
+                             f'video-streamer sends 122); latency is at least {FEC_LATENCY_MS} ms with FEC')
 
     args = parser.parse_args()
 
-    viewer = RTPStreamViewerCLI(port=args.port, payload_type=args.payload, codec=args.codec)
+    viewer = RTPStreamViewerCLI(port=args.port, payload_type=args.payload, codec=args.codec,
+                                sender=args.sender, latency=args.latency, fec_pt=args.fec)
     viewer.run()
 
 if __name__ == '__main__':
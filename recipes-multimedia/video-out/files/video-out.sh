@@ -2,9 +2,23 @@
 
 PORT=$1
 PORT=${PORT:-5600}
+# Payload type of ULPFEC packets, empty or 0 without FEC
+FEC_PT=$2
 
 echo "gst-launch running on port $PORT"
 
+if [ -n "$FEC_PT" ] && [ "$FEC_PT" != "0" ]; then
+    # The jitter buffer waits for the FEC packets that follow the packets they protect
+    gst-launch-1.0 -v udpsrc port=$PORT caps="application/x-rtp, media=video, clock-rate=90000, payload=96" ! \
+        rtpstorage size-time=250000000 ! rtpssrcdemux ! \
+        "application/x-rtp, media=video, clock-rate=90000, encoding-name=H264, payload=96" ! \
+        rtpjitterbuffer do-lost=true latency=50 ! rtpulpfecdec pt=$FEC_PT ! \
+        rtph264depay ! queue ! avdec_h264 ! \
+        videoconvert ! queue ! \
+        fbdevsink
+    exit $?
+fi
+
 gst-launch-1.0 -v udpsrc port=$PORT caps="application/x-rtp, media=video, encoding-name=H264, payload=96" ! \
     rtph264depay ! queue ! avdec_h264 ! \
     videoconvert ! queue ! \
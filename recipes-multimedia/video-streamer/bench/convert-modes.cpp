@@ -0,0 +1,122 @@
+/*
+ * Conversion cost of the output modes on a synthetic PAL UYVY frame, without
+ * capture or encoder: frames and both field modes, whole or with an overscan
+ * crop, at full and half scale. Prints us per output buffer, a field being
+ * one buffer, comparable with the convert cpu of the stats. The fastest of a
+ * few rounds is taken, the others lost time to the rest of the system.
+ *
+ * Build and run on the target, or natively for a comparison:
+ *   g++ -O2 -I../video-streamer convert-modes.cpp ../video-streamer/convert.cpp -o convert-modes
+ *   ./convert-modes [buffers]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "convert.h"
+
+#define WIDTH 720
+#define HEIGHT 576
+// Typical overscan crop: 8 pixels each side, 16 lines top and bottom
+#define CROP_LEFT 8
+#define CROP_TOP 16
+#define CROP_WIDTH 704
+#define CROP_HEIGHT 544
+#define ROUNDS 5
+
+/* Output modes of the convert stage, as --field-mode, --scale and --crop set them */
+struct mode {
+    const char *name;
+    int fields;                 // 0 frames, 1 bob (line-doubled fields), 2 half-height fields
+    int half;                   // --scale half
+    int crop;
+};
+
+static const struct mode modes[] = {
+    {"frame", 0, 0, 0},
+    {"frame crop", 0, 0, 1},
+    {"frame half", 0, 1, 0},
+    {"frame crop half", 0, 1, 1},
+    {"bob", 1, 0, 0},
+    {"bob crop", 1, 0, 1},
+    {"bob half", 1, 1, 0},
+    {"bob crop half", 1, 1, 1},
+    {"field", 2, 0, 0},
+    {"field crop", 2, 0, 1},
+    {"field half", 2, 1, 0},
+    {"field crop half", 2, 1, 1},
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* One output buffer, the same calls convert_to_pool() makes. Parity picks the field */
+static void convert_buffer(const struct mode *mode, const uint8_t *frame, int parity, const struct frame_planes *dst)
+{
+    int stride = WIDTH * 2;
+    int width = mode->crop ? CROP_WIDTH : WIDTH;
+    int lines = mode->crop ? CROP_HEIGHT : HEIGHT;
+    const uint8_t *src = mode->crop ? frame + CROP_TOP * stride + CROP_LEFT * 2 : frame;
+    int double_lines = mode->fields == 1;
+
+    if (mode->fields) {
+        src += parity * stride;
+        stride *= 2;
+        lines /= 2;
+    }
+    if (mode->half)
+        convert_uyvy_half(src, stride, width, lines, !double_lines, FRAME_FORMAT_NV12, dst);
+    else if (double_lines)
+        convert_uyvy_doubled(src, stride, width, lines, FRAME_FORMAT_NV12, dst);
+    else
+        convert_uyvy(src, stride, width, lines, FRAME_FORMAT_NV12, dst);
+}
+
+int main(int argc, char *argv[])
+{
+    int buffers = argc > 1 ? atoi(argv[1]) : 500;
+    uint8_t *frame = (uint8_t *)malloc(WIDTH * 2 * HEIGHT);
+    uint8_t *luma = (uint8_t *)malloc(WIDTH * HEIGHT);
+    uint8_t *chroma = (uint8_t *)malloc(WIDTH * HEIGHT / 2);
+    struct frame_planes dst;
+
+    if (buffers <= 0 || !frame || !luma || !chroma) {
+        fprintf(stderr, "Usage: %s [buffers]\n", argv[0]);
+        return 1;
+    }
+    // Noise keeps the data from being trivially cached or predicted
+    srand(1);
+    for (int i = 0; i < WIDTH * 2 * HEIGHT; i++)
+        frame[i] = rand();
+    memset(&dst, 0, sizeof(dst));
+    dst.data[0] = luma;
+    dst.data[1] = chroma;
+    dst.stride[0] = dst.stride[1] = WIDTH;
+
+    printf("%s, %dx%d UYVY to NV12, best of %d rounds of %d buffers\n", convert_impl_name(), WIDTH, HEIGHT, ROUNDS, buffers);
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        uint64_t best = UINT64_MAX;
+
+        // One untimed buffer warms the caches
+        convert_buffer(&modes[m], frame, 0, &dst);
+        for (int round = 0; round < ROUNDS; round++) {
+            uint64_t start = now_ns();
+
+            for (int i = 0; i < buffers; i++)
+                convert_buffer(&modes[m], frame, i & 1, &dst);
+            if (now_ns() - start < best)
+                best = now_ns() - start;
+        }
+        printf("%-16s %8.1f us/buffer\n", modes[m].name, best / 1000.0 / buffers);
+    }
+    free(frame);
+    free(luma);
+    free(chroma);
+    return 0;
+}
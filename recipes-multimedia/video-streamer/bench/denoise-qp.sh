@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Bytes per frame of a recorded clip encoded by x264 at a constant
+# quantiser, without and with the temporal denoise. At an equal quantiser
+# the picture quality is about the same, so the difference is what the
+# encoder spent on coding noise.
+#
+# Usage: denoise-qp.sh <clip.uyvy> [strength] [qp]
+
+. "$(dirname "$0")/lib.sh"
+
+CLIP=$1
+STRENGTH=${2:-8}
+QP=${3:-26}
+
+if [ ! -f "$CLIP" ]; then
+    echo "Usage: $0 <clip.uyvy> [strength] [qp]"
+    exit 1
+fi
+
+for denoise in 0 $STRENGTH; do
+    dir=$OUT/denoise-$denoise
+    run_clip "$CLIP" $dir -E x264 -q $QP -N $denoise
+    frames=$(au_count $dir) || exit 1
+    bytes=$(au_bytes $dir)
+    echo "denoise $denoise, qp $QP: $frames frames, $((bytes / frames)) bytes per frame," \
+        "$((bytes * 8 * FPS / frames / 1000)) kbit/s"
+    eval mean_$denoise=$((bytes / frames))
+done
+eval mean_on=\$mean_$STRENGTH
+echo "saved at qp $QP: $(( (mean_0 - mean_on) * 100 / mean_0 ))%"
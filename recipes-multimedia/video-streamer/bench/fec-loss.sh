@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Residual loss with and without ULPFEC when the network drops packets at
+# random: the recorder drops each packet, media and parity alike, with
+# the given probability before the same recovery chain as video-out.sh.
+# A lost packet breaks its access unit, so what is missing against a run
+# without loss is the share of frames and bytes FEC could not repair.
+#
+# Usage: fec-loss.sh <clip.uyvy> [fec percent] [drop probabilities] [video-streamer options]
+
+. "$(dirname "$0")/lib.sh"
+
+CLIP=$1
+FEC=${2:-20}
+DROPS=${3:-"0.01 0.02 0.05 0.10"}
+FEC_PT=122
+STORE="rtpstorage size-time=250000000 ! rtpssrcdemux !"
+MEDIA="application/x-rtp,media=video,clock-rate=90000,encoding-name=H264,payload=96"
+
+if [ ! -f "$CLIP" ]; then
+    echo "Usage: $0 <clip.uyvy> [fec percent] [drop probabilities] [video-streamer options]"
+    exit 1
+fi
+shift $(($# < 3 ? $# : 3))
+
+dir=$OUT/fec-reference
+RECEIVE="$STORE $MEDIA ! rtpjitterbuffer do-lost=true latency=50" run_clip "$CLIP" $dir "$@"
+ref_frames=$(au_count $dir) || exit 1
+ref_bytes=$(au_bytes $dir)
+echo "no loss: $ref_frames frames, $ref_bytes bytes"
+
+for drop in $DROPS; do
+    for fec in 0 $FEC; do
+        dir=$OUT/fec-$fec-drop-$drop
+        recover=""
+        [ $fec -gt 0 ] && recover="! rtpulpfecdec pt=$FEC_PT"
+        RECEIVE="identity drop-probability=$drop ! $STORE $MEDIA ! rtpjitterbuffer do-lost=true latency=50 $recover" \
+            run_clip "$CLIP" $dir -e $fec "$@"
+        frames=$(au_count $dir) || exit 1
+        bytes=$(au_bytes $dir)
+        echo "drop $drop, fec $fec%: residual frame loss" \
+            "$(awk "BEGIN { printf \"%.2f\", 100 * (1 - $frames / $ref_frames) }")%," \
+            "byte loss $(awk "BEGIN { printf \"%.2f\", 100 * (1 - $bytes / $ref_bytes) }")%"
+    done
+done
@@ -0,0 +1,83 @@
+# Helpers of the benchmark scripts, sourced by them
+#
+# A recorded raw UYVY clip is replayed into a v4l2loopback device, which
+# video-streamer captures like the adv7180, and what arrives over UDP is
+# recorded one access unit per file:
+#   modprobe v4l2loopback video_nr=10 exclusive_caps=1
+# Needs gst-launch-1.0 with rawvideoparse, v4l2sink, rtph264depay and
+# h264parse.
+
+VIDEO_STREAMER=${VIDEO_STREAMER:-video-streamer}
+LOOPBACK=${LOOPBACK:-/dev/video10}
+PORT=${PORT:-5600}
+WIDTH=${WIDTH:-720}
+HEIGHT=${HEIGHT:-576}
+FPS=${FPS:-25}
+OUT=${OUT:-/tmp/video-bench}
+# Stages of the recorder between udpsrc and the depayloader, without spaces in caps
+RECEIVE=${RECEIVE:-rtpjitterbuffer latency=100}
+
+RTP_CAPS="application/x-rtp, media=video, clock-rate=90000, encoding-name=H264, payload=96"
+
+# Replay a clip into the loopback device in real time, in the background
+start_feeder()
+{
+    gst-launch-1.0 -q filesrc location="$1" ! \
+        rawvideoparse format=uyvy width=$WIDTH height=$HEIGHT framerate=$FPS/1 ! \
+        v4l2sink device=$LOOPBACK &
+    FEEDER=$!
+    # The loopback device has a format once the feeder runs
+    sleep 1
+}
+
+# Record the access units arriving on a port into a directory, in the background
+start_recorder()
+{
+    gst-launch-1.0 -q -e udpsrc port=$2 caps="$RTP_CAPS" ! \
+        $RECEIVE ! rtph264depay ! h264parse ! \
+        "video/x-h264, stream-format=byte-stream, alignment=au" ! \
+        multifilesink location="$1/au-%05d.h264" &
+    RECORDER=$!
+}
+
+# Stream a clip with the given video-streamer options, recorded into a directory
+run_clip()
+{
+    clip=$1
+    dir=$2
+    shift 2
+    rm -rf "$dir"
+    mkdir -p "$dir"
+    ${RECORD:-start_recorder} "$dir" ${RECORD_PORT:-$PORT}
+    start_feeder "$clip"
+    $VIDEO_STREAMER -i $LOOPBACK -s ${STATS:-0} -S "$dir.json" "$@" 127.0.0.1 $PORT > "$dir.log" 2>&1 &
+    streamer=$!
+    wait $FEEDER
+    # When it runs under a tracer, stop the traced video-streamer so the tracer reports
+    pkill -P $streamer || kill $streamer
+    wait $streamer
+    kill -INT $RECORDER
+    wait $RECORDER
+}
+
+# Access units and bytes recorded in a directory
+au_count()
+{
+    frames=$(ls "$1" | wc -l)
+    if [ $frames -eq 0 ]; then
+        echo "Nothing was received, see $1.log" >&2
+        exit 1
+    fi
+    echo $frames
+}
+
+au_bytes()
+{
+    cat "$1"/au-* | wc -c
+}
+
+# An object of the last stats written, e.g. stats_of run.json send
+stats_of()
+{
+    grep -o "\"$2\":{[^}]*}" "$1" | head -1
+}
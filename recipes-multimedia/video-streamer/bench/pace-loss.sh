@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Loss bursts behind a shallow bottleneck queue without and with pacing.
+# The loopback device is shaped by a token bucket with a short queue, like
+# a radio link; key frames sent back to back overflow it, paced ones
+# should not. rtp-loss.py counts the lost packets and their bursts. Needs
+# root for tc, and changes the qdisc of lo while it runs.
+#
+# Usage: pace-loss.sh <clip.uyvy> [pace percents] [video-streamer options]
+
+. "$(dirname "$0")/lib.sh"
+
+CLIP=$1
+PACES=${2:-"0 50 80"}
+# Bottleneck rate and queue, bytes
+RATE=${RATE:-20mbit}
+QUEUE=${QUEUE:-15000}
+
+if [ ! -f "$CLIP" ]; then
+    echo "Usage: $0 <clip.uyvy> [pace percents] [video-streamer options]"
+    exit 1
+fi
+shift $(($# < 2 ? $# : 2))
+
+# Count the RTP packets instead of recording the access units
+start_loss_counter()
+{
+    python3 "$(dirname "$0")/rtp-loss.py" $2 > "$1/loss" &
+    RECORDER=$!
+}
+
+tc qdisc replace dev lo root tbf rate $RATE burst 3000 limit $QUEUE || exit 1
+trap 'tc qdisc del dev lo root' EXIT
+
+for pace in $PACES; do
+    dir=$OUT/pace-$pace
+    RECORD=start_loss_counter run_clip "$CLIP" $dir -u mmsg -p $pace "$@"
+    echo "pace $pace%:"
+    sed 's/^/  /' $dir/loss
+    echo "  $(stats_of $dir.json send)"
+done
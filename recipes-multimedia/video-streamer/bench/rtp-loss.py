@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+"""
+Count the RTP packets arriving on a UDP port until interrupted, then print
+the loss and how it clusters: a burst is a run of consecutive sequence
+numbers which never arrived. Late packets filling a gap are not counted
+as lost.
+
+Usage: rtp-loss.py <port>
+"""
+
+import signal
+import socket
+import struct
+import sys
+
+
+def main():
+    port = int(sys.argv[1])
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+    sock.bind(("", port))
+    signal.signal(signal.SIGINT, signal.default_int_handler)
+
+    received = set()
+    first = None
+    last = None         # Extended sequence of the newest packet
+    try:
+        while True:
+            packet = sock.recv(65536)
+            if len(packet) < 12 or packet[0] >> 6 != 2 or packet[1] & 0x7f != 96:
+                continue
+            seq = struct.unpack("!H", packet[2:4])[0]
+            if last is None:
+                first = last = seq
+            else:
+                # Extend the 16 bit sequence to the value closest to the newest one
+                ext = (last & ~0xffff) | seq
+                if ext - last > 0x8000:
+                    ext -= 0x10000
+                elif last - ext > 0x8000:
+                    ext += 0x10000
+                seq = ext
+                last = max(last, seq)
+            received.add(seq)
+    except KeyboardInterrupt:
+        pass
+
+    if last is None:
+        print("no RTP packets received")
+        return 1
+    expected = last - first + 1
+    bursts = []
+    run = 0
+    for seq in range(first, last + 1):
+        if seq in received:
+            if run:
+                bursts.append(run)
+            run = 0
+        else:
+            run += 1
+    lost = sum(bursts)
+    print(f"packets: {expected} expected, {lost} lost, {100.0 * lost / expected:.2f}%")
+    if bursts:
+        print(f"bursts: {len(bursts)}, mean {lost / len(bursts):.1f} max {max(bursts)} packets, "
+              f"{100.0 * sum(b for b in bursts if b > 1) / lost:.0f}% of the loss in bursts of 2 or more")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Sender cost of udpsink, sendmmsg and UDP GSO on the same clip: packets
+# per second, CPU time per frame of the sending thread and the whole
+# process CPU, from the last stats video-streamer wrote. With STRACE=1
+# each mode runs once more under strace to count the send syscalls per
+# frame, which udpsink does not report itself.
+#
+# Usage: send-modes.sh <clip.uyvy> [video-streamer options]
+
+. "$(dirname "$0")/lib.sh"
+
+CLIP=$1
+STATS=${STATS:-5}
+
+if [ ! -f "$CLIP" ]; then
+    echo "Usage: $0 <clip.uyvy> [video-streamer options]"
+    exit 1
+fi
+shift
+
+for mode in udpsink mmsg gso; do
+    dir=$OUT/send-$mode
+    run_clip "$CLIP" $dir -u $mode "$@"
+    frames=$(au_count $dir) || exit 1
+    echo "$mode: $frames frames received"
+    echo "  $(stats_of $dir.json send)"
+    echo "  $(stats_of $dir.json encoder)"
+    if [ "$STRACE" = 1 ]; then
+        VIDEO_STREAMER="strace -f -c -o $dir.strace -e trace=sendto,sendmsg,sendmmsg ${VIDEO_STREAMER}" \
+            run_clip "$CLIP" $dir -u $mode "$@"
+        calls=$(awk '$NF ~ /^send/ { calls += $4 } END { print calls }' $dir.strace)
+        echo "  $calls send syscalls, $((calls / $(au_count $dir))) per frame"
+    fi
+done
@@ -0,0 +1,108 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "band_pool.h"
+
+struct band_worker {
+    struct band_pool *pool;
+    pthread_t thread;
+    sem_t start;
+    int band;
+};
+
+struct band_pool {
+    int bands;
+    int quit;
+    band_func_t func;
+    void *arg;
+    sem_t done;
+    struct band_worker *workers;
+};
+
+static void sem_wait_intr(sem_t *sem)
+{
+    while (sem_wait(sem) == -1 && errno == EINTR)
+        ;
+}
+
+static void *band_worker_thread(void *arg)
+{
+    struct band_worker *worker = (struct band_worker *)arg;
+    struct band_pool *pool = worker->pool;
+
+    for (;;) {
+        sem_wait_intr(&worker->start);
+        if (pool->quit)
+            break;
+        pool->func(pool->arg, worker->band, pool->bands);
+        sem_post(&pool->done);
+    }
+    return NULL;
+}
+
+struct band_pool *band_pool_new(int bands)
+{
+    struct band_pool *pool = (struct band_pool *)calloc(1, sizeof(*pool));
+
+    if (!pool)
+        return NULL;
+    if (bands < 1)
+        bands = 1;
+    pool->bands = bands;
+    sem_init(&pool->done, 0, 0);
+    pool->workers = (struct band_worker *)calloc(bands, sizeof(*pool->workers));
+    if (!pool->workers) {
+        sem_destroy(&pool->done);
+        free(pool);
+        return NULL;
+    }
+    for (int i = 1; i < bands; i++) {
+        struct band_worker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->band = i;
+        sem_init(&worker->start, 0, 0);
+        if (pthread_create(&worker->thread, NULL, band_worker_thread, worker)) {
+            perror("pthread_create");
+            sem_destroy(&worker->start);
+            // Run with the threads created so far
+            pool->bands = i;
+            break;
+        }
+    }
+    return pool;
+}
+
+void band_pool_free(struct band_pool *pool)
+{
+    if (!pool)
+        return;
+    pool->quit = 1;
+    for (int i = 1; i < pool->bands; i++) {
+        sem_post(&pool->workers[i].start);
+        pthread_join(pool->workers[i].thread, NULL);
+        sem_destroy(&pool->workers[i].start);
+    }
+    sem_destroy(&pool->done);
+    free(pool->workers);
+    free(pool);
+}
+
+int band_pool_bands(const struct band_pool *pool)
+{
+    return pool->bands;
+}
+
+void band_pool_run(struct band_pool *pool, band_func_t func, void *arg)
+{
+    // sem_post/sem_wait order the accesses to func and arg
+    pool->func = func;
+    pool->arg = arg;
+    for (int i = 1; i < pool->bands; i++)
+        sem_post(&pool->workers[i].start);
+    func(arg, 0, pool->bands);
+    for (int i = 1; i < pool->bands; i++)
+        sem_wait_intr(&pool->done);
+}
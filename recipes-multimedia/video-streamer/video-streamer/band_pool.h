@@ -0,0 +1,19 @@
+#ifndef _BAND_POOL_H_INCLUDED
+#define _BAND_POOL_H_INCLUDED
+
+/*
+ * Worker threads which process horizontal bands of a frame in parallel.
+ * The calling thread takes band 0, so a pool of one band has no threads.
+ */
+struct band_pool;
+
+typedef void (*band_func_t)(void *arg, int band, int bands);
+
+struct band_pool *band_pool_new(int bands);
+void band_pool_free(struct band_pool *pool);
+int band_pool_bands(const struct band_pool *pool);
+
+/* Run func for every band and wait until all of them are done */
+void band_pool_run(struct band_pool *pool, band_func_t func, void *arg);
+
+#endif // _BAND_POOL_H_INCLUDED
@@ -0,0 +1,411 @@
+#include <stdint.h>
+#include "convert.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONVERT_NEON 1
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#define CONVERT_SSE2 1
+#if defined(__GNUC__)
+#define CONVERT_AVX2 1
+#endif
+#endif
+
+/*
+ * UYVY layout: U0 Y0 V0 Y1 | U2 Y2 V2 Y3 ...
+ * Chroma is averaged over two lines with rounding up, the same as
+ * _mm_avg_epu8() and vrhaddq_u8() do, so all paths give identical output.
+ */
+static inline uint8_t avg(uint8_t a, uint8_t b)
+{
+    return (a + b + 1) >> 1;
+}
+
+// Output pixels of convert_uyvy_half() done at a time
+#define HALF_CHUNK 256
+
+static void nv12_scalar(const uint8_t *s0, const uint8_t *s1,
+                        uint8_t *y0, uint8_t *y1, uint8_t *uv, int x, int width)
+{
+    for (; x < width; x += 2) {
+        const uint8_t *p0 = s0 + 2 * x;
+        const uint8_t *p1 = s1 + 2 * x;
+
+        y0[x] = p0[1];
+        y0[x + 1] = p0[3];
+        y1[x] = p1[1];
+        y1[x + 1] = p1[3];
+        uv[x] = avg(p0[0], p1[0]);
+        uv[x + 1] = avg(p0[2], p1[2]);
+    }
+}
+
+static void i420_scalar(const uint8_t *s0, const uint8_t *s1,
+                        uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int x, int width)
+{
+    for (; x < width; x += 2) {
+        const uint8_t *p0 = s0 + 2 * x;
+        const uint8_t *p1 = s1 + 2 * x;
+
+        y0[x] = p0[1];
+        y0[x + 1] = p0[3];
+        y1[x] = p1[1];
+        y1[x + 1] = p1[3];
+        u[x / 2] = avg(p0[0], p1[0]);
+        v[x / 2] = avg(p0[2], p1[2]);
+    }
+}
+
+/*
+ * Two UYVY lines averaged and halved horizontally into one UYVY line of
+ * width / 2 pixels. Pixel pairs are averaged in chroma and luma, the
+ * rounding is cascaded the same way in every path.
+ */
+static void half_scalar(const uint8_t *s0, const uint8_t *s1, uint8_t *d, int x, int width)
+{
+    for (; x < width; x += 4) {
+        const uint8_t *p0 = s0 + 2 * x;
+        const uint8_t *p1 = s1 + 2 * x;
+        uint8_t a[8];
+
+        for (int i = 0; i < 8; i++)
+            a[i] = avg(p0[i], p1[i]);
+        d[x] = avg(a[0], a[4]);
+        d[x + 1] = avg(a[1], a[3]);
+        d[x + 2] = avg(a[2], a[6]);
+        d[x + 3] = avg(a[5], a[7]);
+    }
+}
+
+#if CONVERT_NEON
+static void nv12_neon(const uint8_t *s0, const uint8_t *s1,
+                      uint8_t *y0, uint8_t *y1, uint8_t *uv, int width)
+{
+    int x = 0;
+
+    // vld4 splits 32 pixels into U, even Y, V and odd Y
+    for (; x + 32 <= width; x += 32) {
+        uint8x16x4_t a = vld4q_u8(s0 + 2 * x);
+        uint8x16x4_t b = vld4q_u8(s1 + 2 * x);
+        uint8x16x2_t ya = { { a.val[1], a.val[3] } };
+        uint8x16x2_t yb = { { b.val[1], b.val[3] } };
+        uint8x16x2_t c = { { vrhaddq_u8(a.val[0], b.val[0]), vrhaddq_u8(a.val[2], b.val[2]) } };
+
+        vst2q_u8(y0 + x, ya);
+        vst2q_u8(y1 + x, yb);
+        vst2q_u8(uv + x, c);
+    }
+    nv12_scalar(s0, s1, y0, y1, uv, x, width);
+}
+
+static void i420_neon(const uint8_t *s0, const uint8_t *s1,
+                      uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int width)
+{
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        uint8x16x4_t a = vld4q_u8(s0 + 2 * x);
+        uint8x16x4_t b = vld4q_u8(s1 + 2 * x);
+        uint8x16x2_t ya = { { a.val[1], a.val[3] } };
+        uint8x16x2_t yb = { { b.val[1], b.val[3] } };
+
+        vst2q_u8(y0 + x, ya);
+        vst2q_u8(y1 + x, yb);
+        vst1q_u8(u + x / 2, vrhaddq_u8(a.val[0], b.val[0]));
+        vst1q_u8(v + x / 2, vrhaddq_u8(a.val[2], b.val[2]));
+    }
+    i420_scalar(s0, s1, y0, y1, u, v, x, width);
+}
+
+static void half_neon(const uint8_t *s0, const uint8_t *s1, uint8_t *d, int width)
+{
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        uint8x16x4_t a = vld4q_u8(s0 + 2 * x);
+        uint8x16x4_t b = vld4q_u8(s1 + 2 * x);
+        uint8x8x4_t o;
+        uint16x8_t y;
+
+        for (int i = 0; i < 4; i++)
+            a.val[i] = vrhaddq_u8(a.val[i], b.val[i]);
+        // Chroma of neighbouring pairs, the rounding shift is the same as avg()
+        o.val[0] = vrshrn_n_u16(vpaddlq_u8(a.val[0]), 1);
+        o.val[2] = vrshrn_n_u16(vpaddlq_u8(a.val[2]), 1);
+        // Luma of each pair, even pairs give the first pixel and odd ones the second
+        y = vreinterpretq_u16_u8(vrhaddq_u8(a.val[1], a.val[3]));
+        o.val[1] = vmovn_u16(y);
+        o.val[3] = vshrn_n_u16(y, 8);
+        vst4_u8(d + x, o);
+    }
+    half_scalar(s0, s1, d, x, width);
+}
+#endif
+
+#if CONVERT_SSE2
+static void nv12_sse2(const uint8_t *s0, const uint8_t *s1,
+                      uint8_t *y0, uint8_t *y1, uint8_t *uv, int width)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(s0 + 2 * x));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(s0 + 2 * x + 16));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(s1 + 2 * x));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(s1 + 2 * x + 16));
+        __m128i c0 = _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(b0, mask));
+        __m128i c1 = _mm_packus_epi16(_mm_and_si128(a1, mask), _mm_and_si128(b1, mask));
+
+        _mm_storeu_si128((__m128i *)(y0 + x), _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(b0, 8)));
+        _mm_storeu_si128((__m128i *)(y1 + x), _mm_packus_epi16(_mm_srli_epi16(a1, 8), _mm_srli_epi16(b1, 8)));
+        _mm_storeu_si128((__m128i *)(uv + x), _mm_avg_epu8(c0, c1));
+    }
+    nv12_scalar(s0, s1, y0, y1, uv, x, width);
+}
+
+static void i420_sse2(const uint8_t *s0, const uint8_t *s1,
+                      uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int width)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(s0 + 2 * x));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(s0 + 2 * x + 16));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(s1 + 2 * x));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(s1 + 2 * x + 16));
+        __m128i c0 = _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(b0, mask));
+        __m128i c1 = _mm_packus_epi16(_mm_and_si128(a1, mask), _mm_and_si128(b1, mask));
+        __m128i c = _mm_avg_epu8(c0, c1);
+
+        _mm_storeu_si128((__m128i *)(y0 + x), _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(b0, 8)));
+        _mm_storeu_si128((__m128i *)(y1 + x), _mm_packus_epi16(_mm_srli_epi16(a1, 8), _mm_srli_epi16(b1, 8)));
+        _mm_storel_epi64((__m128i *)(u + x / 2), _mm_packus_epi16(_mm_and_si128(c, mask), zero));
+        _mm_storel_epi64((__m128i *)(v + x / 2), _mm_packus_epi16(_mm_srli_epi16(c, 8), zero));
+    }
+    i420_scalar(s0, s1, y0, y1, u, v, x, width);
+}
+
+static void half_sse2(const uint8_t *s0, const uint8_t *s1, uint8_t *d, int width)
+{
+    const __m128i chroma = _mm_set1_epi32(0x00ff00ff);
+    const __m128i luma0 = _mm_set1_epi32(0x0000ff00);
+    const __m128i luma1 = _mm_set1_epi32((int)0xff000000);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(s0 + 2 * x)),
+                                 _mm_loadu_si128((const __m128i *)(s1 + 2 * x)));
+        __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(s0 + 2 * x + 16)),
+                                 _mm_loadu_si128((const __m128i *)(s1 + 2 * x + 16)));
+        __m128i even, odd, c, y0, y1;
+
+        // Pixel pairs are 32-bit words, split them into even and odd ones
+        a = _mm_shuffle_epi32(a, 0xd8);
+        b = _mm_shuffle_epi32(b, 0xd8);
+        even = _mm_unpacklo_epi64(a, b);
+        odd = _mm_unpackhi_epi64(a, b);
+        c = _mm_avg_epu8(even, odd);
+        // Luma of a pair meets in byte 1, the odd pairs move on to byte 3
+        y0 = _mm_avg_epu8(even, _mm_srli_epi32(even, 16));
+        y1 = _mm_slli_epi32(_mm_avg_epu8(odd, _mm_srli_epi32(odd, 16)), 16);
+        _mm_storeu_si128((__m128i *)(d + x), _mm_or_si128(_mm_and_si128(c, chroma),
+                                                          _mm_or_si128(_mm_and_si128(y0, luma0),
+                                                                       _mm_and_si128(y1, luma1))));
+    }
+    half_scalar(s0, s1, d, x, width);
+}
+#endif
+
+#if CONVERT_AVX2
+/* packus works within 128-bit lanes, the permute restores pixel order */
+#define AVX2_FIX_ORDER(x) _mm256_permute4x64_epi64((x), 0xd8)
+
+__attribute__((target("avx2")))
+static void nv12_avx2(const uint8_t *s0, const uint8_t *s1,
+                      uint8_t *y0, uint8_t *y1, uint8_t *uv, int width)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(s0 + 2 * x));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(s0 + 2 * x + 32));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(s1 + 2 * x));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(s1 + 2 * x + 32));
+        __m256i c0 = _mm256_packus_epi16(_mm256_and_si256(a0, mask), _mm256_and_si256(b0, mask));
+        __m256i c1 = _mm256_packus_epi16(_mm256_and_si256(a1, mask), _mm256_and_si256(b1, mask));
+
+        _mm256_storeu_si256((__m256i *)(y0 + x),
+                            AVX2_FIX_ORDER(_mm256_packus_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(b0, 8))));
+        _mm256_storeu_si256((__m256i *)(y1 + x),
+                            AVX2_FIX_ORDER(_mm256_packus_epi16(_mm256_srli_epi16(a1, 8), _mm256_srli_epi16(b1, 8))));
+        _mm256_storeu_si256((__m256i *)(uv + x), AVX2_FIX_ORDER(_mm256_avg_epu8(c0, c1)));
+    }
+    // GCC does not add it to target("avx2") functions, SSE code running next would stall
+    _mm256_zeroupper();
+    nv12_scalar(s0, s1, y0, y1, uv, x, width);
+}
+
+__attribute__((target("avx2")))
+static void i420_avx2(const uint8_t *s0, const uint8_t *s1,
+                      uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int width)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    const __m256i zero = _mm256_setzero_si256();
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(s0 + 2 * x));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(s0 + 2 * x + 32));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(s1 + 2 * x));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(s1 + 2 * x + 32));
+        __m256i c0 = _mm256_packus_epi16(_mm256_and_si256(a0, mask), _mm256_and_si256(b0, mask));
+        __m256i c1 = _mm256_packus_epi16(_mm256_and_si256(a1, mask), _mm256_and_si256(b1, mask));
+        __m256i c = AVX2_FIX_ORDER(_mm256_avg_epu8(c0, c1));
+        __m256i cu = AVX2_FIX_ORDER(_mm256_packus_epi16(_mm256_and_si256(c, mask), zero));
+        __m256i cv = AVX2_FIX_ORDER(_mm256_packus_epi16(_mm256_srli_epi16(c, 8), zero));
+
+        _mm256_storeu_si256((__m256i *)(y0 + x),
+                            AVX2_FIX_ORDER(_mm256_packus_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(b0, 8))));
+        _mm256_storeu_si256((__m256i *)(y1 + x),
+                            AVX2_FIX_ORDER(_mm256_packus_epi16(_mm256_srli_epi16(a1, 8), _mm256_srli_epi16(b1, 8))));
+        _mm_storeu_si128((__m128i *)(u + x / 2), _mm256_castsi256_si128(cu));
+        _mm_storeu_si128((__m128i *)(v + x / 2), _mm256_castsi256_si128(cv));
+    }
+    _mm256_zeroupper();
+    i420_scalar(s0, s1, y0, y1, u, v, x, width);
+}
+#endif
+
+typedef void (*nv12_func_t)(const uint8_t *, const uint8_t *, uint8_t *, uint8_t *, uint8_t *, int);
+typedef void (*i420_func_t)(const uint8_t *, const uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint8_t *, int);
+typedef void (*half_func_t)(const uint8_t *, const uint8_t *, uint8_t *, int);
+
+static void nv12_c(const uint8_t *s0, const uint8_t *s1, uint8_t *y0, uint8_t *y1, uint8_t *uv, int width)
+{
+    nv12_scalar(s0, s1, y0, y1, uv, 0, width);
+}
+
+static void i420_c(const uint8_t *s0, const uint8_t *s1,
+                   uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int width)
+{
+    i420_scalar(s0, s1, y0, y1, u, v, 0, width);
+}
+
+static void half_c(const uint8_t *s0, const uint8_t *s1, uint8_t *d, int width)
+{
+    half_scalar(s0, s1, d, 0, width);
+}
+
+struct convert_impl {
+    const char *name;
+    nv12_func_t nv12;
+    i420_func_t i420;
+    half_func_t half;
+};
+
+static struct convert_impl select_impl(void)
+{
+#if CONVERT_NEON
+    return { "neon", nv12_neon, i420_neon, half_neon };
+#else
+#if CONVERT_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return { "avx2", nv12_avx2, i420_avx2, half_sse2 };
+#endif
+#if CONVERT_SSE2
+    return { "sse2", nv12_sse2, i420_sse2, half_sse2 };
+#endif
+    return { "c", nv12_c, i420_c, half_c };
+#endif
+}
+
+static const struct convert_impl *get_impl(void)
+{
+    // Initialisation of a function local static is thread safe
+    static const struct convert_impl impl = select_impl();
+    return &impl;
+}
+
+void uyvy_rows_to_nv12(const uint8_t *src0, const uint8_t *src1,
+                       uint8_t *y0, uint8_t *y1, uint8_t *uv, int width)
+{
+    get_impl()->nv12(src0, src1, y0, y1, uv, width);
+}
+
+void uyvy_rows_to_i420(const uint8_t *src0, const uint8_t *src1,
+                       uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int width)
+{
+    get_impl()->i420(src0, src1, y0, y1, u, v, width);
+}
+
+/* Col is the first output pixel, it must be even */
+static inline void convert_row_pair(const struct convert_impl *f, const uint8_t *s0, const uint8_t *s1,
+                                    int row, int col, int width, enum frame_format format,
+                                    const struct frame_planes *dst)
+{
+    uint8_t *y0 = dst->data[0] + row * dst->stride[0] + col;
+    int crow = row / 2;
+
+    if (format == FRAME_FORMAT_NV12)
+        f->nv12(s0, s1, y0, y0 + dst->stride[0], dst->data[1] + crow * dst->stride[1] + col, width);
+    else
+        f->i420(s0, s1, y0, y0 + dst->stride[0], dst->data[1] + crow * dst->stride[1] + col / 2,
+                dst->data[2] + crow * dst->stride[2] + col / 2, width);
+}
+
+void convert_uyvy(const uint8_t *src, int src_stride, int width, int height,
+                  enum frame_format format, const struct frame_planes *dst)
+{
+    const struct convert_impl *f = get_impl();
+
+    for (int row = 0; row < height; row += 2) {
+        const uint8_t *s0 = src + row * src_stride;
+
+        convert_row_pair(f, s0, s0 + src_stride, row, 0, width, format, dst);
+    }
+}
+
+void convert_uyvy_doubled(const uint8_t *src, int src_stride, int width, int height,
+                          enum frame_format format, const struct frame_planes *dst)
+{
+    const struct convert_impl *f = get_impl();
+
+    for (int line = 0; line < height; line++) {
+        const uint8_t *s = src + line * src_stride;
+
+        convert_row_pair(f, s, s, 2 * line, 0, width, format, dst);
+    }
+}
+
+void convert_uyvy_half(const uint8_t *src, int src_stride, int width, int height, int average_lines,
+                       enum frame_format format, const struct frame_planes *dst)
+{
+    const struct convert_impl *f = get_impl();
+    // Halved lines of a chunk, small enough to stay in L1
+    uint8_t h0[2 * HALF_CHUNK], h1[2 * HALF_CHUNK];
+    const int step = average_lines ? 2 : 1;   // Source lines per output line
+
+    for (int line = 0, row = 0; line + 2 * step <= height; line += 2 * step, row += 2) {
+        const uint8_t *s0 = src + line * src_stride;
+        const uint8_t *s1 = s0 + step * src_stride;
+
+        for (int x = 0; x < width; x += 2 * HALF_CHUNK) {
+            int n = width - x < 2 * HALF_CHUNK ? width - x : 2 * HALF_CHUNK;
+
+            // Without averaging a line is "averaged" with itself, which leaves it as it is
+            f->half(s0 + 2 * x, s0 + (step - 1) * src_stride + 2 * x, h0, n);
+            f->half(s1 + 2 * x, s1 + (step - 1) * src_stride + 2 * x, h1, n);
+            convert_row_pair(f, h0, h1, row, x / 2, n / 2, format, dst);
+        }
+    }
+}
+
+const char *convert_impl_name(void)
+{
+    return get_impl()->name;
+}
@@ -0,0 +1,47 @@
+#ifndef _CONVERT_H_INCLUDED
+#define _CONVERT_H_INCLUDED
+
+#include <stdint.h>
+
+enum frame_format {
+    FRAME_FORMAT_NV12,
+    FRAME_FORMAT_I420,
+};
+
+/* Destination planes. For NV12 plane 1 holds interleaved UV and plane 2 is unused */
+struct frame_planes {
+    uint8_t *data[3];
+    int stride[3];
+};
+
+/*
+ * Convert two UYVY lines into two luma lines and one 4:2:0 chroma line.
+ * Chroma of both source lines is averaged. src0 and src1 may point to the
+ * same line (line doubling).
+ */
+void uyvy_rows_to_nv12(const uint8_t *src0, const uint8_t *src1,
+                       uint8_t *y0, uint8_t *y1, uint8_t *uv, int width);
+void uyvy_rows_to_i420(const uint8_t *src0, const uint8_t *src1,
+                       uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int width);
+
+/* Convert a whole UYVY frame. Width and height must be even */
+void convert_uyvy(const uint8_t *src, int src_stride, int width, int height,
+                  enum frame_format format, const struct frame_planes *dst);
+
+/* Convert UYVY lines repeating each of them twice, 2 * height lines are written */
+void convert_uyvy_doubled(const uint8_t *src, int src_stride, int width, int height,
+                          enum frame_format format, const struct frame_planes *dst);
+
+/*
+ * Halve UYVY lines horizontally, pixel pairs are averaged. With
+ * average_lines pairs of lines are averaged too, a 2x2 box filter, and
+ * height / 2 lines are written, otherwise height lines. Width must be a
+ * multiple of 4 and the number of lines written even.
+ */
+void convert_uyvy_half(const uint8_t *src, int src_stride, int width, int height, int average_lines,
+                       enum frame_format format, const struct frame_planes *dst);
+
+/* Name of the SIMD implementation selected at run time */
+const char *convert_impl_name(void);
+
+#endif // _CONVERT_H_INCLUDED
@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "denoise.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DENOISE_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define DENOISE_SSE2 1
+#endif
+
+/*
+ * out = cur + round((ref - cur) * a / 16), a = max(strength - |cur - ref| / 2, 0)
+ * The rounding is the one of vrshrq_n_s16(), all paths give identical output.
+ */
+static void row_scalar(uint8_t *cur, uint8_t *ref, int x, int width, int strength, struct denoise_sums *sums)
+{
+    for (; x < width; x++) {
+        int c = cur[x];
+        int r = ref[x];
+        int d = abs(c - r);
+        int a = strength - (d >> 1);
+        int o = c + (((r - c) * (a > 0 ? a : 0) + 8) >> 4);
+
+        sums->sad_in += d;
+        sums->sad_out += abs(o - r);
+        cur[x] = o;
+        ref[x] = o;
+    }
+}
+
+#if DENOISE_NEON
+static void row_neon(uint8_t *cur, uint8_t *ref, int width, int strength, struct denoise_sums *sums)
+{
+    const uint8x16_t s = vdupq_n_u8(strength);
+    uint32x4_t sad_in = vdupq_n_u32(0);
+    uint32x4_t sad_out = vdupq_n_u32(0);
+    uint64x2_t total;
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t c = vld1q_u8(cur + x);
+        uint8x16_t r = vld1q_u8(ref + x);
+        uint8x16_t d = vabdq_u8(c, r);
+        uint8x16_t a = vqsubq_u8(s, vshrq_n_u8(d, 1));
+        int16x8_t lo = vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(r), vget_low_u8(c)));
+        int16x8_t hi = vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(r), vget_high_u8(c)));
+        uint8x16_t o;
+
+        lo = vrshrq_n_s16(vmulq_s16(lo, vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(a)))), 4);
+        hi = vrshrq_n_s16(vmulq_s16(hi, vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(a)))), 4);
+        lo = vaddq_s16(lo, vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(c))));
+        hi = vaddq_s16(hi, vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(c))));
+        o = vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi));
+        sad_in = vpadalq_u16(sad_in, vpaddlq_u8(d));
+        sad_out = vpadalq_u16(sad_out, vpaddlq_u8(vabdq_u8(o, r)));
+        vst1q_u8(cur + x, o);
+        vst1q_u8(ref + x, o);
+    }
+    total = vpaddlq_u32(sad_in);
+    sums->sad_in += vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1);
+    total = vpaddlq_u32(sad_out);
+    sums->sad_out += vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1);
+    row_scalar(cur, ref, x, width, strength, sums);
+}
+#endif
+
+#if DENOISE_SSE2
+static void row_sse2(uint8_t *cur, uint8_t *ref, int width, int strength, struct denoise_sums *sums)
+{
+    const __m128i s = _mm_set1_epi8(strength);
+    const __m128i half = _mm_set1_epi8(0x7f);
+    const __m128i round = _mm_set1_epi16(8);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sad_in = zero;
+    __m128i sad_out = zero;
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(cur + x));
+        __m128i r = _mm_loadu_si128((const __m128i *)(ref + x));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(c, r), _mm_subs_epu8(r, c));
+        // No 8-bit shifts, the mask drops the bit shifted in from the neighbour
+        __m128i a = _mm_subs_epu8(s, _mm_and_si128(_mm_srli_epi16(d, 1), half));
+        __m128i clo = _mm_unpacklo_epi8(c, zero);
+        __m128i chi = _mm_unpackhi_epi8(c, zero);
+        __m128i lo = _mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(r, zero), clo), _mm_unpacklo_epi8(a, zero));
+        __m128i hi = _mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(r, zero), chi), _mm_unpackhi_epi8(a, zero));
+        __m128i o;
+
+        lo = _mm_add_epi16(clo, _mm_srai_epi16(_mm_add_epi16(lo, round), 4));
+        hi = _mm_add_epi16(chi, _mm_srai_epi16(_mm_add_epi16(hi, round), 4));
+        o = _mm_packus_epi16(lo, hi);
+        sad_in = _mm_add_epi64(sad_in, _mm_sad_epu8(c, r));
+        sad_out = _mm_add_epi64(sad_out, _mm_sad_epu8(o, r));
+        _mm_storeu_si128((__m128i *)(cur + x), o);
+        _mm_storeu_si128((__m128i *)(ref + x), o);
+    }
+    sums->sad_in += _mm_cvtsi128_si32(sad_in) + _mm_cvtsi128_si32(_mm_srli_si128(sad_in, 8));
+    sums->sad_out += _mm_cvtsi128_si32(sad_out) + _mm_cvtsi128_si32(_mm_srli_si128(sad_out, 8));
+    row_scalar(cur, ref, x, width, strength, sums);
+}
+#endif
+
+typedef void (*row_func_t)(uint8_t *, uint8_t *, int, int, struct denoise_sums *);
+
+#if !DENOISE_NEON && !DENOISE_SSE2
+static void row_c(uint8_t *cur, uint8_t *ref, int width, int strength, struct denoise_sums *sums)
+{
+    row_scalar(cur, ref, 0, width, strength, sums);
+}
+#endif
+
+struct denoise_impl {
+    const char *name;
+    row_func_t row;
+};
+
+static struct denoise_impl select_impl(void)
+{
+#if DENOISE_NEON
+    return { "neon", row_neon };
+#elif DENOISE_SSE2
+    return { "sse2", row_sse2 };
+#else
+    return { "c", row_c };
+#endif
+}
+
+static const struct denoise_impl *get_impl(void)
+{
+    static const struct denoise_impl impl = select_impl();
+    return &impl;
+}
+
+void denoise_plane(uint8_t *data, int stride, uint8_t *ref, int ref_stride, int width, int rows,
+                   int strength, struct denoise_sums *sums)
+{
+    const struct denoise_impl *f = get_impl();
+
+    for (int row = 0; row < rows; row++) {
+        uint8_t *cur = data + row * stride;
+        uint8_t *r = ref + row * ref_stride;
+
+        if (strength > 0)
+            f->row(cur, r, width, strength, sums);
+        else
+            memcpy(r, cur, width);
+    }
+}
+
+const char *denoise_impl_name(void)
+{
+    return get_impl()->name;
+}
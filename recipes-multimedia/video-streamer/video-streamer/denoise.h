@@ -0,0 +1,33 @@
+#ifndef _DENOISE_H_INCLUDED
+#define _DENOISE_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Motion-adaptive temporal denoise of 8-bit planes. Each pixel is blended
+ * with the same pixel of a single reference, the previous filtered frame,
+ * which is updated in place. Still pixels take strength/16 of the
+ * reference, the share falls off as the difference grows and pixels which
+ * changed by 2 * strength or more pass unfiltered, so motion doesn't smear.
+ */
+
+#define DENOISE_MAX_STRENGTH 12
+
+/* Sum of absolute differences to the reference before and after filtering */
+struct denoise_sums {
+    uint64_t sad_in;
+    uint64_t sad_out;
+};
+
+/*
+ * Filter rows of a plane, width in bytes. Interleaved chroma works as it
+ * is, the two components are filtered independently. Strength 0 copies
+ * the plane to the reference, which restarts the filter.
+ */
+void denoise_plane(uint8_t *data, int stride, uint8_t *ref, int ref_stride, int width, int rows,
+                   int strength, struct denoise_sums *sums);
+
+/* Name of the SIMD implementation selected at run time */
+const char *denoise_impl_name(void);
+
+#endif // _DENOISE_H_INCLUDED
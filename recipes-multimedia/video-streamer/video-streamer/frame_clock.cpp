@@ -0,0 +1,86 @@
+#include "frame_clock.h"
+
+// Loop gains as shifts: phase error is corrected by 1/8 per frame, the
+// period by 1/256 of the error. Slow enough to filter out interrupt jitter.
+#define PHASE_SHIFT 3
+#define PERIOD_SHIFT 8
+// The period estimate stays within 1% of nominal
+#define PERIOD_LIMIT 100
+
+static void publish_drift(struct frame_clock *clock)
+{
+    int32_t ppb = (int32_t)((clock->period - (int64_t)clock->nominal) * 1000000000LL / (int64_t)clock->nominal);
+
+    __atomic_store_n(&clock->drift_ppb, ppb, __ATOMIC_RELAXED);
+}
+
+void frame_clock_init(struct frame_clock *clock, uint64_t period)
+{
+    clock->nominal = period;
+    clock->period = period;
+    clock->last = 0;
+    clock->sequence = 0;
+    clock->valid = 0;
+    publish_drift(clock);
+}
+
+void frame_clock_reset(struct frame_clock *clock)
+{
+    clock->valid = 0;
+}
+
+void frame_clock_update(struct frame_clock *clock, uint64_t capture, uint32_t sequence,
+                        struct frame_clock_tick *tick)
+{
+    int64_t period = clock->period;
+    int64_t delta, error;
+    int64_t frames;
+
+    tick->lost = 0;
+    tick->resync = 0;
+    if (!clock->valid || capture <= clock->last) {
+        tick->resync = clock->valid;
+        goto restart;
+    }
+
+    // Frames since the previous one, from the timestamps and from the driver counter
+    delta = capture - clock->last;
+    frames = (delta + period / 2) / period;
+    if (sequence - clock->sequence > 1 && sequence - clock->sequence < 1000)
+        frames = sequence - clock->sequence;
+    if (frames < 1)
+        frames = 1;
+
+    error = delta - frames * period;
+    if (error > period / 2 || error < -period / 2) {
+        tick->resync = 1;
+        tick->lost = frames - 1;
+        goto restart;
+    }
+
+    clock->last += frames * period + (error >> PHASE_SHIFT);
+    period += (error / frames) >> PERIOD_SHIFT;
+    if (period > (int64_t)(clock->nominal + clock->nominal / PERIOD_LIMIT))
+        period = clock->nominal + clock->nominal / PERIOD_LIMIT;
+    else if (period < (int64_t)(clock->nominal - clock->nominal / PERIOD_LIMIT))
+        period = clock->nominal - clock->nominal / PERIOD_LIMIT;
+    clock->period = period;
+    publish_drift(clock);
+    clock->sequence = sequence;
+    tick->lost = frames - 1;
+    tick->time = clock->last;
+    tick->duration = period;
+    return;
+
+restart:
+    clock->last = capture;
+    clock->sequence = sequence;
+    clock->valid = 1;
+    tick->time = capture;
+    tick->duration = clock->period;
+}
+
+double frame_clock_drift_ppm(const struct frame_clock *clock)
+{
+    return __atomic_load_n(&clock->drift_ppb, __ATOMIC_RELAXED) / 1000.0;
+}
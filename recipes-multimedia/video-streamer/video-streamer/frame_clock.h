@@ -0,0 +1,38 @@
+#ifndef _FRAME_CLOCK_H_INCLUDED
+#define _FRAME_CLOCK_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Turns jittery capture timestamps into evenly spaced frame times which
+ * follow the source clock. A second order loop tracks both the phase and
+ * the frame period, so drift between the analog source and the system
+ * clock does not accumulate.
+ */
+struct frame_clock {
+    uint64_t nominal;           // Nominal frame period, ns
+    int64_t period;             // Estimated frame period, ns
+    uint64_t last;              // Smoothed time of the previous frame
+    uint32_t sequence;          // V4L2 sequence of the previous frame
+    int valid;
+    int32_t drift_ppb;          // Period drift for other threads, a 64-bit period can tear on 32-bit CPUs
+};
+
+/* Result of one update */
+struct frame_clock_tick {
+    uint64_t time;              // Smoothed frame time
+    uint64_t duration;          // Current period estimate
+    unsigned int lost;          // Frames missing since the previous one
+    int resync;                 // Timestamp jumped, the loop started over
+};
+
+void frame_clock_init(struct frame_clock *clock, uint64_t period);
+/* Start over on the next frame, e.g. after the signal was lost. The period estimate is kept */
+void frame_clock_reset(struct frame_clock *clock);
+void frame_clock_update(struct frame_clock *clock, uint64_t capture, uint32_t sequence,
+                        struct frame_clock_tick *tick);
+
+/* Difference of the source clock from nominal in parts per million, callable from any thread */
+double frame_clock_drift_ppm(const struct frame_clock *clock);
+
+#endif // _FRAME_CLOCK_H_INCLUDED
@@ -0,0 +1,251 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frame_diff.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FRAME_DIFF_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define FRAME_DIFF_SSE2 1
+#endif
+
+// Lines of a cell which are sampled
+#define SAMPLE_LINE0 0
+#define SAMPLE_LINE1 2
+
+/* Luma of pixel x in a line */
+static inline int luma(const uint8_t *line, int x, enum luma_layout layout)
+{
+    switch (layout) {
+    case LUMA_UYVY:
+        return line[2 * x + 1];
+    case LUMA_YUYV:
+        return line[2 * x];
+    default:
+        return line[x];
+    }
+}
+
+/* Cells [col, cols) of a row: rounded mean of 4 pixels on each of the two lines */
+static void cells_scalar(const uint8_t *l0, const uint8_t *l1, uint8_t *out, int col, int cols,
+                         enum luma_layout layout)
+{
+    for (; col < cols; col++) {
+        int sum = 0;
+
+        for (int i = 0; i < FRAME_DIFF_CELL; i++)
+            sum += luma(l0, FRAME_DIFF_CELL * col + i, layout) + luma(l1, FRAME_DIFF_CELL * col + i, layout);
+        out[col] = (sum + 4) >> 3;
+    }
+}
+
+#if FRAME_DIFF_NEON
+/* 4 cells per step, the sums of 4 pixels come from two pairwise adds */
+static void cells_neon(const uint8_t *l0, const uint8_t *l1, uint8_t *out, int cols, enum luma_layout layout)
+{
+    int col = 0;
+
+    for (; col + 4 <= cols; col += 4) {
+        uint8x16_t y0, y1;
+        uint32x4_t sum;
+
+        if (layout == LUMA_PLANAR) {
+            y0 = vld1q_u8(l0 + FRAME_DIFF_CELL * col);
+            y1 = vld1q_u8(l1 + FRAME_DIFF_CELL * col);
+        } else {
+            uint8x16x2_t p0 = vld2q_u8(l0 + 2 * FRAME_DIFF_CELL * col);
+            uint8x16x2_t p1 = vld2q_u8(l1 + 2 * FRAME_DIFF_CELL * col);
+            int i = layout == LUMA_UYVY ? 1 : 0;
+
+            y0 = p0.val[i];
+            y1 = p1.val[i];
+        }
+        sum = vaddq_u32(vpaddlq_u16(vpaddlq_u8(y0)), vpaddlq_u16(vpaddlq_u8(y1)));
+        sum = vrshrq_n_u32(sum, 3);
+        out[col] = vgetq_lane_u32(sum, 0);
+        out[col + 1] = vgetq_lane_u32(sum, 1);
+        out[col + 2] = vgetq_lane_u32(sum, 2);
+        out[col + 3] = vgetq_lane_u32(sum, 3);
+    }
+    cells_scalar(l0, l1, out, col, cols, layout);
+}
+
+/* Two neighbouring blocks, one per half of the vectors */
+static void blocks_neon(const uint8_t *a, const uint8_t *b, int pitch, int col, unsigned int sad[2])
+{
+    uint16x8_t acc = vdupq_n_u16(0);
+    uint64x2_t sum;
+
+    for (int row = 0; row < FRAME_DIFF_BLOCK; row++)
+        acc = vpadalq_u8(acc, vabdq_u8(vld1q_u8(a + row * pitch + col), vld1q_u8(b + row * pitch + col)));
+    sum = vpaddlq_u32(vpaddlq_u16(acc));
+    sad[0] = vgetq_lane_u64(sum, 0);
+    sad[1] = vgetq_lane_u64(sum, 1);
+}
+#endif
+
+#if FRAME_DIFF_SSE2
+/* 2 cells per step from packed 4:2:2, 4 from planar luma */
+static void cells_sse2(const uint8_t *l0, const uint8_t *l1, uint8_t *out, int cols, enum luma_layout layout)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi64x(4);
+    int col = 0;
+
+    if (layout == LUMA_PLANAR) {
+        // Low 4 bytes of each 64-bit half, _mm_sad_epu8() sums a half at a time
+        const __m128i mask = _mm_set_epi32(0, -1, 0, -1);
+
+        for (; col + 4 <= cols; col += 4) {
+            __m128i y0 = _mm_loadu_si128((const __m128i *)(l0 + FRAME_DIFF_CELL * col));
+            __m128i y1 = _mm_loadu_si128((const __m128i *)(l1 + FRAME_DIFF_CELL * col));
+            __m128i even = _mm_add_epi64(_mm_sad_epu8(_mm_and_si128(y0, mask), zero),
+                                         _mm_sad_epu8(_mm_and_si128(y1, mask), zero));
+            __m128i odd = _mm_add_epi64(_mm_sad_epu8(_mm_and_si128(_mm_srli_epi64(y0, 32), mask), zero),
+                                        _mm_sad_epu8(_mm_and_si128(_mm_srli_epi64(y1, 32), mask), zero));
+
+            even = _mm_srli_epi64(_mm_add_epi64(even, round), 3);
+            odd = _mm_srli_epi64(_mm_add_epi64(odd, round), 3);
+            out[col] = _mm_cvtsi128_si32(even);
+            out[col + 1] = _mm_cvtsi128_si32(odd);
+            out[col + 2] = _mm_extract_epi16(even, 4);
+            out[col + 3] = _mm_extract_epi16(odd, 4);
+        }
+    } else {
+        const __m128i mask = _mm_set1_epi16(0x00ff);
+
+        for (; col + 2 <= cols; col += 2) {
+            __m128i p0 = _mm_loadu_si128((const __m128i *)(l0 + 2 * FRAME_DIFF_CELL * col));
+            __m128i p1 = _mm_loadu_si128((const __m128i *)(l1 + 2 * FRAME_DIFF_CELL * col));
+            __m128i y0 = layout == LUMA_UYVY ? _mm_srli_epi16(p0, 8) : _mm_and_si128(p0, mask);
+            __m128i y1 = layout == LUMA_UYVY ? _mm_srli_epi16(p1, 8) : _mm_and_si128(p1, mask);
+            __m128i sum = _mm_add_epi64(_mm_sad_epu8(y0, zero), _mm_sad_epu8(y1, zero));
+
+            sum = _mm_srli_epi64(_mm_add_epi64(sum, round), 3);
+            out[col] = _mm_cvtsi128_si32(sum);
+            out[col + 1] = _mm_extract_epi16(sum, 4);
+        }
+    }
+    cells_scalar(l0, l1, out, col, cols, layout);
+}
+
+static void blocks_sse2(const uint8_t *a, const uint8_t *b, int pitch, int col, unsigned int sad[2])
+{
+    __m128i acc = _mm_setzero_si128();
+
+    for (int row = 0; row < FRAME_DIFF_BLOCK; row++) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + row * pitch + col)),
+                                              _mm_loadu_si128((const __m128i *)(b + row * pitch + col))));
+    }
+    sad[0] = _mm_cvtsi128_si32(acc);
+    sad[1] = _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+}
+#endif
+
+typedef void (*cells_func_t)(const uint8_t *, const uint8_t *, uint8_t *, int, enum luma_layout);
+typedef void (*blocks_func_t)(const uint8_t *, const uint8_t *, int, int, unsigned int[2]);
+
+#if !FRAME_DIFF_NEON && !FRAME_DIFF_SSE2
+/* Sum of absolute differences of the block starting at cell column col */
+static unsigned int block_scalar(const uint8_t *a, const uint8_t *b, int pitch, int col)
+{
+    unsigned int sad = 0;
+
+    for (int row = 0; row < FRAME_DIFF_BLOCK; row++) {
+        for (int i = 0; i < FRAME_DIFF_BLOCK; i++)
+            sad += abs(a[row * pitch + col + i] - b[row * pitch + col + i]);
+    }
+    return sad;
+}
+
+static void cells_c(const uint8_t *l0, const uint8_t *l1, uint8_t *out, int cols, enum luma_layout layout)
+{
+    cells_scalar(l0, l1, out, 0, cols, layout);
+}
+
+static void blocks_c(const uint8_t *a, const uint8_t *b, int pitch, int col, unsigned int sad[2])
+{
+    sad[0] = block_scalar(a, b, pitch, col);
+    sad[1] = block_scalar(a, b, pitch, col + FRAME_DIFF_BLOCK);
+}
+#endif
+
+struct frame_diff_impl {
+    const char *name;
+    cells_func_t cells;
+    blocks_func_t blocks;
+};
+
+static struct frame_diff_impl select_impl(void)
+{
+#if FRAME_DIFF_NEON
+    return { "neon", cells_neon, blocks_neon };
+#elif FRAME_DIFF_SSE2
+    return { "sse2", cells_sse2, blocks_sse2 };
+#else
+    return { "c", cells_c, blocks_c };
+#endif
+}
+
+static const struct frame_diff_impl *get_impl(void)
+{
+    static const struct frame_diff_impl impl = select_impl();
+    return &impl;
+}
+
+int frame_thumb_init(struct frame_thumb *thumb, int width, int height)
+{
+    const int pair = 2 * FRAME_DIFF_BLOCK;
+
+    thumb->cols = width / FRAME_DIFF_CELL;
+    thumb->rows = height / FRAME_DIFF_CELL;
+    // Whole pairs of blocks, the padding stays zero in every thumbnail
+    thumb->pitch = (thumb->cols + pair - 1) / pair * pair;
+    thumb->padded_rows = (thumb->rows + FRAME_DIFF_BLOCK - 1) / FRAME_DIFF_BLOCK * FRAME_DIFF_BLOCK;
+    thumb->cells = (uint8_t *)calloc(thumb->padded_rows, thumb->pitch);
+    return thumb->cells ? 0 : -1;
+}
+
+void frame_thumb_free(struct frame_thumb *thumb)
+{
+    free(thumb->cells);
+    thumb->cells = NULL;
+}
+
+void frame_thumb_build(struct frame_thumb *thumb, const uint8_t *src, int stride, enum luma_layout layout)
+{
+    const struct frame_diff_impl *f = get_impl();
+
+    for (int row = 0; row < thumb->rows; row++) {
+        const uint8_t *line = src + row * FRAME_DIFF_CELL * stride;
+
+        f->cells(line + SAMPLE_LINE0 * stride, line + SAMPLE_LINE1 * stride, thumb->cells + row * thumb->pitch,
+                 thumb->cols, layout);
+    }
+}
+
+double frame_thumb_diff(const struct frame_thumb *a, const struct frame_thumb *b)
+{
+    const struct frame_diff_impl *f = get_impl();
+    unsigned int max = 0;
+
+    for (int row = 0; row < a->padded_rows; row += FRAME_DIFF_BLOCK) {
+        for (int col = 0; col < a->pitch; col += 2 * FRAME_DIFF_BLOCK) {
+            unsigned int sad[2];
+
+            f->blocks(a->cells + row * a->pitch, b->cells + row * b->pitch, a->pitch, col, sad);
+            if (sad[0] > max)
+                max = sad[0];
+            if (sad[1] > max)
+                max = sad[1];
+        }
+    }
+    return (double)max / (FRAME_DIFF_BLOCK * FRAME_DIFF_BLOCK);
+}
+
+const char *frame_diff_impl_name(void)
+{
+    return get_impl()->name;
+}
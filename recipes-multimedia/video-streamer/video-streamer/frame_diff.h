@@ -0,0 +1,41 @@
+#ifndef _FRAME_DIFF_H_INCLUDED
+#define _FRAME_DIFF_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Cheap change detection between frames. A frame is reduced to a luma
+ * thumbnail of 4x4 pixel cells, averaged over two of the four lines, and
+ * thumbnails are compared in blocks of 8x8 cells (32x32 pixels). The
+ * result is the mean difference of the block which changed most, so a
+ * small moving object is not lost in a still background.
+ */
+
+#define FRAME_DIFF_CELL 4
+#define FRAME_DIFF_BLOCK 8
+
+/* Where luma is in a line */
+enum luma_layout {
+    LUMA_PLANAR,                // NV12, I420, GRAY8
+    LUMA_UYVY,
+    LUMA_YUYV,
+};
+
+struct frame_thumb {
+    int cols, rows;             // Cells
+    int pitch;                  // Bytes per row, padded with zero cells
+    int padded_rows;
+    uint8_t *cells;
+};
+
+/* Thumbnail of a width x height frame. Returns -1 if it can't be allocated */
+int frame_thumb_init(struct frame_thumb *thumb, int width, int height);
+void frame_thumb_free(struct frame_thumb *thumb);
+void frame_thumb_build(struct frame_thumb *thumb, const uint8_t *src, int stride, enum luma_layout layout);
+/* Mean luma difference per cell in the most changed block, the thumbnails must be of the same size */
+double frame_thumb_diff(const struct frame_thumb *a, const struct frame_thumb *b);
+
+/* Name of the SIMD implementation selected at run time */
+const char *frame_diff_impl_name(void);
+
+#endif // _FRAME_DIFF_H_INCLUDED
@@ -0,0 +1,192 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "latency.h"
+
+// Frames between appsrc and udpsink which can be tracked at once
+#define PENDING_FRAMES 16
+// Histogram resolution and range
+#define BUCKET_US 100
+#define BUCKETS 2048
+
+struct pending_frame {
+    int used;
+    uint64_t pts;
+    struct frame_trace trace;
+};
+
+struct histogram {
+    unsigned int count;
+    uint64_t max;
+    unsigned int bucket[BUCKETS + 1]; // Last one collects everything above the range
+};
+
+struct latency_tracer {
+    pthread_mutex_t lock;
+    struct pending_frame pending[PENDING_FRAMES];
+    struct pending_frame *sending; // Frame whose packets reach udpsink now
+    unsigned int lost;
+    struct histogram hist[TRACE_STAGES];
+};
+
+static const char *stage_names[TRACE_STAGES] = {
+    "total", "dequeue", "convert", "push", "queue", "encode", "send",
+};
+
+struct latency_tracer *latency_tracer_new(void)
+{
+    struct latency_tracer *tracer = (struct latency_tracer *)calloc(1, sizeof(*tracer));
+
+    if (tracer)
+        pthread_mutex_init(&tracer->lock, NULL);
+    return tracer;
+}
+
+void latency_tracer_free(struct latency_tracer *tracer)
+{
+    if (!tracer)
+        return;
+    pthread_mutex_destroy(&tracer->lock);
+    free(tracer);
+}
+
+uint64_t latency_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *latency_stage_name(int stage)
+{
+    return stage_names[stage];
+}
+
+static void histogram_add(struct histogram *hist, uint64_t from, uint64_t to)
+{
+    uint64_t us = to > from ? (to - from) / 1000 : 0;
+    uint64_t index = us / BUCKET_US;
+
+    hist->bucket[index < BUCKETS ? index : BUCKETS]++;
+    hist->count++;
+    if (us > hist->max)
+        hist->max = us;
+}
+
+static unsigned int histogram_percentile(const struct histogram *hist, unsigned int percent)
+{
+    unsigned int rank = (hist->count * percent + 99) / 100;
+    unsigned int seen = 0;
+
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += hist->bucket[i];
+        if (seen >= rank) {
+            unsigned int upper = (i + 1) * BUCKET_US;
+            return upper < hist->max ? upper : (unsigned int)hist->max;
+        }
+    }
+    return (unsigned int)hist->max;
+}
+
+static struct pending_frame *find_pending(struct latency_tracer *tracer, uint64_t pts)
+{
+    for (int i = 0; i < PENDING_FRAMES; i++) {
+        if (tracer->pending[i].used && tracer->pending[i].pts == pts)
+            return &tracer->pending[i];
+    }
+    return NULL;
+}
+
+static void complete_frame(struct latency_tracer *tracer, struct pending_frame *frame)
+{
+    const uint64_t *t = frame->trace.t;
+
+    frame->used = 0;
+    if (!t[TRACE_QUEUE] || !t[TRACE_ENCODE]) {
+        tracer->lost++;
+        return;
+    }
+    for (int i = TRACE_DEQUEUE; i < TRACE_POINTS; i++)
+        histogram_add(&tracer->hist[i], t[i - 1], t[i]);
+    histogram_add(&tracer->hist[TRACE_CAPTURE], t[TRACE_CAPTURE], t[TRACE_SEND]);
+}
+
+void latency_begin(struct latency_tracer *tracer, uint64_t pts, const struct frame_trace *trace)
+{
+    struct pending_frame *slot = NULL;
+
+    pthread_mutex_lock(&tracer->lock);
+    for (int i = 0; i < PENDING_FRAMES; i++) {
+        struct pending_frame *frame = &tracer->pending[i];
+
+        if (frame == tracer->sending)
+            continue;
+        if (!frame->used) {
+            slot = frame;
+            break;
+        }
+        // Frames dropped inside the pipeline never complete, reuse the oldest
+        if (!slot || frame->trace.t[TRACE_PUSH] < slot->trace.t[TRACE_PUSH])
+            slot = frame;
+    }
+    if (slot->used)
+        tracer->lost++;
+    slot->used = 1;
+    slot->pts = pts;
+    slot->trace = *trace;
+    slot->trace.t[TRACE_QUEUE] = 0;
+    slot->trace.t[TRACE_ENCODE] = 0;
+    slot->trace.t[TRACE_SEND] = 0;
+    pthread_mutex_unlock(&tracer->lock);
+}
+
+void latency_mark(struct latency_tracer *tracer, uint64_t pts, enum trace_point point, uint64_t now)
+{
+    struct pending_frame *frame;
+
+    pthread_mutex_lock(&tracer->lock);
+    frame = find_pending(tracer, pts);
+    if (frame && !frame->trace.t[point])
+        frame->trace.t[point] = now;
+    pthread_mutex_unlock(&tracer->lock);
+}
+
+void latency_sent(struct latency_tracer *tracer, uint64_t pts, uint64_t now)
+{
+    struct pending_frame *frame;
+
+    pthread_mutex_lock(&tracer->lock);
+    if (tracer->sending && tracer->sending->pts != pts) {
+        complete_frame(tracer, tracer->sending);
+        tracer->sending = NULL;
+    }
+    if (!tracer->sending)
+        tracer->sending = find_pending(tracer, pts);
+    frame = tracer->sending;
+    if (frame)
+        frame->trace.t[TRACE_SEND] = now;
+    pthread_mutex_unlock(&tracer->lock);
+}
+
+unsigned int latency_collect(struct latency_tracer *tracer, struct latency_summary summary[TRACE_STAGES])
+{
+    unsigned int lost;
+
+    pthread_mutex_lock(&tracer->lock);
+    for (int i = 0; i < TRACE_STAGES; i++) {
+        const struct histogram *hist = &tracer->hist[i];
+
+        summary[i].count = hist->count;
+        summary[i].p50 = histogram_percentile(hist, 50);
+        summary[i].p95 = histogram_percentile(hist, 95);
+        summary[i].p99 = histogram_percentile(hist, 99);
+        summary[i].max = (unsigned int)hist->max;
+    }
+    memset(tracer->hist, 0, sizeof(tracer->hist));
+    lost = tracer->lost;
+    tracer->lost = 0;
+    pthread_mutex_unlock(&tracer->lock);
+    return lost;
+}
@@ -0,0 +1,53 @@
+#ifndef _LATENCY_H_INCLUDED
+#define _LATENCY_H_INCLUDED
+
+#include <stdint.h>
+
+/* Points of a frame's way through the streamer, all on CLOCK_MONOTONIC in ns */
+enum trace_point {
+    TRACE_CAPTURE,              // v4l2_buffer.timestamp
+    TRACE_DEQUEUE,              // VIDIOC_DQBUF returned
+    TRACE_CONVERT,              // Conversion done
+    TRACE_PUSH,                 // Pushed to appsrc
+    TRACE_QUEUE,                // Left the appsrc queue
+    TRACE_ENCODE,               // Left the encoder
+    TRACE_SEND,                 // Last packet handed to udpsink
+    TRACE_POINTS,
+};
+
+/* Latency stages: the step from the previous point to each point, plus the total */
+#define TRACE_STAGES TRACE_POINTS
+
+struct frame_trace {
+    uint64_t t[TRACE_POINTS];
+};
+
+struct latency_summary {
+    unsigned int count;
+    unsigned int p50, p95, p99, max; // us
+};
+
+struct latency_tracer;
+
+struct latency_tracer *latency_tracer_new(void);
+void latency_tracer_free(struct latency_tracer *tracer);
+
+uint64_t latency_now(void);
+
+/* Start tracking a frame pushed to the pipeline with the given PTS */
+void latency_begin(struct latency_tracer *tracer, uint64_t pts, const struct frame_trace *trace);
+/* Frame with the PTS reached a point between appsrc and the encoder output */
+void latency_mark(struct latency_tracer *tracer, uint64_t pts, enum trace_point point, uint64_t now);
+/* Packet of the frame with the PTS reached udpsink. The frame is complete once the next one starts */
+void latency_sent(struct latency_tracer *tracer, uint64_t pts, uint64_t now);
+
+/*
+ * Summaries of the frames completed since the previous call, indexed by
+ * trace_point (TRACE_CAPTURE holds capture to send). Returns the number of
+ * frames which were never completed.
+ */
+unsigned int latency_collect(struct latency_tracer *tracer, struct latency_summary summary[TRACE_STAGES]);
+
+const char *latency_stage_name(int stage);
+
+#endif // _LATENCY_H_INCLUDED
@@ -0,0 +1,40 @@
+#include "pacer.h"
+
+void pacer_init(struct pacer *pacer, uint64_t burst)
+{
+    pacer->rate = 0;
+    pacer->burst = burst;
+    pacer->tokens = burst;
+    pacer->last = 0;
+}
+
+void pacer_set_rate(struct pacer *pacer, uint64_t bits)
+{
+    pacer->rate = bits / 8;
+}
+
+static void refill(struct pacer *pacer, uint64_t now)
+{
+    if (pacer->last && now > pacer->last)
+        pacer->tokens += (double)(now - pacer->last) * pacer->rate / 1e9;
+    else if (!pacer->last)
+        pacer->tokens = pacer->burst;
+    if (pacer->tokens > pacer->burst)
+        pacer->tokens = pacer->burst;
+    pacer->last = now;
+}
+
+uint64_t pacer_delay(struct pacer *pacer, size_t len, uint64_t now)
+{
+    refill(pacer, now);
+    if (pacer->tokens >= len || !pacer->rate)
+        return 0;
+    return (uint64_t)((len - pacer->tokens) * 1e9 / pacer->rate);
+}
+
+void pacer_consume(struct pacer *pacer, size_t len, uint64_t now)
+{
+    refill(pacer, now);
+    // May go negative when the packet did not wait, the next ones make up for it
+    pacer->tokens -= len;
+}
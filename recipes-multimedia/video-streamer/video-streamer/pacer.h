@@ -0,0 +1,27 @@
+#ifndef _PACER_H_INCLUDED
+#define _PACER_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Token bucket which spreads the packets of a frame over time instead of
+ * sending them back to back. Tokens are bytes, refilled at the pacing rate
+ * up to a small burst.
+ */
+struct pacer {
+    uint64_t rate;              // bytes/s
+    uint64_t burst;             // Bucket depth, bytes
+    double tokens;
+    uint64_t last;              // Time of the last refill, ns
+};
+
+void pacer_init(struct pacer *pacer, uint64_t burst);
+/* Pacing rate for the following packets, in bits/s */
+void pacer_set_rate(struct pacer *pacer, uint64_t bits);
+/* Time until a packet of len bytes may go, 0 if it may go now */
+uint64_t pacer_delay(struct pacer *pacer, size_t len, uint64_t now);
+/* Take the tokens of a packet which is going out */
+void pacer_consume(struct pacer *pacer, size_t len, uint64_t now);
+
+#endif // _PACER_H_INCLUDED
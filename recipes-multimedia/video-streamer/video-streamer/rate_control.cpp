@@ -0,0 +1,100 @@
+#include "rate_control.h"
+
+// Loss fraction above which the rate goes down, and below which it may go up
+#define LOSS_HIGH 0.10
+#define LOSS_LOW 0.02
+// Growth per report on a clean link, and while probing
+#define INCREASE 1.05
+#define PROBE_INCREASE 1.5
+// Cut when the round trip grows, i.e. queues build up on the link
+#define DELAY_DECREASE 0.9
+// Round trip above twice the minimum plus this means the link is queueing
+#define RTT_SLACK_MS 30
+// Window of the minimum round trip, kept as two halves
+#define RTT_WINDOW_MS 10000
+// The probe settles this far below the last clean rate
+#define PROBE_BACKOFF 0.85
+#define PROBE_REPORTS 8
+// Clean reports to wait after a cut before increasing again, and
+// reports in a row with moderate loss before it counts as congestion
+#define HOLD_REPORTS 2
+
+static unsigned int clamp_rate(const struct rate_control *rc, double rate)
+{
+    if (rate < rc->min)
+        return rc->min;
+    if (rate > rc->max)
+        return rc->max;
+    return (unsigned int)rate;
+}
+
+void rate_control_init(struct rate_control *rc, unsigned int min, unsigned int max, unsigned int start, int probe)
+{
+    rc->min = min;
+    rc->max = max >= min ? max : min;
+    rc->rate = clamp_rate(rc, probe ? min : start);
+    rc->probe_good = rc->rate;
+    rc->min_rtt = 0;
+    rc->rtt_min_now = 0;
+    rc->rtt_min_prev = 0;
+    rc->rtt_window_start = 0;
+    rc->probing = probe ? PROBE_REPORTS : 0;
+    rc->hold = 0;
+    rc->lossy = 0;
+}
+
+static void update_min_rtt(struct rate_control *rc, const struct rate_report *report)
+{
+    unsigned long long age = report->time_ms - rc->rtt_window_start;
+
+    if (!report->rtt)
+        return;
+    if (!rc->rtt_window_start || age >= RTT_WINDOW_MS / 2) {
+        // The older half ages out, all of it after a gap in the reports
+        rc->rtt_min_prev = age < RTT_WINDOW_MS ? rc->rtt_min_now : 0;
+        rc->rtt_min_now = 0;
+        rc->rtt_window_start = report->time_ms;
+    }
+    if (!rc->rtt_min_now || report->rtt < rc->rtt_min_now)
+        rc->rtt_min_now = report->rtt;
+    rc->min_rtt = rc->rtt_min_prev && rc->rtt_min_prev < rc->rtt_min_now ? rc->rtt_min_prev : rc->rtt_min_now;
+}
+
+unsigned int rate_control_update(struct rate_control *rc, const struct rate_report *report)
+{
+    int delayed;
+
+    update_min_rtt(rc, report);
+    delayed = report->rtt && report->rtt > 2 * rc->min_rtt + RTT_SLACK_MS;
+
+    if (rc->probing) {
+        if (report->loss > LOSS_LOW || delayed) {
+            rc->rate = clamp_rate(rc, rc->probe_good * PROBE_BACKOFF);
+            rc->probing = 0;
+            rc->hold = HOLD_REPORTS;
+        } else {
+            rc->probe_good = rc->rate;
+            rc->rate = clamp_rate(rc, rc->rate * PROBE_INCREASE);
+            rc->probing--;
+            if (rc->probe_good == rc->max)
+                rc->probing = 0;
+        }
+        return rc->rate;
+    }
+
+    rc->lossy = report->loss > LOSS_LOW ? rc->lossy + 1 : 0;
+    if (report->loss > LOSS_HIGH || rc->lossy > HOLD_REPORTS) {
+        rc->lossy = 0;
+        rc->rate = clamp_rate(rc, rc->rate * (1.0 - report->loss / 2));
+        rc->hold = HOLD_REPORTS;
+    } else if (delayed) {
+        rc->rate = clamp_rate(rc, rc->rate * DELAY_DECREASE);
+        rc->hold = HOLD_REPORTS;
+    } else if (report->loss < LOSS_LOW) {
+        if (rc->hold)
+            rc->hold--;
+        else
+            rc->rate = clamp_rate(rc, rc->rate * INCREASE);
+    }
+    return rc->rate;
+}
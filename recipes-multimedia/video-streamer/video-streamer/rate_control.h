@@ -0,0 +1,37 @@
+#ifndef _RATE_CONTROL_H_INCLUDED
+#define _RATE_CONTROL_H_INCLUDED
+
+/*
+ * Congestion control driven by RTCP receiver reports. Loss above a few
+ * percent or a growing round trip time bring the rate down, a clean link
+ * lets it creep up again. Optionally the first reports are used to probe
+ * for the starting rate, ramping up quickly until the link shows loss.
+ * The round trip is compared with its minimum over the last seconds, so a
+ * route change raising it is followed instead of reading as queueing.
+ */
+struct rate_control {
+    unsigned int min, max;      // bit/s
+    unsigned int rate;          // Current target
+    unsigned int probe_good;    // Highest rate without loss while probing
+    unsigned int min_rtt;       // ms over the last RTT window, 0 while unknown
+    unsigned int rtt_min_now;   // ms, minimum of the current half window
+    unsigned int rtt_min_prev;  // ms, minimum of the half window before
+    unsigned long long rtt_window_start; // ms
+    int probing;                // Reports left in the startup probe
+    int hold;                   // Reports to wait before increasing again
+    int lossy;                  // Reports in a row with moderate loss
+};
+
+/* Receiver report, as the sender sees it */
+struct rate_report {
+    double loss;                // Fraction lost since the previous report, 0..1
+    unsigned int jitter;        // ms
+    unsigned int rtt;           // ms, 0 if unknown
+    unsigned long long time_ms; // Monotonic time it arrived
+};
+
+void rate_control_init(struct rate_control *rc, unsigned int min, unsigned int max, unsigned int start, int probe);
+/* Returns the new target rate */
+unsigned int rate_control_update(struct rate_control *rc, const struct rate_report *report);
+
+#endif // _RATE_CONTROL_H_INCLUDED
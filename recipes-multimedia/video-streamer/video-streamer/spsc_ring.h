@@ -0,0 +1,107 @@
+#ifndef _SPSC_RING_H_INCLUDED
+#define _SPSC_RING_H_INCLUDED
+
+#include <atomic>
+#include <errno.h>
+#include <semaphore.h>
+#include <time.h>
+
+// sem_clockwait() appeared in glibc 2.30, older C libraries wait on the wall clock
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+#define SPSC_RING_CLOCKWAIT 1
+#define SPSC_RING_CLOCK CLOCK_MONOTONIC
+#else
+#define SPSC_RING_CLOCK CLOCK_REALTIME
+#endif
+
+/* Wait for the semaphore until the deadline, in SPSC_RING_CLOCK time */
+static inline int spsc_ring_sem_wait(sem_t *sem, const struct timespec *deadline)
+{
+#ifdef SPSC_RING_CLOCKWAIT
+    return sem_clockwait(sem, CLOCK_MONOTONIC, deadline);
+#else
+    return sem_timedwait(sem, deadline);
+#endif
+}
+
+/*
+ * Bounded lock-free single producer / single consumer ring.
+ * N must be a power of two. The semaphore is only used to wake up a
+ * sleeping consumer, sem_post() does not enter the kernel without waiters.
+ */
+template <typename T, unsigned int N>
+class SpscRing {
+    static_assert(N && !(N & (N - 1)), "ring size must be a power of two");
+
+public:
+    SpscRing() : head(0), tail(0), drops(0) { sem_init(&items, 0, 0); }
+    ~SpscRing() { sem_destroy(&items); }
+
+    /* Producer side. Returns false and counts a drop when the ring is full */
+    bool push(const T &item)
+    {
+        unsigned int t = tail.load(std::memory_order_relaxed);
+
+        if (t - head.load(std::memory_order_acquire) == N) {
+            drops.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        slots[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        sem_post(&items);
+        return true;
+    }
+
+    /* Consumer side. Waits up to timeout_ms for an item, unaffected by clock steps where the C library can */
+    bool pop(T &item, int timeout_ms)
+    {
+        struct timespec ts;
+
+        clock_gettime(SPSC_RING_CLOCK, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        while (spsc_ring_sem_wait(&items, &ts) == -1) {
+            if (errno != EINTR)
+                return false;
+        }
+        return take(item);
+    }
+
+    /* Consumer side, never blocks */
+    bool try_pop(T &item)
+    {
+        if (sem_trywait(&items) == -1)
+            return false;
+        return take(item);
+    }
+
+    unsigned int size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    unsigned long long dropped() const { return drops.load(std::memory_order_relaxed); }
+    unsigned int capacity() const { return N; }
+
+private:
+    bool take(T &item)
+    {
+        unsigned int h = head.load(std::memory_order_relaxed);
+
+        item = slots[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    T slots[N];
+    std::atomic<unsigned int> head;
+    std::atomic<unsigned int> tail;
+    std::atomic<unsigned long long> drops;
+    sem_t items;
+};
+
+#endif // _SPSC_RING_H_INCLUDED
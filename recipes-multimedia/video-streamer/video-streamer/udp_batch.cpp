@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "udp_batch.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+// A frame at the maximum bitrate is a few dozen packets, larger ones go in several batches
+#define BATCH_PACKETS 64
+#define BATCH_PIECES 256
+// Kernel limits of one GSO send
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
+
+struct udp_packet {
+    int iov;                    // First piece in udp_batch.iov
+    int pieces;
+    size_t len;
+};
+
+struct udp_batch {
+    int fd;
+    int gso;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct udp_packet packets[BATCH_PACKETS];
+    int count;
+    struct iovec iov[BATCH_PIECES];
+    int pieces;
+    struct mmsghdr msgs[BATCH_PACKETS];
+    struct udp_batch_stats stats;
+};
+
+struct udp_batch *udp_batch_new(const char *host, int port, int gso)
+{
+    struct udp_batch *batch;
+    struct addrinfo hints, *res;
+    char service[16];
+    int segment = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res)) {
+        fprintf(stderr, "Can't resolve %s\n", host);
+        return NULL;
+    }
+    batch = (struct udp_batch *)calloc(1, sizeof(*batch));
+    if (!batch) {
+        perror("calloc");
+        freeaddrinfo(res);
+        return NULL;
+    }
+    batch->fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    memcpy(&batch->addr, res->ai_addr, res->ai_addrlen);
+    batch->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    if (batch->fd == -1) {
+        perror("socket");
+        free(batch);
+        return NULL;
+    }
+    // Kernels without UDP GSO reject the option
+    batch->gso = gso && setsockopt(batch->fd, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+    return batch;
+}
+
+void udp_batch_free(struct udp_batch *batch)
+{
+    if (!batch)
+        return;
+    close(batch->fd);
+    free(batch);
+}
+
+int udp_batch_room(const struct udp_batch *batch, int pieces)
+{
+    return batch->count < BATCH_PACKETS && batch->pieces + pieces <= BATCH_PIECES;
+}
+
+void udp_batch_packet(struct udp_batch *batch)
+{
+    struct udp_packet *packet = &batch->packets[batch->count++];
+
+    packet->iov = batch->pieces;
+    packet->pieces = 0;
+    packet->len = 0;
+}
+
+void udp_batch_append(struct udp_batch *batch, const void *data, size_t len)
+{
+    struct udp_packet *packet = &batch->packets[batch->count - 1];
+
+    batch->iov[batch->pieces].iov_base = (void *)data;
+    batch->iov[batch->pieces].iov_len = len;
+    batch->pieces++;
+    packet->pieces++;
+    packet->len += len;
+}
+
+/* Packets [first, first + count) with sendmmsg(), -1 if any of them failed */
+static int send_mmsg(struct udp_batch *batch, int first, int count)
+{
+    unsigned long long errors = batch->stats.errors;
+    int sent = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct msghdr *msg = &batch->msgs[i].msg_hdr;
+        const struct udp_packet *packet = &batch->packets[first + i];
+
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &batch->addr;
+        msg->msg_namelen = batch->addrlen;
+        msg->msg_iov = &batch->iov[packet->iov];
+        msg->msg_iovlen = packet->pieces;
+    }
+    while (sent < count) {
+        int ret = sendmmsg(batch->fd, &batch->msgs[sent], count - sent, 0);
+
+        batch->stats.sends++;
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            // Skip the packet which failed, like udpsink does
+            batch->stats.errors++;
+            ret = 1;
+        }
+        sent += ret;
+    }
+    return batch->stats.errors > errors ? -1 : 0;
+}
+
+/* Packets [first, first + count) of the same size, the last one may be shorter, as one GSO send */
+static int send_gso(struct udp_batch *batch, int first, int count)
+{
+    const struct udp_packet *packet = &batch->packets[first];
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &batch->addr;
+    msg.msg_namelen = batch->addrlen;
+    msg.msg_iov = &batch->iov[packet->iov];
+    msg.msg_iovlen = batch->packets[first + count - 1].iov + batch->packets[first + count - 1].pieces - packet->iov;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *(uint16_t *)CMSG_DATA(cmsg) = packet->len;
+
+    batch->stats.sends++;
+    while (sendmsg(batch->fd, &msg, 0) == -1) {
+        if (errno == EINTR)
+            continue;
+        if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT) {
+            // The device or the kernel can't segment after all
+            fprintf(stderr, "UDP GSO failed (%s), using sendmmsg\n", strerror(errno));
+            batch->gso = 0;
+            return send_mmsg(batch, first, count);
+        }
+        batch->stats.errors += count;
+        return -1;
+    }
+    batch->stats.gso_sends++;
+    return 0;
+}
+
+/* Number of packets from first which can go out as one GSO send */
+static int gso_run(const struct udp_batch *batch, int first)
+{
+    size_t segment = batch->packets[first].len;
+    size_t bytes = segment;
+    int count = 1;
+
+    while (first + count < batch->count && count < GSO_MAX_SEGMENTS) {
+        size_t len = batch->packets[first + count].len;
+
+        if (len > segment || bytes + len > GSO_MAX_BYTES)
+            break;
+        bytes += len;
+        count++;
+        // Only the last segment may be shorter
+        if (len < segment)
+            break;
+    }
+    return count;
+}
+
+int udp_batch_flush(struct udp_batch *batch)
+{
+    int ret = 0;
+    int single = 0;             // First of the packets waiting for sendmmsg()
+    int i = 0;
+
+    while (batch->gso && i < batch->count) {
+        int run = gso_run(batch, i);
+
+        if (run < 2) {
+            i++;
+            continue;
+        }
+        // Keep the order: packets before the run go first
+        if (i > single && send_mmsg(batch, single, i - single))
+            ret = -1;
+        if (send_gso(batch, i, run))
+            ret = -1;
+        i += run;
+        single = i;
+    }
+    if (batch->count > single && send_mmsg(batch, single, batch->count - single))
+        ret = -1;
+    batch->stats.packets += batch->count;
+    batch->count = 0;
+    batch->pieces = 0;
+    return ret;
+}
+
+int udp_batch_set_dscp(struct udp_batch *batch, int dscp)
+{
+    int tos = dscp << 2;
+
+    if (batch->addr.ss_family == AF_INET6)
+        return setsockopt(batch->fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+    return setsockopt(batch->fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+}
+
+int udp_batch_gso(const struct udp_batch *batch)
+{
+    return batch->gso;
+}
+
+void udp_batch_get_stats(const struct udp_batch *batch, struct udp_batch_stats *stats)
+{
+    *stats = batch->stats;
+}
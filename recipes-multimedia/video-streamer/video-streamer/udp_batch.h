@@ -0,0 +1,37 @@
+#ifndef _UDP_BATCH_H_INCLUDED
+#define _UDP_BATCH_H_INCLUDED
+
+#include <stddef.h>
+
+/*
+ * Sends the RTP packets of an access unit with as few syscalls as possible.
+ * Runs of equally sized packets go out as one UDP GSO (UDP_SEGMENT) send,
+ * everything else through sendmmsg(). Without GSO in the kernel all of it
+ * goes through sendmmsg().
+ */
+struct udp_batch;
+
+struct udp_batch_stats {
+    unsigned long long packets;
+    unsigned long long sends;       // Syscalls
+    unsigned long long gso_sends;   // Of them with UDP_SEGMENT
+    unsigned long long errors;      // Packets which could not be sent
+};
+
+struct udp_batch *udp_batch_new(const char *host, int port, int gso);
+void udp_batch_free(struct udp_batch *batch);
+
+/* Whether a packet of the given number of pieces still fits, flush first if not */
+int udp_batch_room(const struct udp_batch *batch, int pieces);
+/* Start a new packet, then append its pieces */
+void udp_batch_packet(struct udp_batch *batch);
+void udp_batch_append(struct udp_batch *batch, const void *data, size_t len);
+/* Send the packets collected so far, returns -1 if any of them failed */
+int udp_batch_flush(struct udp_batch *batch);
+
+/* DSCP of the packets, 0..63 */
+int udp_batch_set_dscp(struct udp_batch *batch, int dscp);
+int udp_batch_gso(const struct udp_batch *batch);
+void udp_batch_get_stats(const struct udp_batch *batch, struct udp_batch_stats *stats);
+
+#endif // _UDP_BATCH_H_INCLUDED
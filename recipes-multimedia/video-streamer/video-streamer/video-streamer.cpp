@@ -9,42 +9,378 @@
 #include <fcntl.h>
 #include <linux/videodev2.h>
 #include <string.h>
+#include <math.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <pthread.h>
 #include <poll.h>
+#include <getopt.h>
 #include <opencv2/imgproc.hpp>
 #include <glib.h>
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <gst/allocators/gstdmabuf.h>
+#include <gst/video/video.h>
+#include <frame_ring.h>
+#include <rtsched.h>
+#include "convert.h"
+#include "denoise.h"
+#include "frame_diff.h"
+#include "band_pool.h"
+#include "frame_clock.h"
+#include "latency.h"
+#include "pacer.h"
+#include "rate_control.h"
+#include "udp_batch.h"
+#include "spsc_ring.h"
 
 #define WATCHDOG_TIMEOUT_US 300000
 #define WATCHDOG_CHECK_MS 1000
 #define PID_FILE "/tmp/camera-stream.pid"
+#define DEFAULT_PORT 5600
+// Receivers one encode is sent to
+#define MAX_DESTINATIONS 8
+// Capture devices streaming at the same time
+#define MAX_CAMERAS 4
+
+#define CAPTURE_BUFFERS 4
+// In zero-copy mode GStreamer holds capture buffers until the encoder has
+// consumed them, so more buffers are needed to keep the driver fed.
+#define CAPTURE_BUFFERS_ZERO_COPY 8
+// Buffers which always stay queued in the driver
+#define MIN_QUEUED_BUFFERS 2
+// Preallocated buffers in the pool of converted frames
+#define POOL_MIN_BUFFERS 4
+// Frames waiting between the capture, convert and push stages
+#define CAPTURE_RING_SIZE 8
+#define PUSH_RING_SIZE 4
+// Access units waiting for the pacer
+#define PACE_RING_SIZE 8
+// Stage threads check for exit this often
+#define RING_WAIT_MS 200
+#define STATS_INTERVAL_S 10
+// No frame for this many frame periods plus the slack means the capture has stalled
+#define STALL_FRAMES 2
+#define STALL_SLACK_MS 20
+// In-place stream restarts before the device is reopened
+#define RESTREAM_ATTEMPTS 3
+#define REOPEN_RETRY_MS 1000
+// Rate of the black frames sent while there is no signal
+#define IDLE_FRAME_MS 500
+#define STATS_FILE "/tmp/camera-stream.json"
+// Pipeline errors closer together than this escalate from an in-place reset to a rebuild
+#define RESET_INTERVAL_US 2000000
+// Frames appsrc may hold in the bounded queue modes
+#define QUEUE_FRAMES 2
+// Encoder bitrate, bit/s: start and the bounds of the rate control
+#define BITRATE 1000000
+#define MIN_BITRATE 250000
+#define MAX_BITRATE 2000000
+// Range of the bitrate options
+#define BITRATE_LOWEST 10000
+#define BITRATE_HIGHEST 100000000
+// RTCP interval, both ways, and how often the receiver reports are checked
+#define RTCP_INTERVAL_MS 500
+#define RTCP_POLL_MS 250
+// Key frames requested by the receiver (PLI/FIR) are forced at most this often
+#define KEYFRAME_INTERVAL_MS 300
+// Field of the force-key-unit events video-streamer sends itself
+#define LOCAL_KEYFRAME_FIELD "video-streamer-local"
+// Payload type of the ULPFEC packets, the receiver has to match it
+#define FEC_PT 122
+// RTP payload size, the payloader splits NAL units to fit
+#define MTU 1450
+// Paced sending: packets which may go back to back, and the lowest pacing rate relative to the bitrate
+#define PACE_BURST_PACKETS 4
+#define PACE_HEADROOM 1.5
+// Slices per frame of the low-latency profile
+#define SLICES 4
+// IDR period with intra refresh, key frames are requested when needed
+#define INTRA_REFRESH_IDR_S 60
+// Encoder errors in a row before --encoder auto moves on to the next backend
+#define ENCODER_ERRORS 3
+// Frames per second sent at least while static frames are skipped
+#define MIN_FPS 2
+// --auto-half: full size again above this multiple of its rate, changes at least this far apart
+#define AUTO_HALF_HYSTERESIS 1.5
+#define AUTO_HALF_HOLD_S 10
+// Smallest crop, in capture pixels
+#define MIN_CROP 16
 
 using namespace cv;
 using namespace std;
 
-const int WIDTH = 720;
-const int HEIGTH = 576;
-const int FPS = 50;
-const int imageSize = WIDTH * HEIGTH * 2;
-GstClockTime timestamp = 0;
+static const char DEFAULT_DEVICE[] = "/dev/video0";
+
+enum field_mode {
+    FIELD_MODE_FRAME,           // Interlaced frames as captured
+    FIELD_MODE_BOB,             // Each field line-doubled to a full frame
+    FIELD_MODE_HALF,            // Each field as a half-height frame
+};
+
+/* How captured frames get to appsrc */
+enum frame_path {
+    FRAME_PATH_ZERO_COPY,       // Capture buffers wrapped as they are
+    FRAME_PATH_COPY,            // Copied as captured, videoconvert does the rest
+    FRAME_PATH_CONVERT,         // UYVY converted to NV12/I420 by convert.cpp
+    FRAME_PATH_OPENCV,          // UYVY converted to BGR by OpenCV
+};
+
+/* What happens when the encoder or the network can't keep up */
+enum backpressure {
+    BACKPRESSURE_LATEST,        // One frame (both fields in field modes) pending in appsrc, newer ones replace it
+    BACKPRESSURE_DROP_OLDEST,   // Bounded appsrc queue, the oldest frame goes first
+    BACKPRESSURE_BLOCK,         // Bounded appsrc queue, the push stage waits
+};
+
+/* Encoded frame sizes */
+struct FrameSizes {
+    guint frames, keyframes;
+    guint64 sum, sum2;          // bytes, bytes^2
+    guint max;
+    guint min_delta;            // Smallest frame which is not a key frame, 0 if none
+};
+
+/* How RTP packets leave */
+enum udp_mode {
+    UDP_MODE_UDPSINK,           // One syscall per packet
+    UDP_MODE_MMSG,              // One sendmmsg() per access unit
+    UDP_MODE_GSO,               // UDP GSO for runs of equal packets, sendmmsg() for the rest
+};
+
+/* H.264 encoders, in the order --encoder auto tries them */
+enum encoder_backend {
+    ENCODER_V4L2,               // Hardware encoder
+    ENCODER_X264,               // Software, zero-latency tuning
+    ENCODER_OPENH264,           // Software
+    ENCODER_BACKENDS,
+};
+
+static const struct {
+    const char *name;           // --encoder value
+    const char *factory;
+} encoder_backends[ENCODER_BACKENDS] = {
+    {"v4l2", "v4l2h264enc"},
+    {"x264", "x264enc"},
+    {"openh264", "openh264enc"},
+};
+
+/* Process CPU time at the time of a report */
+struct CpuUsage {
+    gint64 cpu;                 // us, user and system
+    gint64 time;
+};
+
+/* Batched sender counters at the time of a report */
+struct SendCounters {
+    struct udp_batch_stats batch;
+    guint64 frames;
+    guint64 cpu_ns;
+    guint64 pace_ns;
+    gint64 time;
+};
+
+/* Temporal denoise counters, convert stage only */
+struct DenoiseCounters {
+    guint64 frames;
+    guint64 cpu_ns;             // Thread CPU time of all bands
+    struct denoise_sums sums;
+};
+
+/* Conversion CPU per output scale, index 0 is full size and 1 half */
+struct ConvertCounters {
+    guint64 frames[2];
+    guint64 cpu_ns[2];          // Thread CPU time of all bands, without the denoise
+};
+
+/* Conversion since the previous report */
+struct ConvertReport {
+    guint64 frames[2];
+    double cpu_us_per_frame[2];
+};
+
+/* Frame skipping counters at the time of a report */
+struct SkipCounters {
+    gint checked, still, fields;
+    gint64 time;
+};
+
+/* Frame skipping since the previous report */
+struct SkipReport {
+    guint checked;
+    guint still;                // Static frames or fields
+    guint fields;               // Second fields repeating the first one
+    double ratio;               // Skipped share of the frames looked at
+    double saved_kbps;          // Estimated from the smallest P frame sent
+};
+
+/* Temporal denoise since the previous report */
+struct DenoiseReport {
+    guint64 frames;
+    double cpu_us_per_frame;
+    double removed;             // Percent of the difference between frames taken out
+};
+
+/* Batched sender since the previous report */
+/* Access unit handed from the appsink to the pacing thread */
+struct PacedSample {
+    GstSample *sample;
+    uint64_t arrival;           // Latency clock when the appsink got it
+};
+
+struct SendReport {
+    double packets_per_s;
+    double sends_per_frame;     // Syscalls
+    double cpu_us_per_frame;
+    double pace_ms, pace_max_ms;    // Time the last packet of a frame waited in the pacer
+    unsigned long long pace_dropped; // Access units the pacer fell behind on
+    unsigned long long gso_sends, errors;
+    gboolean gso;               // Still sending with UDP GSO
+};
+
+/*
+ * Part of the capture which is sent and its scale. Crop and scale need the
+ * convert path, the other paths always send the whole frame.
+ */
+struct OutputMode {
+    gint left, top;             // Capture pixels and frame lines
+    gint width, height;         // 0 is the rest of the frame
+    gint scale;                 // 1, or 2 for half width and height
+};
+
+/* Receiver of the stream, RTCP goes to the port after its RTP port */
+struct Destination {
+    gchar *host;
+    gint port;
+    gint dscp;                  // -1 keeps the default
+    gboolean from_file;         // Added and removed by the destinations file
+    struct udp_batch *batch;    // Socket of the batched modes
+};
 
-static const char DEVICE[] = "/dev/video0";
-char *incImage = new char[imageSize];
+struct _PipelineData;
+struct BufferSet;
+struct Camera;
 
 struct Buffers {
     void *start;
     size_t length;
+    unsigned int index;
+    int dmabuf_fd;
+    gboolean queued;            // Owned by the driver, changed under queue_lock
+    struct BufferSet *set;
+    struct Camera *camera;
+};
+
+/* Buffers of one VIDIOC_REQBUFS, kept until the last one out of the driver comes back */
+struct BufferSet {
+    struct Buffers *buffers;
+    unsigned int count;
+    gint refs;                  // The open device plus every buffer out of the driver
+};
+
+enum capture_state {
+    CAPTURE_STREAMING,
+    CAPTURE_RESTREAMED,         // Stream restarted in place, waiting for a frame
+    CAPTURE_REOPENED,           // Device reopened, waiting for a frame
+    CAPTURE_NO_SIGNAL,          // Sending idle frames until the signal returns
+    CAPTURE_RESUMING,           // Signal is back, waiting for a frame
+};
+
+enum signal_state {
+    SIGNAL_UNKNOWN,             // Driver does not tell
+    SIGNAL_PRESENT,
+    SIGNAL_LOST,
+};
+
+/* Captured frame handed from the capture to the convert stage */
+struct CaptureFrame {
+    struct Buffers *buf;
+    guint32 field;
+    guint32 bytesused;
+    GstClockTime time;          // Start of the frame, CLOCK_MONOTONIC
+    GstClockTime duration;
+    gboolean discont;           // Frames were lost before this one
+    int camera;
+    struct frame_trace trace;
+};
+
+/* Frame handed from the convert to the push stage */
+struct OutputFrame {
+    GstBuffer *buffer;
+    GstClockTime time;          // CLOCK_MONOTONIC, turned into running time when pushed
+    GstClockTime duration;
+    gboolean discont;
+    guint generation;           // Pipeline the frame was made for
+    int camera;                 // A key frame is forced when it changes
+    struct frame_trace trace;
+};
+
+/* What the convert stage produces for, taken together so a pipeline rebuild can't tear it */
+struct OutputTarget {
+    GstBufferPool *pool;        // Referenced, NULL while the pipeline is rebuilt
+    GstVideoInfo info;
+    struct OutputMode mode;
+    guint generation;
+};
+
+/* UYVY lines converted by the band workers */
+struct ConvertJob {
+    const uint8_t *src;
+    int stride;
+    int width;
+    int height;                 // Source lines
+    gboolean double_lines;
+    gboolean half;              // Halved, lines are not averaged together with double_lines
+    int out_width, out_height;
+    int pair_lines;             // Source lines of two output lines
+    guint64 cpu_ns;             // Added up by the bands
+    enum frame_format format;
+    struct frame_planes planes;
+    int strength;               // Temporal denoise, 0 restarts it from this frame
+    gboolean denoise_chroma;
+    struct frame_planes ref;    // Denoise reference, same layout as planes. NULL data disables it
+    struct DenoiseCounters denoise; // Added up by the bands
+};
+
+/*
+ * One capture device with its own capture thread. All of them stream all
+ * the time so a switch does not wait for a device to start, the frames of
+ * the ones which are not active go straight back to the driver.
+ */
+struct Camera {
+    const char *device;
+    int index;
+    struct _PipelineData *owner;
+    int fd;
+    struct BufferSet *set;      // Buffers of the open device
+    GMutex queue_lock;          // Serializes VIDIOC_QBUF with stream restarts
+    struct v4l2_requestbuffers reqbuf;
+    gint dequeued_buffers;      // Capture buffers out of the driver
+    GstVideoFormat capture_format;
+    struct v4l2_pix_format pix; // Negotiated capture format
+    GstVideoInfo capture_info;  // Layout of the capture buffers
+    gint fps_n, fps_d;          // Capture frame rate
+    gboolean top_field_first;   // Field order of V4L2_FIELD_INTERLACED for current standard
+    gboolean source_events;     // V4L2_EVENT_SOURCE_CHANGE subscribed
+    struct frame_clock clock;   // Smoothed capture time, capture thread only
+    gint lost_frames;           // Frames the driver never delivered
+    gint clock_resyncs;         // Capture timestamps jumped
+    gboolean discont;           // Next frame follows a break, capture thread only
+    gint no_signal;             // Idle, no signal on the input
+    pthread_t thread;
 };
 
 /* Structure to hold all the data */
 typedef struct _PipelineData {
     GstElement *pipeline;
     GstElement *src;
+    GstBufferPool *pool;        // Copied or converted frames
+    GMutex lock;                // Protects src and pool used by the reader thread
     GMainLoop *loop;
     gchar *address;
     gint port;
@@ -53,15 +389,133 @@ typedef struct _PipelineData {
     gboolean is_running;
     guint watchdog_timer_id; // Change to guint for g_timeout_add
     gint64 last_buffer_time;
-    int fd;
-    struct Buffers *buffers;
+    struct Camera cameras[MAX_CAMERAS];
+    gint camera_count;
+    gint camera;                // Camera feeding the convert stage, changed under capture_lock
+    GMutex capture_lock;        // One capture thread at a time pushes to capture_ring
+    gint camera_arg;            // From the command line
+    gint camera_wanted;         // Command line updated by the mode file, main loop only
+    gint capture_camera;        // Camera of the last frame pushed, under capture_lock
+    GstClockTime capture_last;  // End of the last frame pushed, under capture_lock
+    gint64 switch_start;        // When the pending switch was requested, under capture_lock
+    gint switches;
+    gint switches_late;         // First frame of the new camera took longer than a frame interval
+    gint last_switch_us;        // From the request to the first frame of the new camera
     unsigned int num_buffers;
-    struct v4l2_requestbuffers reqbuf;
+    gboolean zero_copy;         // Hand mmap'd capture buffers to appsrc
+    gboolean dmabuf;            // Export capture buffers as DMABUF
+    GstAllocator *dmabuf_allocator;
+    gint zero_copy_held;        // Wrapped capture buffers owned by GStreamer, pool buffers not counted
+    guint tap_slots;            // Shared memory frame tap, 0 disables it
+    struct frame_ring *tap;     // Push thread only
+    gint tap_frames;            // Published to the tap
+    gint starved_frames;        // Frames dropped to keep the driver fed
+    gint restreams;             // Stalls recovered by STREAMOFF/STREAMON
+    gint reopens;               // Stalls which needed the device reopened
+    gint last_recovery_ms;      // From the last frame before a stall to the first one after it
+    gint idle_frames;           // No-signal frames sent
+    GstBuffer *idle_frame;      // Cached no-signal frame, convert stage only
+    GstVideoInfo idle_info;     // Layout of idle_frame
+    GstVideoFormat capture_format; // Capture format of the first camera, the others have the same
+    struct v4l2_pix_format pix;
+    GstVideoInfo capture_info;
+    gint fps_n, fps_d;
+    GstVideoFormat format;      // Format pushed to appsrc
+    GstVideoInfo info;          // Changed with the pool, under lock
+    struct OutputMode mode;     // Crop and scale of the current pipeline, under lock
+    guint generation;           // Counts pipelines, under lock
+    struct OutputMode mode_arg; // From the command line
+    struct OutputMode mode_wanted; // Command line updated by the mode file, main loop only
+    const char *mode_file;      // Reloaded on SIGHUP
+    guint auto_half;            // Bitrate below which the output is halved, 0 disables
+    gboolean auto_halved;
+    gint64 auto_half_time;      // Last automatic change
+    struct ConvertCounters converted; // Written by the convert stage, under lock
+    struct ConvertCounters convert_prev;
+    struct OutputMode convert_mode; // Mode of the last frame converted, convert stage only
+    enum frame_path path;
+    enum field_mode field_mode;
+    gboolean top_field_first;
+    SpscRing<struct CaptureFrame, CAPTURE_RING_SIZE> *capture_ring;
+    SpscRing<struct OutputFrame, PUSH_RING_SIZE> *push_ring;
+    struct band_pool *bands;    // Threads converting a frame in horizontal bands
+    gint denoise;               // Temporal denoise strength, 0 disables it
+    gboolean denoise_chroma;    // Chroma too, not only luma
+    guint8 *denoise_ref[2];     // Previous filtered frame, one per field parity, convert stage only
+    gsize denoise_size;
+    gboolean denoise_valid[2];
+    struct DenoiseCounters denoised; // Written by the convert stage, under lock
+    struct DenoiseCounters denoise_prev;
+    guint skip_threshold;       // Mean luma difference of the most changed block, 0 disables skipping
+    guint min_fps;              // Frames sent per second at least while the scene is static
+    enum luma_layout skip_layout;
+    struct frame_thumb skip_sent[2]; // Last frame or field sent, per parity, convert stage only
+    struct frame_thumb skip_cur;
+    gboolean skip_valid[2];
+    GstClockTime skip_last_sent;
+    gint keyframe_pending;      // A key frame was asked for, the next frame is sent whatever it looks like
+    gint skip_checked;          // Frames and fields looked at
+    gint skipped_still;         // Dropped, nothing changed since the last one sent
+    gint skipped_fields;        // Dropped second fields repeating the first one
+    struct SkipCounters skip_prev;
+    struct latency_tracer *tracer;
+    const char *stats_file;     // Machine-readable copy of the stats line
+    gint standby;               // Pipeline kept allocated, nothing is pushed or sent
+    gint64 last_reset;          // Last in-place reset, main loop only
+    const char *resume_reason;  // What the pending resume timing is for
+    gint64 resume_start;        // When the resume was requested
+    gint resume_pending;        // Set until the first packet after the resume reaches udpsink
+    gint last_resume_ms;        // From the request to the first packet of the last resume
+    enum backpressure backpressure;
+    guint queue_frames;         // appsrc queue limit for the bounded modes
+    gint stale_frames;          // Frames skipped by the push stage for a newer one
+    gboolean low_latency;       // Encoder profile without IDR bursts
+    gint slices;
+    enum encoder_backend encoder;
+    gboolean encoder_auto;      // Fall back to the next backend when one is missing or fails
+    gint encoder_errors;        // Errors from the encoder since its last frame
+    guint encoder_threads;      // Software encoders, 0 lets them choose
+    guint quantizer;            // Constant x264 quantiser for measurements, 0 uses the bitrate
+    cpu_set_t encoder_cpus;     // Software encoders, empty leaves them unpinned
+    struct rt_config capture_rt; // Scheduling of the capture thread
+    struct CpuUsage cpu_prev;
+    struct FrameSizes encoded;  // Since the last report, under lock
+    guint bitrate;              // Current encoder rate, main loop only
+    struct rate_control rate;
+    guint rr_seq;               // Highest sequence of the last receiver report seen
+    struct rate_report rr;      // Last receiver report
+    gint64 last_keyframe;       // Last forced key frame, under lock
+    gint keyframe_requests;     // Forced on request
+    gint keyframes_limited;     // Requests dropped by the rate limit
+    guint fec_percentage;       // FEC overhead, 0 disables it
+    gboolean fec_multipacket;   // Parity over the packets of a frame, not packet by packet
+    enum udp_mode udp_mode;
+    struct Destination dests[MAX_DESTINATIONS];
+    gint dest_count;            // Changed by the main thread only
+    GMutex dest_lock;           // Protects dests against the streaming thread
+    const char *dest_file;      // Reloaded on SIGHUP
+    struct udp_batch_stats dests_removed; // Counters of the destinations gone
+    guint64 send_frames;        // Access units sent, under dest_lock
+    guint64 send_cpu_ns;        // Thread CPU time spent sending them, under dest_lock
+    guint64 send_packets;       // udpsink mode: packets times the destinations, under dest_lock
+    GstClockTime send_last_pts; // udpsink mode: access unit of the last packets, under dest_lock
+    guint64 send_dropped;       // Packets of too many memories to send, under dest_lock
+    struct SendCounters send_prev;
+    guint pace;                 // Percent of the frame interval the packets are spread over, 0 disables
+    struct pacer pacer;         // Pacing thread only
+    SpscRing<struct PacedSample, PACE_RING_SIZE> *pace_ring;
+    guint64 pace_ns;            // Pacing delay of the frames sent, under dest_lock
+    guint64 pace_max_ns;        // Largest since the previous report, under dest_lock
+    gint quit;
+    gint exit_status;           // Set by a capture thread which can't go on, main() returns it
 } PipelineData;
 
 /* Forward declarations */
 static void start_pipeline(PipelineData *data);
 static void stop_pipeline(PipelineData *data);
+static void reset_pipeline(PipelineData *data, const char *why);
+static gboolean encoder_failed(PipelineData *data);
+static int xioctl(int fd, int request, void *arg);
 
 /* Bus message handler */
 static gboolean bus_call(GstBus *bus, GstMessage *msg, PipelineData *data)
@@ -72,8 +526,7 @@ static gboolean bus_call(GstBus *bus, GstMessage *msg, PipelineData *data)
     switch (GST_MESSAGE_TYPE(msg)) {
         case GST_MESSAGE_EOS:
             g_print("End-Of-Stream reached.\n");
-            stop_pipeline(data);
-            start_pipeline(data);
+            reset_pipeline(data, "eos");
             break;
         case GST_MESSAGE_ERROR:
             gst_message_parse_error(msg, &err, &debug_info);
@@ -81,8 +534,9 @@ static gboolean bus_call(GstBus *bus, GstMessage *msg, PipelineData *data)
             g_printerr("Debugging info: %s\n", (debug_info) ? debug_info : "none");
             g_clear_error(&err);
             g_free(debug_info);
-            stop_pipeline(data);
-            start_pipeline(data);
+            if (!g_strcmp0(GST_MESSAGE_SRC_NAME(msg), "encoder") && encoder_failed(data))
+                break;
+            reset_pipeline(data, "error");
             break;
         case GST_MESSAGE_WARNING:
             gst_message_parse_warning(msg, &err, &debug_info);
@@ -109,10 +563,112 @@ static gboolean bus_call(GstBus *bus, GstMessage *msg, PipelineData *data)
 /* Pad probe callback to get a timestamp from the buffer */
 static GstPadProbeReturn probe_buffer_cb(GstPad *pad, GstPadProbeInfo *info, PipelineData *data)
 {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
     data->last_buffer_time = g_get_monotonic_time();
+    latency_mark(data->tracer, GST_BUFFER_PTS(buffer), TRACE_QUEUE, latency_now());
+    return GST_PAD_PROBE_OK;
+}
+
+/* Frame left the encoder */
+static GstPadProbeReturn probe_encoded_cb(GstPad *pad, GstPadProbeInfo *info, PipelineData *data)
+{
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    guint size = gst_buffer_get_size(buffer);
+
+    latency_mark(data->tracer, GST_BUFFER_PTS(buffer), TRACE_ENCODE, latency_now());
+    g_atomic_int_set(&data->encoder_errors, 0);
+    g_mutex_lock(&data->lock);
+    data->encoded.frames++;
+    if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        data->encoded.keyframes++;
+    else if (!data->encoded.min_delta || size < data->encoded.min_delta)
+        data->encoded.min_delta = size;
+    data->encoded.sum += size;
+    data->encoded.sum2 += (guint64)size * size;
+    if (size > data->encoded.max)
+        data->encoded.max = size;
+    g_mutex_unlock(&data->lock);
+    return GST_PAD_PROBE_OK;
+}
+
+/* Time the way from a resume request to the first packet sent */
+static void start_resume_timer(PipelineData *data, const char *reason)
+{
+    data->resume_reason = reason;
+    data->resume_start = g_get_monotonic_time();
+    g_atomic_int_set(&data->resume_pending, TRUE);
+}
+
+/*
+ * rtpbin turns PLI/FIR from the receiver into force-key-unit events going
+ * upstream. A lossy link would request an IDR for every lost packet, so
+ * only let one through every KEYFRAME_INTERVAL_MS. Our own requests, marked
+ * by request_keyframe(), always pass and restart the interval.
+ */
+static GstPadProbeReturn probe_keyframe_request_cb(GstPad *pad, GstPadProbeInfo *info, PipelineData *data)
+{
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    gint64 now = g_get_monotonic_time();
+    gboolean limited, local;
+
+    if (!gst_video_event_is_force_key_unit(event))
+        return GST_PAD_PROBE_OK;
+    local = gst_structure_has_field(gst_event_get_structure(event), LOCAL_KEYFRAME_FIELD);
+    g_mutex_lock(&data->lock);
+    limited = !local && now - data->last_keyframe < KEYFRAME_INTERVAL_MS * 1000;
+    if (!limited)
+        data->last_keyframe = now;
+    g_mutex_unlock(&data->lock);
+    if (local)
+        return GST_PAD_PROBE_OK;
+    if (limited) {
+        g_atomic_int_inc(&data->keyframes_limited);
+        return GST_PAD_PROBE_DROP;
+    }
+    g_atomic_int_inc(&data->keyframe_requests);
+    g_atomic_int_set(&data->keyframe_pending, TRUE);
+    return GST_PAD_PROBE_OK;
+}
+
+/* RTP packet(s) handed to udpsink */
+static GstPadProbeReturn probe_sent_cb(GstPad *pad, GstPadProbeInfo *info, PipelineData *data)
+{
+    GstBuffer *buffer;
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+
+        if (!gst_buffer_list_length(list))
+            return GST_PAD_PROBE_OK;
+        buffer = gst_buffer_list_get(list, 0);
+    } else {
+        buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    }
+    latency_sent(data->tracer, GST_BUFFER_PTS(buffer), latency_now());
+    if (g_atomic_int_get(&data->resume_pending) && g_atomic_int_compare_and_exchange(&data->resume_pending, TRUE, FALSE)) {
+        gint ms = (gint)((g_get_monotonic_time() - data->resume_start) / 1000);
+
+        g_atomic_int_set(&data->last_resume_ms, ms);
+        g_print("First packet %d ms after %s\n", ms, data->resume_reason);
+    }
     return GST_PAD_PROBE_OK;
 }
 
+/* Add a probe which lives as long as the element */
+static void add_element_probe(GstElement *element, const gchar *pad_name, GstPadProbeType type,
+                              GstPadProbeCallback callback, PipelineData *data)
+{
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+
+    if (!pad) {
+        g_printerr("Failed to get %s pad of %s.\n", pad_name, GST_ELEMENT_NAME(element));
+        return;
+    }
+    gst_pad_add_probe(pad, type, callback, data, NULL);
+    gst_object_unref(pad);
+}
+
 /* Watchdog timer callback */
 static gboolean check_pipeline_activity(PipelineData *data)
 {
@@ -136,467 +692,3376 @@ static gboolean check_pipeline_activity(PipelineData *data)
     return G_SOURCE_CONTINUE;
 }
 
-/* Pipeline creation and setup */
-static GstElement *create_and_setup_pipeline(PipelineData *data)
+/* Pool of buffers for converted frames, so no memory is allocated per frame */
+static GstBufferPool *create_buffer_pool(GstCaps *caps, guint size)
 {
-    GstElement *pipeline, *src, *convert, *capsfilter, *encoder, *encoder_capsfilter, *payloader, *sink;
-    GstBus *bus;
-    GstCaps *caps, *encoder_caps;
-    GstStructure *encoder_controls;
+    GstBufferPool *pool = gst_buffer_pool_new();
+    GstStructure *config = gst_buffer_pool_get_config(pool);
 
-    g_print("Creating new GStreamer pipeline...\n");
+    gst_buffer_pool_config_set_params(config, caps, size, POOL_MIN_BUFFERS, 0);
+    if (!gst_buffer_pool_set_config(pool, config) || !gst_buffer_pool_set_active(pool, TRUE)) {
+        gst_object_unref(pool);
+        return NULL;
+    }
+    return pool;
+}
 
-    /* Create elements */
-    pipeline = gst_pipeline_new("camera-h264-streamer");
-//    src = gst_element_factory_make("v4l2src", "source");
-    src = gst_element_factory_make("appsrc", "source");
-    convert = gst_element_factory_make("videoconvert", "converter");
-    capsfilter = gst_element_factory_make("capsfilter", "capsfilter");
-    encoder = gst_element_factory_make("v4l2h264enc", "encoder");
-    encoder_capsfilter = gst_element_factory_make("capsfilter", "encoder-capsfilter");
-    payloader = gst_element_factory_make("rtph264pay", "payloader");
-    sink = gst_element_factory_make("udpsink", "sink");
+/*
+ * Add a control to extra-controls if the encoder device has it. The name is
+ * the one v4l2h264enc gives it: lower case, non-alphanumerics as '_'.
+ */
+static gboolean add_encoder_control(int fd, GstStructure *controls, guint32 id, gint value)
+{
+    struct v4l2_queryctrl query;
+    gchar *name;
+    int len = 0;
 
-    /* Check if elements were created */
-    if (!pipeline || !src || !convert || !capsfilter || !encoder || !encoder_capsfilter || !payloader || !sink) {
-        g_printerr("Failed to create one or more GStreamer elements!\n");
-        if (pipeline) gst_object_unref(pipeline);
-        if (src) gst_object_unref(src);
-        if (convert) gst_object_unref(convert);
-        if (capsfilter) gst_object_unref(capsfilter);
-        if (encoder) gst_object_unref(encoder);
-        if (encoder_capsfilter) gst_object_unref(encoder_capsfilter);
-        if (payloader) gst_object_unref(payloader);
-        if (sink) gst_object_unref(sink);
-        return NULL;
+    memset(&query, 0, sizeof(query));
+    query.id = id;
+    if (fd < 0 || xioctl(fd, VIDIOC_QUERYCTRL, &query) == -1 ||
+        (query.flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_READ_ONLY)))
+        return FALSE;
+    name = g_strndup((const gchar *)query.name, sizeof(query.name));
+    for (int i = 0; name[i]; i++) {
+        if (!g_ascii_isalnum(name[i]))
+            continue;
+        if (len > 0 && !g_ascii_isalnum(name[i - 1]))
+            name[len++] = '_';
+        name[len++] = g_ascii_tolower(name[i]);
     }
+    name[len] = '\0';
+    gst_structure_set(controls, name, G_TYPE_INT, CLAMP(value, query.minimum, query.maximum), NULL);
+    g_free(name);
+    return TRUE;
+}
 
-    /* Set properties */
-//    g_object_set(src, "device", "/dev/video0", "norm", "PAL", NULL);
-//    caps = gst_caps_from_string("video/x-raw,format=UYVY,width=720,height=576,framerate=25/1");
-    caps = gst_caps_new_simple("video/x-raw",
-                               "format", G_TYPE_STRING, "BGR",
-                               "width", G_TYPE_INT, WIDTH,
-                               "height", G_TYPE_INT, HEIGTH,
-                               "framerate", GST_TYPE_FRACTION, FPS, 1,
-                               NULL);
-    g_object_set(G_OBJECT(src),
-                 "caps", caps,
-                 "is-live", TRUE,
-                 "format", GST_FORMAT_TIME,
-                 "stream-type", GST_APP_STREAM_TYPE_STREAM, // Mode PUSH
-                 NULL);
-    g_object_set(capsfilter, "caps", caps, NULL);
-    gst_caps_unref(caps);
+/*
+ * Encoder controls. The low-latency profile keeps every frame about the same
+ * size: CBR with a one-frame CPB, no B-frames, cyclic intra refresh instead
+ * of periodic IDR (short closed GOPs if the encoder has no intra refresh),
+ * and several slices per frame so a lost packet only damages a slice.
+ */
+static GstStructure *create_encoder_controls(PipelineData *data, GstElement *encoder, int width, int height, int fps)
+{
+    GstStructure *controls = gst_structure_new("controls", "video_bitrate", G_TYPE_INT, data->bitrate, NULL);
+    int mbs = ((width + 15) / 16) * ((height + 15) / 16);
+    gchar *device = NULL;
+    const char *refresh;
+    int fd;
 
-    encoder_controls = gst_structure_new_from_string("controls,video_bitrate=1000000");
-    g_object_set(encoder, "extra-controls", encoder_controls, NULL);
-    gst_structure_free(encoder_controls);
+    if (!data->low_latency)
+        return controls;
+    g_object_get(encoder, "device", &device, NULL);
+    fd = device ? open(device, O_RDWR | O_NONBLOCK) : -1;
+    if (fd == -1)
+        g_printerr("Can't query the controls of %s, low-latency profile not applied\n", device ? device : "encoder");
+    g_free(device);
 
-    encoder_caps = gst_caps_from_string("video/x-h264,profile=main,level=(string)4");
-    g_object_set(encoder_capsfilter, "caps", encoder_caps, NULL);
-    gst_caps_unref(encoder_caps);
+    add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_BITRATE_MODE, V4L2_MPEG_VIDEO_BITRATE_MODE_CBR);
+    add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_B_FRAMES, 0);
+    add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER, 1);
+    // The whole picture is refreshed once a second
+    if (add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD, fps)) {
+        add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE,
+                            V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE_CYCLIC);
+        refresh = "intra refresh";
+        add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, INTRA_REFRESH_IDR_S * fps);
+    } else if (add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB, MAX(mbs / fps, 1))) {
+        refresh = "intra refresh";
+        add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, INTRA_REFRESH_IDR_S * fps);
+    } else {
+        refresh = "closed GOP";
+        add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, MAX(fps / 2, 1));
+        add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_GOP_CLOSURE, 1);
+    }
+    // One frame at the starting bitrate, in kB
+    if (!add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_H264_CPB_SIZE, MAX(data->bitrate / 8 / fps / 1000, 1)))
+        add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_VBV_SIZE, MAX(data->bitrate / 8 / fps / 1000, 1));
+    if (data->slices > 1 &&
+        add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE, V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB))
+        add_encoder_control(fd, controls, V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB, (mbs + data->slices - 1) / data->slices);
+    if (fd >= 0)
+        close(fd);
 
-    g_object_set(payloader, "config-interval", -1, "mtu", 1450, "aggregate-mode", 1, NULL);
-    g_object_set(sink, "host", data->address, "port", data->port, "sync", FALSE, "loop", FALSE, NULL);
+    gchar *str = gst_structure_to_string(controls);
+    g_print("Low-latency encoder, %s: %s\n", refresh, str);
+    g_free(str);
+    return controls;
+}
 
-    /* Add elements to the pipeline */
-    gst_bin_add_many(GST_BIN(pipeline), src, capsfilter, convert, encoder, encoder_capsfilter, payloader, sink, NULL);
+static gboolean encoder_available(int backend)
+{
+    GstElementFactory *factory = gst_element_factory_find(encoder_backends[backend].factory);
 
-    /* Link elements */
-    if (!gst_element_link_many(src, capsfilter, convert, encoder, encoder_capsfilter, payloader, sink, NULL)) {
-        g_printerr("Elements could not be linked.\n");
-        gst_object_unref(pipeline);
-        return NULL;
+    if (!factory)
+        return FALSE;
+    gst_object_unref(factory);
+    return TRUE;
+}
+
+/* With --encoder auto the first backend from the current one which is installed */
+static void select_encoder(PipelineData *data)
+{
+    int backend = data->encoder;
+
+    while (data->encoder_auto && backend < ENCODER_BACKENDS - 1 && !encoder_available(backend))
+        backend++;
+    if (backend != data->encoder) {
+        g_printerr("%s is missing, using %s\n", encoder_backends[data->encoder].factory,
+                   encoder_backends[backend].factory);
+        data->encoder = (enum encoder_backend)backend;
     }
+}
 
-    /* Get the bus and add a watch */
-    bus = gst_element_get_bus(pipeline);
-    data->bus_watch_id = gst_bus_add_watch(bus, (GstBusFunc)bus_call, data);
-    gst_object_unref(bus);
+/*
+ * x264 tuned for latency: no lookahead and no B-frames, threads work on
+ * slices of the same frame instead of on consecutive frames. The
+ * low-latency profile adds CBR with a one-frame VBV and intra refresh.
+ */
+static void configure_x264_encoder(PipelineData *data, GstElement *encoder, int fps)
+{
+    gst_util_set_object_arg(G_OBJECT(encoder), "tune", "zerolatency");
+    gst_util_set_object_arg(G_OBJECT(encoder), "speed-preset", "ultrafast");
+    g_object_set(encoder, "bitrate", data->bitrate / 1000, "threads", data->encoder_threads,
+                 "sliced-threads", TRUE, "rc-lookahead", 0, "sync-lookahead", 0, "bframes", 0, NULL);
+    if (data->quantizer) {
+        // Equal quality for every run, the frame sizes show what the input costs
+        gst_util_set_object_arg(G_OBJECT(encoder), "pass", "quant");
+        g_object_set(encoder, "quantizer", data->quantizer, NULL);
+    } else if (data->low_latency) {
+        gchar *options = g_strdup_printf("slices=%d", MAX(data->slices, 1));
 
-    /* Add pad probe for activity check */
-    GstPad *src_pad = gst_element_get_static_pad(src, "src");
-    if (src_pad) {
-        data->pad_probe_id = gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)probe_buffer_cb, data, NULL);
-        gst_object_unref(src_pad);
-    } else {
-        g_printerr("Failed to get src pad.\n");
+        gst_util_set_object_arg(G_OBJECT(encoder), "pass", "cbr");
+        // The whole picture is refreshed once a second
+        g_object_set(encoder, "intra-refresh", TRUE, "key-int-max", fps, "vbv-buf-capacity", MAX(1000 / fps, 1),
+                     "option-string", options, NULL);
+        g_free(options);
     }
-    data->src = src;
-    return pipeline;
 }
 
-/* Stop pipeline and free resources */
-static void stop_pipeline(PipelineData *data)
+/* openh264 has no intra refresh, the low-latency profile uses short GOPs */
+static void configure_openh264_encoder(PipelineData *data, GstElement *encoder, int fps)
 {
-    if (!data->pipeline) return;
+    gst_util_set_object_arg(G_OBJECT(encoder), "usage-type", "camera");
+    gst_util_set_object_arg(G_OBJECT(encoder), "complexity", "low");
+    gst_util_set_object_arg(G_OBJECT(encoder), "rate-control", "bitrate");
+    g_object_set(encoder, "bitrate", data->bitrate, "multi-thread", data->encoder_threads, NULL);
+    if (data->low_latency) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "slice-mode", "n-slices");
+        g_object_set(encoder, "gop-size", MAX(fps / 2, 1), "num-slices", MAX(data->slices, 1), NULL);
+    }
+}
 
-    g_print("Stopping pipeline...\n");
+static void configure_encoder(PipelineData *data, GstElement *encoder, int width, int height, int fps)
+{
+    GstStructure *controls;
 
-    /* Stop watchdog timer */
-    if (data->watchdog_timer_id) {
-        g_source_remove(data->watchdog_timer_id);
-        data->watchdog_timer_id = 0;
+    switch (data->encoder) {
+    case ENCODER_X264:
+        configure_x264_encoder(data, encoder, fps);
+        break;
+    case ENCODER_OPENH264:
+        configure_openh264_encoder(data, encoder, fps);
+        break;
+    default:
+        controls = create_encoder_controls(data, encoder, width, height, fps);
+        g_object_set(encoder, "extra-controls", controls, NULL);
+        gst_structure_free(controls);
+        if (data->dmabuf)
+            gst_util_set_object_arg(G_OBJECT(encoder), "output-io-mode", "dmabuf-import");
+        break;
     }
+}
 
-    /* Remove pad probe */
-    if (data->pad_probe_id) {
-        GstElement *src = gst_bin_get_by_name(GST_BIN(data->pipeline), "source");
-        if (src) {
-            GstPad *src_pad = gst_element_get_static_pad(src, "src");
-            if (src_pad) {
-                gst_pad_remove_probe(src_pad, data->pad_probe_id);
-                gst_object_unref(src_pad);
+/*
+ * Software encoders start their worker threads from the streaming thread
+ * which feeds them, so pinning that thread before the stream starts pins
+ * the workers as well.
+ */
+static GstPadProbeReturn probe_encoder_thread_cb(GstPad *pad, GstPadProbeInfo *info, PipelineData *data)
+{
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) != GST_EVENT_STREAM_START)
+        return GST_PAD_PROBE_OK;
+    if (pthread_setaffinity_np(pthread_self(), sizeof(data->encoder_cpus), &data->encoder_cpus))
+        g_printerr("Can't pin the encoder thread\n");
+    return GST_PAD_PROBE_OK;
+}
+
+static void unmap_pieces(GstMapInfo *maps, guint *mapped, guint keep)
+{
+    while (*mapped > keep) {
+        (*mapped)--;
+        gst_memory_unmap(maps[*mapped].memory, &maps[*mapped]);
+    }
+}
+
+/*
+ * Pacing rate for an access unit: its packets take at most the configured
+ * share of the frame interval, and never go slower than a bit above the
+ * target bitrate so small frames don't linger.
+ */
+static void set_pace_rate(PipelineData *data, GstBufferList *list, GstBuffer *single)
+{
+    int fps_n = data->field_mode == FIELD_MODE_FRAME ? data->fps_n : 2 * data->fps_n;
+    guint64 window = gst_util_uint64_scale(GST_SECOND / 100 * data->pace, data->fps_d, fps_n);
+    gsize bytes = list ? gst_buffer_list_calculate_size(list) : gst_buffer_get_size(single);
+    guint64 rate = data->bitrate * PACE_HEADROOM;
+
+    pacer_set_rate(&data->pacer, MAX(rate, gst_util_uint64_scale(bytes * 8, GST_SECOND, window)));
+}
+
+/* Send what the destinations have collected, called with dest_lock held */
+static void flush_destinations(PipelineData *data)
+{
+    for (int i = 0; i < data->dest_count; i++)
+        udp_batch_flush(data->dests[i].batch);
+}
+
+/*
+ * Send the packets of one access unit in batches, no copies: each memory
+ * becomes a piece, and every destination gets the same pieces. Takes the sample.
+ */
+static void send_sample(PipelineData *data, GstSample *sample, uint64_t arrival)
+{
+    GstBufferList *list;
+    GstBuffer *single;
+    GstMapInfo maps[64];
+    guint mapped = 0;
+    guint count;
+    struct timespec start, end;
+    uint64_t sent;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    list = gst_sample_get_buffer_list(sample);
+    single = gst_sample_get_buffer(sample);
+    count = list ? gst_buffer_list_length(list) : 1;
+    if (data->pace)
+        set_pace_rate(data, list, single);
+    g_mutex_lock(&data->dest_lock);
+    for (guint i = 0; i < count; i++) {
+        GstBuffer *buffer = list ? gst_buffer_list_get(list, i) : single;
+        guint pieces = gst_buffer_n_memory(buffer);
+        guint first;
+
+        if (pieces > G_N_ELEMENTS(maps)) {
+            // Counted with the send errors, the receiver sees it as loss
+            if (!data->send_dropped++)
+                g_printerr("RTP packet of %u memories dropped, at most %u can be sent\n", pieces,
+                           (guint)G_N_ELEMENTS(maps));
+            continue;
+        }
+        if (data->pace) {
+            gsize len = gst_buffer_get_size(buffer);
+            guint64 delay = pacer_delay(&data->pacer, len, latency_now());
+
+            // What is collected goes now, this packet once the bucket has its tokens
+            if (delay) {
+                flush_destinations(data);
+                unmap_pieces(maps, &mapped, 0);
+                // Nothing is pending, destinations may come and go meanwhile
+                g_mutex_unlock(&data->dest_lock);
+                g_usleep(delay / 1000);
+                g_mutex_lock(&data->dest_lock);
             }
-            gst_object_unref(src);
+            pacer_consume(&data->pacer, len, latency_now());
+        }
+        if (!data->dest_count)
+            continue;
+        // All destinations hold the same packets
+        if (!udp_batch_room(data->dests[0].batch, pieces) || mapped + pieces > G_N_ELEMENTS(maps)) {
+            flush_destinations(data);
+            unmap_pieces(maps, &mapped, 0);
+        }
+        first = mapped;
+        for (guint j = 0; j < pieces; j++) {
+            if (!gst_memory_map(gst_buffer_peek_memory(buffer, j), &maps[mapped], GST_MAP_READ))
+                break;
+            mapped++;
+        }
+        if (mapped - first < pieces) {
+            unmap_pieces(maps, &mapped, first);
+            continue;
+        }
+        for (int d = 0; d < data->dest_count; d++) {
+            udp_batch_packet(data->dests[d].batch);
+            for (guint j = first; j < mapped; j++)
+                udp_batch_append(data->dests[d].batch, maps[j].data, maps[j].size);
         }
-        data->pad_probe_id = 0;
     }
+    flush_destinations(data);
+    g_mutex_unlock(&data->dest_lock);
+    sent = latency_now();
+    unmap_pieces(maps, &mapped, 0);
+    // The sink pad saw the frame before the pacer, the last packet leaves now
+    if (data->pace && count)
+        latency_sent(data->tracer, GST_BUFFER_PTS(list ? gst_buffer_list_get(list, 0) : single), sent);
+    gst_sample_unref(sample);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    g_mutex_lock(&data->dest_lock);
+    data->send_frames++;
+    data->send_cpu_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+    if (data->pace) {
+        data->pace_ns += sent - arrival;
+        if (sent - arrival > data->pace_max_ns)
+            data->pace_max_ns = sent - arrival;
+    }
+    g_mutex_unlock(&data->dest_lock);
+}
 
-    /* Set pipeline to NULL state */
-    gst_element_set_state(data->pipeline, GST_STATE_NULL);
+/* The pacer waits in its own thread, the streaming thread goes on with the next frame */
+static GstFlowReturn send_sample_cb(GstAppSink *appsink, PipelineData *data)
+{
+    struct PacedSample paced;
 
-    /* Remove bus watch */
-    if (data->bus_watch_id) {
-        g_source_remove(data->bus_watch_id);
-        data->bus_watch_id = 0;
+    paced.sample = gst_app_sink_pull_sample(appsink);
+    if (!paced.sample)
+        return GST_FLOW_EOS;
+    paced.arrival = latency_now();
+    if (!data->pace)
+        send_sample(data, paced.sample, paced.arrival);
+    else if (!data->pace_ring->push(paced))
+        gst_sample_unref(paced.sample);
+    return GST_FLOW_OK;
+}
+
+/* Pacing stage: send the access units queued by send_sample_cb() */
+static void *pace_thread(void *arg)
+{
+    PipelineData *pipeline = (PipelineData *)arg;
+    struct PacedSample paced;
+
+    while (!g_atomic_int_get(&pipeline->quit)) {
+        if (pipeline->pace_ring->pop(paced, RING_WAIT_MS))
+            send_sample(pipeline, paced.sample, paced.arrival);
     }
+    return NULL;
+}
+
+/*
+ * udpsink sends in the thread which pushes to it, so the chain functions of
+ * its sink pad are wrapped to count and time the sends like send_sample_cb()
+ */
+struct SinkChain {
+    GstPadChainFunction chain;
+    GstPadChainListFunction chain_list;
+    PipelineData *data;
+};
+
+static GQuark sink_chain_quark(void)
+{
+    return g_quark_from_static_string("video-streamer-sink-chain");
+}
+
+static void udpsink_sent(PipelineData *data, GstClockTime pts, guint packets, const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    g_mutex_lock(&data->dest_lock);
+    // The packets of an access unit share its timestamp
+    if (pts != data->send_last_pts) {
+        data->send_last_pts = pts;
+        data->send_frames++;
+    }
+    data->send_packets += (guint64)packets * data->dest_count;
+    data->send_cpu_ns += (end.tv_sec - start->tv_sec) * 1000000000LL + end.tv_nsec - start->tv_nsec;
+    g_mutex_unlock(&data->dest_lock);
+}
+
+static GstFlowReturn udpsink_chain(GstPad *pad, GstObject *parent, GstBuffer *buffer)
+{
+    struct SinkChain *chain = (struct SinkChain *)g_object_get_qdata(G_OBJECT(pad), sink_chain_quark());
+    GstClockTime pts = GST_BUFFER_PTS(buffer);
+    struct timespec start;
+    GstFlowReturn ret;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    ret = chain->chain(pad, parent, buffer);
+    udpsink_sent(chain->data, pts, 1, &start);
+    return ret;
+}
+
+static GstFlowReturn udpsink_chain_list(GstPad *pad, GstObject *parent, GstBufferList *list)
+{
+    struct SinkChain *chain = (struct SinkChain *)g_object_get_qdata(G_OBJECT(pad), sink_chain_quark());
+    guint packets = gst_buffer_list_length(list);
+    GstClockTime pts = packets ? GST_BUFFER_PTS(gst_buffer_list_get(list, 0)) : GST_CLOCK_TIME_NONE;
+    struct timespec start;
+    GstFlowReturn ret;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    ret = chain->chain_list(pad, parent, list);
+    udpsink_sent(chain->data, pts, packets, &start);
+    return ret;
+}
+
+static void time_udpsink(PipelineData *data, GstElement *sink)
+{
+    GstPad *pad = gst_element_get_static_pad(sink, "sink");
+    struct SinkChain *chain;
+
+    if (!pad)
+        return;
+    chain = g_new0(struct SinkChain, 1);
+    chain->chain = GST_PAD_CHAINFUNC(pad);
+    chain->chain_list = GST_PAD_CHAINLISTFUNC(pad);
+    chain->data = data;
+    g_object_set_qdata_full(G_OBJECT(pad), sink_chain_quark(), chain, g_free);
+    if (chain->chain)
+        gst_pad_set_chain_function(pad, udpsink_chain);
+    if (chain->chain_list)
+        gst_pad_set_chain_list_function(pad, udpsink_chain_list);
+    gst_object_unref(pad);
+}
+
+/* rtpbin asks for the FEC encoder of the session while the send pads are made */
+static GstElement *request_fec_encoder_cb(GstElement *rtpbin, guint session, PipelineData *data)
+{
+    GstElement *fec = gst_element_factory_make("rtpulpfecenc", "fec");
+
+    if (!fec) {
+        g_printerr("rtpulpfecenc is missing, sending without FEC\n");
+        return NULL;
+    }
+    g_object_set(fec, "pt", FEC_PT, "percentage", data->fec_percentage,
+                 "multipacket", data->fec_multipacket, NULL);
+    return fec;
+}
+
+/* host[:port[:dscp]], [ipv6]:port[:dscp] or a bare IPv6 address */
+static gboolean parse_destination(const char *spec, struct Destination *dest)
+{
+    const char *rest = strchr(spec, ':');
+    gchar *host;
+    gchar **parts;
+    gboolean ok;
+
+    memset(dest, 0, sizeof(*dest));
+    dest->port = DEFAULT_PORT;
+    dest->dscp = -1;
+    if (*spec == '[') {
+        const char *end = strchr(spec, ']');
+
+        if (!end || (end[1] && end[1] != ':'))
+            return FALSE;
+        host = g_strndup(spec + 1, end - spec - 1);
+        rest = end[1] ? end + 1 : NULL;
+    } else if (rest && g_hostname_is_ip_address(spec)) {
+        // IPv6 address without port
+        host = g_strdup(spec);
+        rest = NULL;
+    } else {
+        host = rest ? g_strndup(spec, rest - spec) : g_strdup(spec);
+    }
+    parts = g_strsplit(rest ? rest + 1 : "", ":", 2);
+    if (rest) {
+        dest->port = atoi(parts[0]);
+        if (parts[1])
+            dest->dscp = atoi(parts[1]);
+    }
+    g_strfreev(parts);
+    ok = *host && dest->port > 0 && dest->port < 65535 && dest->dscp >= -1 && dest->dscp < 64;
+    if (ok)
+        dest->host = host;
+    else
+        g_free(host);
+    return ok;
+}
+
+static gboolean same_destination(const struct Destination *a, const struct Destination *b)
+{
+    return !strcmp(a->host, b->host) && a->port == b->port && a->dscp == b->dscp;
+}
+
+/* Index of the destination sending to the same host and port, -1 if none */
+static int find_destination(PipelineData *data, const struct Destination *dest)
+{
+    for (int i = 0; i < data->dest_count; i++) {
+        if (!strcmp(data->dests[i].host, dest->host) && data->dests[i].port == dest->port)
+            return i;
+    }
+    return -1;
+}
+
+/* Add or remove a destination in the multiudpsinks of a running pipeline */
+static void update_sink_clients(PipelineData *data, const struct Destination *dest, const char *action)
+{
+    static const char *const sinks[] = {"sink", "rtcp-sink"};
+
+    if (!data->pipeline)
+        return;
+    for (guint i = 0; i < G_N_ELEMENTS(sinks); i++) {
+        GstElement *sink = gst_bin_get_by_name(GST_BIN(data->pipeline), sinks[i]);
+
+        if (!sink)
+            continue;
+        // The RTP sink is an appsink in the batched modes, RTCP always takes the next port
+        if (i || data->udp_mode == UDP_MODE_UDPSINK)
+            g_signal_emit_by_name(sink, action, dest->host, dest->port + i);
+        gst_object_unref(sink);
+    }
+}
+
+/* All destinations as multiudpsink clients, one by one as the clients string can't hold IPv6 */
+static void add_sink_clients(PipelineData *data, GstElement *sink, int port_offset)
+{
+    for (int i = 0; i < data->dest_count; i++)
+        g_signal_emit_by_name(sink, "add", data->dests[i].host, data->dests[i].port + port_offset);
+}
+
+/* Start sending to a destination, takes its host */
+static gboolean add_destination(PipelineData *data, struct Destination *dest)
+{
+    if (data->dest_count == MAX_DESTINATIONS) {
+        g_printerr("Too many destinations, %s:%d not added\n", dest->host, dest->port);
+        g_free(dest->host);
+        return FALSE;
+    }
+    if (find_destination(data, dest) >= 0) {
+        // Sending twice would double the packets the receiver gets
+        g_print("Already sending to %s:%d\n", dest->host, dest->port);
+        g_free(dest->host);
+        return TRUE;
+    }
+    if (data->udp_mode != UDP_MODE_UDPSINK) {
+        dest->batch = udp_batch_new(dest->host, dest->port, data->udp_mode == UDP_MODE_GSO);
+        if (!dest->batch) {
+            g_free(dest->host);
+            return FALSE;
+        }
+        if (dest->dscp >= 0 && udp_batch_set_dscp(dest->batch, dest->dscp))
+            g_printerr("Can't set DSCP %d for %s: %s\n", dest->dscp, dest->host, strerror(errno));
+    } else if (data->dest_count && dest->dscp != data->dests[0].dscp) {
+        // multiudpsink has one socket for all of them
+        g_printerr("DSCP of %s:%d needs the mmsg or gso mode, it gets the one of %s\n",
+                   dest->host, dest->port, data->dests[0].host);
+    }
+    g_mutex_lock(&data->dest_lock);
+    data->dests[data->dest_count++] = *dest;
+    g_mutex_unlock(&data->dest_lock);
+    update_sink_clients(data, dest, "add");
+    g_print("Sending to %s:%d\n", dest->host, dest->port);
+    return TRUE;
+}
+
+static void remove_destination(PipelineData *data, int index)
+{
+    struct Destination dest = data->dests[index];
+
+    update_sink_clients(data, &dest, "remove");
+    g_mutex_lock(&data->dest_lock);
+    memmove(&data->dests[index], &data->dests[index + 1], (data->dest_count - index - 1) * sizeof(dest));
+    data->dest_count--;
+    if (dest.batch) {
+        struct udp_batch_stats stats;
+
+        udp_batch_get_stats(dest.batch, &stats);
+        data->dests_removed.packets += stats.packets;
+        data->dests_removed.sends += stats.sends;
+        data->dests_removed.gso_sends += stats.gso_sends;
+        data->dests_removed.errors += stats.errors;
+    }
+    g_mutex_unlock(&data->dest_lock);
+    g_print("Stopped sending to %s:%d\n", dest.host, dest.port);
+    udp_batch_free(dest.batch);
+    g_free(dest.host);
+}
+
+/*
+ * Destinations file: one host[:port[:dscp]] per line, # comments. Entries
+ * which are gone are removed and new ones added, the others keep streaming.
+ */
+static void load_destinations(PipelineData *data)
+{
+    struct Destination wanted[MAX_DESTINATIONS];
+    int count = 0;
+    gchar *contents;
+    gchar **lines;
+    GError *err = NULL;
+
+    if (!g_file_get_contents(data->dest_file, &contents, NULL, &err)) {
+        g_printerr("Can't read %s: %s\n", data->dest_file, err->message);
+        g_clear_error(&err);
+        return;
+    }
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    for (int i = 0; lines[i] && count < MAX_DESTINATIONS; i++) {
+        gchar *line = g_strstrip(lines[i]);
+
+        if (!*line || *line == '#')
+            continue;
+        if (!parse_destination(line, &wanted[count])) {
+            g_printerr("Bad destination %s in %s\n", line, data->dest_file);
+            continue;
+        }
+        wanted[count++].from_file = TRUE;
+    }
+    g_strfreev(lines);
+
+    for (int i = data->dest_count - 1; i >= 0; i--) {
+        int j;
+
+        if (!data->dests[i].from_file)
+            continue;
+        for (j = 0; j < count; j++) {
+            if (wanted[j].host && same_destination(&wanted[j], &data->dests[i]))
+                break;
+        }
+        if (j == count) {
+            remove_destination(data, i);
+        } else {
+            g_free(wanted[j].host);
+            wanted[j].host = NULL;
+        }
+    }
+    for (int j = 0; j < count; j++) {
+        int index;
+
+        if (!wanted[j].host)
+            continue;
+        // Entries repeating the command line destinations, or each other, are sent once
+        index = find_destination(data, &wanted[j]);
+        if (index >= 0 && !data->dests[index].from_file) {
+            g_free(wanted[j].host);
+            continue;
+        }
+        add_destination(data, &wanted[j]);
+    }
+}
+
+/* left,top,width,height in capture pixels and frame lines, or none for the whole frame */
+static gboolean parse_crop(const char *spec, struct OutputMode *mode)
+{
+    gchar **parts;
+    long value[4];
+    gboolean ok;
+
+    if (!g_ascii_strcasecmp(spec, "none")) {
+        mode->left = mode->top = mode->width = mode->height = 0;
+        return TRUE;
+    }
+    parts = g_strsplit(spec, ",", -1);
+    ok = g_strv_length(parts) == 4;
+    for (int i = 0; ok && i < 4; i++) {
+        char *end;
+
+        value[i] = strtol(parts[i], &end, 10);
+        ok = end != parts[i] && !*end && value[i] >= 0 && value[i] < 65536;
+    }
+    g_strfreev(parts);
+    if (!ok || value[2] < MIN_CROP || value[3] < MIN_CROP)
+        return FALSE;
+    mode->left = value[0];
+    mode->top = value[1];
+    mode->width = value[2];
+    mode->height = value[3];
+    return TRUE;
+}
+
+static gboolean parse_scale(const char *spec, struct OutputMode *mode)
+{
+    if (!g_ascii_strcasecmp(spec, "full"))
+        mode->scale = 1;
+    else if (!g_ascii_strcasecmp(spec, "half"))
+        mode->scale = 2;
+    else
+        return FALSE;
+    return TRUE;
+}
+
+/* Camera index, counted in the order of --device */
+static gboolean parse_camera(const char *spec, int count, gint *camera)
+{
+    char *end;
+    long value = strtol(spec, &end, 10);
+
+    if (end == spec || *end || value < 0 || value >= count)
+        return FALSE;
+    *camera = value;
+    return TRUE;
+}
+
+/* Bit rate in bit/s, within what the encoders take */
+static gboolean parse_bitrate(const char *spec, int *bitrate)
+{
+    char *end;
+    long value = strtol(spec, &end, 10);
+
+    if (end == spec || *end || value < BITRATE_LOWEST || value > BITRATE_HIGHEST)
+        return FALSE;
+    *bitrate = value;
+    return TRUE;
+}
+
+/*
+ * Output mode file: crop=<left,top,width,height>|none, scale=full|half and
+ * camera=<index> lines, # comments. What the file leaves out comes from the
+ * command line.
+ */
+static void load_output_mode(PipelineData *data)
+{
+    struct OutputMode mode = data->mode_arg;
+    gint camera = data->camera_arg;
+    gchar *contents;
+    gchar **lines;
+    GError *err = NULL;
+
+    if (!g_file_get_contents(data->mode_file, &contents, NULL, &err)) {
+        g_printerr("Can't read %s: %s\n", data->mode_file, err->message);
+        g_clear_error(&err);
+        return;
+    }
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    for (int i = 0; lines[i]; i++) {
+        gchar *line = g_strstrip(lines[i]);
+        gchar *value = strchr(line, '=');
+        gboolean ok = FALSE;
+
+        if (!*line || *line == '#')
+            continue;
+        if (value) {
+            *value++ = '\0';
+            g_strstrip(line);
+            value = g_strstrip(value);
+            if (!strcmp(line, "crop"))
+                ok = parse_crop(value, &mode);
+            else if (!strcmp(line, "scale"))
+                ok = parse_scale(value, &mode);
+            else if (!strcmp(line, "camera"))
+                ok = parse_camera(value, data->camera_count, &camera);
+        }
+        if (!ok)
+            g_printerr("Bad %s in %s\n", line, data->mode_file);
+    }
+    g_strfreev(lines);
+    data->mode_wanted = mode;
+    data->camera_wanted = camera;
+}
+
+/*
+ * Mode for the next pipeline: the crop fitted into the capture, even left
+ * and top to keep UYVY pixel pairs and the field order, width and height
+ * rounded down to whole 2x2 chroma blocks after halving in any field mode.
+ */
+static void resolve_output_mode(PipelineData *data, struct OutputMode *mode)
+{
+    int width = data->pix.width;
+    int height = data->pix.height;
+
+    *mode = data->mode_wanted;
+    if (data->auto_halved)
+        mode->scale = 2;
+    if (data->path != FRAME_PATH_CONVERT) {
+        mode->left = mode->top = 0;
+        mode->width = width;
+        mode->height = height;
+        mode->scale = 1;
+        return;
+    }
+    mode->left = CLAMP(mode->left, 0, width - MIN_CROP) & ~1;
+    mode->top = CLAMP(mode->top, 0, height - MIN_CROP) & ~1;
+    if (!mode->width || mode->left + mode->width > width)
+        mode->width = width - mode->left;
+    if (!mode->height || mode->top + mode->height > height)
+        mode->height = height - mode->top;
+    mode->width &= ~3;
+    mode->height &= ~7;
+}
+
+/* Frame size pushed to appsrc */
+static void output_size(PipelineData *data, const struct OutputMode *mode, int *width, int *height)
+{
+    *width = mode->width / mode->scale;
+    *height = (data->field_mode == FIELD_MODE_HALF ? mode->height / 2 : mode->height) / mode->scale;
+}
+
+/* Buffers kept pending in latest mode, both fields of a frame are pushed back to back */
+static guint latest_depth(PipelineData *data)
+{
+    return data->field_mode == FIELD_MODE_FRAME ? 1 : 2;
+}
+
+/* Pipeline creation and setup */
+static GstElement *create_and_setup_pipeline(PipelineData *data)
+{
+    GstElement *pipeline, *src, *convert, *capsfilter, *encoder, *encoder_capsfilter, *payloader, *sink;
+    GstElement *rtpbin, *rtcp_sink, *rtcp_src;
+    GObject *session = NULL;
+    GstBufferPool *pool = NULL;
+    GstBus *bus;
+    struct OutputMode mode;
+    GstVideoInfo info;
+    int out_width, out_height;
+    // Field modes send each field as a frame
+    int fps_n = data->field_mode == FIELD_MODE_FRAME ? data->fps_n : 2 * data->fps_n;
+    GstCaps *caps, *encoder_caps;
+
+    g_print("Creating new GStreamer pipeline...\n");
+    resolve_output_mode(data, &mode);
+    output_size(data, &mode, &out_width, &out_height);
+
+    /* Create elements */
+    pipeline = gst_pipeline_new("camera-h264-streamer");
+//    src = gst_element_factory_make("v4l2src", "source");
+    src = gst_element_factory_make("appsrc", "source");
+    convert = gst_element_factory_make("videoconvert", "converter");
+    capsfilter = gst_element_factory_make("capsfilter", "capsfilter");
+    select_encoder(data);
+    encoder = gst_element_factory_make(encoder_backends[data->encoder].factory, "encoder");
+    encoder_capsfilter = gst_element_factory_make("capsfilter", "encoder-capsfilter");
+    payloader = gst_element_factory_make("rtph264pay", "payloader");
+    if (data->udp_mode == UDP_MODE_UDPSINK)
+        sink = gst_element_factory_make("multiudpsink", "sink");
+    else
+        sink = gst_element_factory_make("appsink", "sink");
+    rtpbin = gst_element_factory_make("rtpbin", "rtpbin");
+    rtcp_sink = gst_element_factory_make("multiudpsink", "rtcp-sink");
+    rtcp_src = gst_element_factory_make("udpsrc", "rtcp-source");
+
+    /* Check if elements were created */
+    if (!pipeline || !src || !convert || !capsfilter || !encoder || !encoder_capsfilter || !payloader || !sink ||
+        !rtpbin || !rtcp_sink || !rtcp_src) {
+        g_printerr("Failed to create one or more GStreamer elements!\n");
+        if (pipeline) gst_object_unref(pipeline);
+        if (src) gst_object_unref(src);
+        if (convert) gst_object_unref(convert);
+        if (capsfilter) gst_object_unref(capsfilter);
+        if (encoder) gst_object_unref(encoder);
+        if (encoder_capsfilter) gst_object_unref(encoder_capsfilter);
+        if (payloader) gst_object_unref(payloader);
+        if (sink) gst_object_unref(sink);
+        if (rtpbin) gst_object_unref(rtpbin);
+        if (rtcp_sink) gst_object_unref(rtcp_sink);
+        if (rtcp_src) gst_object_unref(rtcp_src);
+        return NULL;
+    }
+
+    /* Set properties */
+//    g_object_set(src, "device", "/dev/video0", "norm", "PAL", NULL);
+//    caps = gst_caps_from_string("video/x-raw,format=UYVY,width=720,height=576,framerate=25/1");
+    caps = gst_caps_new_simple("video/x-raw",
+                               "format", G_TYPE_STRING, gst_video_format_to_string(data->format),
+                               "width", G_TYPE_INT, out_width,
+                               "height", G_TYPE_INT, out_height,
+                               "framerate", GST_TYPE_FRACTION, fps_n, data->fps_d,
+                               NULL);
+    g_object_set(G_OBJECT(src),
+                 "caps", caps,
+                 "is-live", TRUE,
+                 "format", GST_FORMAT_TIME,
+                 "stream-type", GST_APP_STREAM_TYPE_STREAM, // Mode PUSH
+                 NULL);
+    /* Bound the queue in frames, a byte limit would depend on the format */
+    gst_app_src_set_max_bytes(GST_APP_SRC(src), 0);
+    gst_app_src_set_max_buffers(GST_APP_SRC(src),
+                                data->backpressure == BACKPRESSURE_LATEST ? latest_depth(data) : data->queue_frames);
+    if (data->backpressure == BACKPRESSURE_BLOCK)
+        g_object_set(G_OBJECT(src), "block", TRUE, NULL);
+    else
+        gst_app_src_set_leaky_type(GST_APP_SRC(src), GST_APP_LEAKY_TYPE_DOWNSTREAM);
+    g_object_set(capsfilter, "caps", caps, NULL);
+    if (data->path == FRAME_PATH_CONVERT || data->path == FRAME_PATH_OPENCV)
+        gst_video_info_set_format(&info, data->format, out_width, out_height);
+    else
+        info = data->capture_info;
+    if (data->path == FRAME_PATH_CONVERT || data->path == FRAME_PATH_COPY) {
+        pool = create_buffer_pool(caps, GST_VIDEO_INFO_SIZE(&info));
+        if (!pool) {
+            g_printerr("Failed to create buffer pool.\n");
+            gst_caps_unref(caps);
+            gst_object_unref(pipeline);
+            return NULL;
+        }
+    }
+    gst_caps_unref(caps);
+
+    configure_encoder(data, encoder, out_width, out_height, (fps_n + data->fps_d / 2) / data->fps_d);
+    g_print("Encoder: %s, %dx%d from %dx%d at %d,%d\n", encoder_backends[data->encoder].factory,
+            out_width, out_height, mode.width, mode.height, mode.left, mode.top);
+
+    // Baseline has no frame reordering
+    encoder_caps = gst_caps_from_string(data->low_latency ?
+                                        "video/x-h264,profile=constrained-baseline,level=(string)4" :
+                                        "video/x-h264,profile=main,level=(string)4");
+    g_object_set(encoder_capsfilter, "caps", encoder_caps, NULL);
+    gst_caps_unref(encoder_caps);
+
+    g_object_set(payloader, "config-interval", -1, "mtu", MTU, "aggregate-mode", 1, NULL);
+    /* Every destination gets the packets of the one encode */
+    if (data->udp_mode == UDP_MODE_UDPSINK) {
+        add_sink_clients(data, sink, 0);
+        g_object_set(sink, "sync", FALSE, "loop", FALSE, NULL);
+        if (data->dest_count && data->dests[0].dscp >= 0)
+            g_object_set(sink, "qos-dscp", data->dests[0].dscp, NULL);
+        time_udpsink(data, sink);
+    } else {
+        GstAppSinkCallbacks callbacks;
+
+        memset(&callbacks, 0, sizeof(callbacks));
+        callbacks.new_sample = (GstFlowReturn (*)(GstAppSink *, gpointer))send_sample_cb;
+        g_object_set(sink, "sync", FALSE, "async", FALSE, "buffer-list", TRUE, NULL);
+        gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, data, NULL);
+    }
+    /* RTCP on the next port, receiver reports drive the bitrate */
+    gst_util_set_object_arg(G_OBJECT(rtpbin), "rtp-profile", "avpf");
+    if (data->fec_percentage)
+        g_signal_connect(rtpbin, "request-fec-encoder", G_CALLBACK(request_fec_encoder_cb), data);
+    add_sink_clients(data, rtcp_sink, 1);
+    g_object_set(rtcp_sink, "sync", FALSE, "async", FALSE, NULL);
+    if (data->dest_count && data->dests[0].dscp >= 0)
+        g_object_set(rtcp_sink, "qos-dscp", data->dests[0].dscp, NULL);
+    caps = gst_caps_from_string("application/x-rtcp");
+    g_object_set(rtcp_src, "port", data->port + 1, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    /* Add elements to the pipeline */
+    gst_bin_add_many(GST_BIN(pipeline), src, capsfilter, convert, encoder, encoder_capsfilter, payloader, sink,
+                     rtpbin, rtcp_sink, rtcp_src, NULL);
+
+    /* Link elements */
+    if (!gst_element_link_many(src, capsfilter, convert, encoder, encoder_capsfilter, payloader, NULL) ||
+        !gst_element_link_pads(payloader, "src", rtpbin, "send_rtp_sink_0") ||
+        !gst_element_link_pads(rtpbin, "send_rtp_src_0", sink, "sink") ||
+        !gst_element_link_pads(rtpbin, "send_rtcp_src_0", rtcp_sink, "sink") ||
+        !gst_element_link_pads(rtcp_src, "src", rtpbin, "recv_rtcp_sink_0")) {
+        g_printerr("Elements could not be linked.\n");
+        if (pool)
+            gst_object_unref(pool);
+        gst_object_unref(pipeline);
+        return NULL;
+    }
+
+    g_signal_emit_by_name(rtpbin, "get-internal-session", 0, &session);
+    if (session) {
+        g_object_set(session, "rtcp-min-interval", (guint64)RTCP_INTERVAL_MS * GST_MSECOND, NULL);
+        g_object_unref(session);
+    }
+
+    /* Get the bus and add a watch */
+    bus = gst_element_get_bus(pipeline);
+    data->bus_watch_id = gst_bus_add_watch(bus, (GstBusFunc)bus_call, data);
+    gst_object_unref(bus);
+
+    /* Add pad probe for activity check */
+    GstPad *src_pad = gst_element_get_static_pad(src, "src");
+    if (src_pad) {
+        data->pad_probe_id = gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)probe_buffer_cb, data, NULL);
+        gst_object_unref(src_pad);
+    } else {
+        g_printerr("Failed to get src pad.\n");
+    }
+    add_element_probe(encoder, "src", GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)probe_encoded_cb, data);
+    // The hardware encoder has no worker threads, pinning would only move the appsrc thread
+    if (CPU_COUNT(&data->encoder_cpus) && data->encoder != ENCODER_V4L2)
+        add_element_probe(encoder, "sink", GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                          (GstPadProbeCallback)probe_encoder_thread_cb, data);
+    add_element_probe(encoder, "src", GST_PAD_PROBE_TYPE_EVENT_UPSTREAM,
+                      (GstPadProbeCallback)probe_keyframe_request_cb, data);
+    add_element_probe(sink, "sink", (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      (GstPadProbeCallback)probe_sent_cb, data);
+    g_mutex_lock(&data->lock);
+    data->src = src;
+    data->pool = pool;
+    data->info = info;
+    data->mode = mode;
+    data->generation++;
+    g_mutex_unlock(&data->lock);
+    return pipeline;
+}
+
+/* Stop pipeline and free resources */
+static void stop_pipeline(PipelineData *data)
+{
+    GstBufferPool *pool;
+
+    if (!data->pipeline) return;
+
+    g_print("Stopping pipeline...\n");
+
+    /* Stop watchdog timer */
+    if (data->watchdog_timer_id) {
+        g_source_remove(data->watchdog_timer_id);
+        data->watchdog_timer_id = 0;
+    }
+
+    /* Remove pad probe */
+    if (data->pad_probe_id) {
+        GstElement *src = gst_bin_get_by_name(GST_BIN(data->pipeline), "source");
+        if (src) {
+            GstPad *src_pad = gst_element_get_static_pad(src, "src");
+            if (src_pad) {
+                gst_pad_remove_probe(src_pad, data->pad_probe_id);
+                gst_object_unref(src_pad);
+            }
+            gst_object_unref(src);
+        }
+        data->pad_probe_id = 0;
+    }
+
+    /* Detach the reader thread from the pipeline */
+    g_mutex_lock(&data->lock);
+    data->src = NULL;
+    pool = data->pool;
+    data->pool = NULL;
+    g_mutex_unlock(&data->lock);
+
+    /* Set pipeline to NULL state */
+    gst_element_set_state(data->pipeline, GST_STATE_NULL);
+
+    if (pool) {
+        gst_buffer_pool_set_active(pool, FALSE);
+        gst_object_unref(pool);
+    }
+
+    /* Remove bus watch */
+    if (data->bus_watch_id) {
+        g_source_remove(data->bus_watch_id);
+        data->bus_watch_id = 0;
+    }
+
+    /* Unref the pipeline to free all resources */
+    gst_object_unref(data->pipeline);
+    data->pipeline = NULL;
+    data->is_running = FALSE;
+    g_print("Pipeline stopped and resources released.\n");
+}
+
+/* Start pipeline */
+static void start_pipeline(PipelineData *data)
+{
+    if (data->is_running) {
+        return;
+    }
+
+    g_print("Starting pipeline...\n");
+    data->pipeline = create_and_setup_pipeline(data);
+
+    if (data->pipeline) {
+        gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
+        data->last_buffer_time = g_get_monotonic_time();
+        data->is_running = TRUE;
+        data->watchdog_timer_id = g_timeout_add(WATCHDOG_CHECK_MS, (GSourceFunc)check_pipeline_activity, data);
+        g_print("Pipeline started.\n");
+    } else {
+        g_printerr("Failed to create pipeline. Retrying in 5 seconds...\n");
+        g_timeout_add_seconds(5, (GSourceFunc)start_pipeline, data);
+    }
+}
+
+/* Ask the encoder for a key frame, so the receiver can start decoding right away */
+static void request_keyframe(PipelineData *data)
+{
+    GstElement *encoder = gst_bin_get_by_name(GST_BIN(data->pipeline), "encoder");
+    GstEvent *event;
+    GstPad *pad;
+
+    if (!encoder)
+        return;
+    g_atomic_int_set(&data->keyframe_pending, TRUE);
+    pad = gst_element_get_static_pad(encoder, "src");
+    if (pad) {
+        // Marked so the receiver request limit neither drops nor counts it
+        event = gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0);
+        gst_structure_set(gst_event_writable_structure(event), LOCAL_KEYFRAME_FIELD, G_TYPE_BOOLEAN, TRUE, NULL);
+        gst_pad_send_event(pad, event);
+        gst_object_unref(pad);
+    }
+    gst_object_unref(encoder);
+}
+
+/*
+ * Flush the pipeline and restart it in place: READY drops queued data and
+ * the encoder state, but keeps elements, caps and devices. A rebuild is the
+ * fallback if that fails or errors keep coming.
+ */
+static void reset_pipeline(PipelineData *data, const char *why)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (!data->pipeline)
+        return;
+    start_resume_timer(data, why);
+    if (now - data->last_reset > RESET_INTERVAL_US) {
+        data->last_reset = now;
+        g_print("Resetting pipeline in place...\n");
+        if (gst_element_set_state(data->pipeline, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE &&
+            gst_element_set_state(data->pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE) {
+            data->last_buffer_time = g_get_monotonic_time();
+            return;
+        }
+        g_printerr("In-place reset failed.\n");
+    }
+    g_print("Rebuilding pipeline...\n");
+    stop_pipeline(data);
+    start_pipeline(data);
+}
+
+/* An encoder which keeps failing is replaced by the next backend which is installed */
+static gboolean encoder_failed(PipelineData *data)
+{
+    if (!data->encoder_auto || g_atomic_int_add(&data->encoder_errors, 1) + 1 < ENCODER_ERRORS)
+        return FALSE;
+    for (int i = data->encoder + 1; i < ENCODER_BACKENDS; i++) {
+        if (!encoder_available(i))
+            continue;
+        g_printerr("%s keeps failing, switching to %s\n", encoder_backends[data->encoder].factory,
+                   encoder_backends[i].factory);
+        data->encoder = (enum encoder_backend)i;
+        g_atomic_int_set(&data->encoder_errors, 0);
+        start_resume_timer(data, "encoder fallback");
+        stop_pipeline(data);
+        start_pipeline(data);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* A new output size needs new caps all the way down, the pipeline is rebuilt for it */
+static void apply_output_mode(PipelineData *data, const char *why)
+{
+    struct OutputMode mode;
+
+    resolve_output_mode(data, &mode);
+    // Otherwise the next pipeline picks it up
+    if (!data->pipeline || !memcmp(&mode, &data->mode, sizeof(mode)))
+        return;
+    g_print("Output mode changed by %s, rebuilding the pipeline\n", why);
+    start_resume_timer(data, "mode change");
+    stop_pipeline(data);
+    start_pipeline(data);
+}
+
+/*
+ * Feed the encoder from another camera. The pipeline stays as it is, the
+ * capture threads change over at the next frame of the new camera and the
+ * push stage forces a key frame on it.
+ */
+static void switch_camera(PipelineData *data, const char *why)
+{
+    int camera = data->camera_wanted;
+
+    if (camera == g_atomic_int_get(&data->camera))
+        return;
+    g_print("Switching to camera %d, %s, by %s\n", camera, data->cameras[camera].device, why);
+    start_resume_timer(data, "camera switch");
+    g_atomic_int_inc(&data->switches);
+    // The push stage forces a key frame at the first frame of the camera
+    g_atomic_int_set(&data->keyframe_pending, TRUE);
+    g_mutex_lock(&data->capture_lock);
+    data->camera = camera;
+    // Timed only while frames flow, in standby the first one waits for the resume
+    data->switch_start = g_atomic_int_get(&data->standby) ? 0 : g_get_monotonic_time();
+    g_mutex_unlock(&data->capture_lock);
+}
+
+/* Keep everything allocated and the capture running, only stop feeding the encoder */
+static void standby_pipeline(PipelineData *data)
+{
+    if (g_atomic_int_get(&data->standby))
+        return;
+    g_atomic_int_set(&data->standby, TRUE);
+    g_atomic_int_set(&data->resume_pending, FALSE);
+    g_print("Pipeline in standby.\n");
+}
+
+static void resume_pipeline(PipelineData *data)
+{
+    gboolean standby = g_atomic_int_get(&data->standby);
+
+    start_resume_timer(data, standby ? "resume" : "start");
+    g_atomic_int_set(&data->standby, FALSE);
+    if (!data->pipeline) {
+        start_pipeline(data);
+        return;
+    }
+    request_keyframe(data);
+    if (standby)
+        g_print("Pipeline resumed.\n");
+}
+
+/* New signal handler that is a GLib callback */
+static gboolean signal_handler_restart(gpointer user_data)
+{
+    PipelineData *data = (PipelineData *)user_data;
+    g_print("Received SIGUSR1. Resuming the pipeline...\n");
+    resume_pipeline(data);
+    return G_SOURCE_CONTINUE; // Continue monitoring for the signal
+}
+
+static gboolean signal_handler_stop(gpointer user_data)
+{
+    PipelineData *data = (PipelineData *)user_data;
+    g_print("Received SIGUSR2. Pipeline to standby...\n");
+    standby_pipeline(data);
+    return G_SOURCE_CONTINUE; // Continue monitoring for the signal
+}
+
+static gboolean signal_handler_reload(gpointer user_data)
+{
+    PipelineData *data = (PipelineData *)user_data;
+    if (data->dest_file) {
+        g_print("Received SIGHUP. Reloading %s...\n", data->dest_file);
+        load_destinations(data);
+    }
+    if (data->mode_file) {
+        g_print("Received SIGHUP. Reloading %s...\n", data->mode_file);
+        load_output_mode(data);
+        apply_output_mode(data, "the mode file");
+        switch_camera(data, "the mode file");
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static int xioctl(int fd, int request, void *arg)
+{
+    int r;
+
+    do {
+        r = ioctl(fd, request, arg);
+    } while (r == -1 && errno == EINTR);
+
+    return r;
+}
+
+static void unmap_buffer(struct Buffers *buf)
+{
+    munmap(buf->start, buf->length);
+    if (buf->dmabuf_fd >= 0)
+        close(buf->dmabuf_fd);
+}
+
+static void buffer_set_unref(struct BufferSet *set)
+{
+    if (!g_atomic_int_dec_and_test(&set->refs))
+        return;
+    free(set->buffers);
+    free(set);
+}
+
+static int init_mmap(struct Camera *camera)
+{
+    PipelineData *pipeline = camera->owner;
+    struct BufferSet *set;
+
+    camera->reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    camera->reqbuf.memory = V4L2_MEMORY_MMAP;
+    camera->reqbuf.count = pipeline->num_buffers;
+    if (xioctl(camera->fd, VIDIOC_REQBUFS, &camera->reqbuf) == -1)
+    {
+        perror("VIDIOC_REQBUFS");
+        return -1;
+    }
+
+    // if (reqbuf.count < 2){
+    //   printf("Not enough buffer memory\n");
+    //   exit(EXIT_FAILURE);
+    // }
+    printf("buffers to be used %d\n", camera->reqbuf.count);
+    if (pipeline->zero_copy && camera->reqbuf.count <= MIN_QUEUED_BUFFERS)
+        printf("Only %d buffers granted, zero-copy frames will be dropped\n", camera->reqbuf.count);
+    g_atomic_int_set(&camera->dequeued_buffers, 0);
+
+    set = (BufferSet *)calloc(1, sizeof(BufferSet));
+    assert(set != NULL);
+    set->buffers = (Buffers *)calloc(camera->reqbuf.count, sizeof(Buffers));
+    assert(set->buffers != NULL);
+    set->refs = 1;
+
+    // Create the buffer memory maps
+    struct v4l2_buffer buffer;
+    for (unsigned int i = 0; i < camera->reqbuf.count; i++) {
+        struct Buffers *buf = &set->buffers[i];
+
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.type = camera->reqbuf.type;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.index = i;
+
+        // Note: VIDIOC_QUERYBUF, not VIDIOC_QBUF, is used here!
+        if (xioctl(camera->fd, VIDIOC_QUERYBUF, &buffer) == -1) {
+            perror("VIDIOC_QUERYBUF");
+            goto fail;
+        }
+
+        buf->length = buffer.length;
+        buf->index = i;
+        buf->dmabuf_fd = -1;
+        buf->set = set;
+        buf->camera = camera;
+        printf("Mapping %d bytes to %d (offset %d)\n", buffer.length, camera->fd, buffer.m.offset);
+        buf->start = mmap(NULL, buffer.length, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, camera->fd, buffer.m.offset);
+
+        if (buf->start == MAP_FAILED) {
+            perror("mmap");
+            goto fail;
+        }
+        set->count++;
+
+        if (pipeline->dmabuf) {
+            struct v4l2_exportbuffer expbuf;
+
+            memset(&expbuf, 0, sizeof(expbuf));
+            expbuf.type = camera->reqbuf.type;
+            expbuf.index = i;
+            expbuf.flags = O_CLOEXEC | O_RDONLY;
+            if (xioctl(camera->fd, VIDIOC_EXPBUF, &expbuf) == -1) {
+                perror("VIDIOC_EXPBUF");
+                goto fail;
+            }
+            buf->dmabuf_fd = expbuf.fd;
+        }
+    }
+    camera->set = set;
+    return 0;
+
+fail:
+    for (unsigned int i = 0; i < set->count; i++)
+        unmap_buffer(&set->buffers[i]);
+    buffer_set_unref(set);
+    return -1;
+}
+
+/* Capture formats in order of preference, the cheapest path to the encoder first */
+static const struct {
+    guint32 pixelformat;
+    GstVideoFormat format;
+} capture_formats[] = {
+    {V4L2_PIX_FMT_NV12, GST_VIDEO_FORMAT_NV12},
+    {V4L2_PIX_FMT_YUV420, GST_VIDEO_FORMAT_I420},
+    {V4L2_PIX_FMT_UYVY, GST_VIDEO_FORMAT_UYVY},
+    {V4L2_PIX_FMT_YUYV, GST_VIDEO_FORMAT_YUY2},
+    {V4L2_PIX_FMT_BGR24, GST_VIDEO_FORMAT_BGR},
+    {V4L2_PIX_FMT_RGB24, GST_VIDEO_FORMAT_RGB},
+    {V4L2_PIX_FMT_RGB565, GST_VIDEO_FORMAT_RGB16},
+};
+
+static GstVideoFormat capture_video_format(guint32 pixelformat)
+{
+    for (unsigned int i = 0; i < G_N_ELEMENTS(capture_formats); i++) {
+        if (capture_formats[i].pixelformat == pixelformat)
+            return capture_formats[i].format;
+    }
+    return GST_VIDEO_FORMAT_UNKNOWN;
+}
+
+/*
+ * Pick the capture format. The format requested for the encoder wins if the
+ * device delivers it directly, otherwise the first one in preference order.
+ */
+static guint32 choose_pixelformat(int fd, GstVideoFormat wanted)
+{
+    struct v4l2_fmtdesc fmtdesc;
+    unsigned int best = G_N_ELEMENTS(capture_formats);
+
+    memset(&fmtdesc, 0, sizeof(fmtdesc));
+    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    while (xioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
+        for (unsigned int i = 0; i < G_N_ELEMENTS(capture_formats); i++) {
+            if (capture_formats[i].pixelformat != fmtdesc.pixelformat)
+                continue;
+            printf("Device format: %s\n", fmtdesc.description);
+            if (capture_formats[i].format == wanted)
+                return fmtdesc.pixelformat;
+            if (i < best)
+                best = i;
+        }
+        fmtdesc.index++;
+    }
+    return best < G_N_ELEMENTS(capture_formats) ? capture_formats[best].pixelformat : 0;
+}
+
+/* Frame size closest to the one of the analog standard, or the largest one */
+static void choose_frame_size(int fd, guint32 pixelformat, guint32 *width, guint32 *height)
+{
+    struct v4l2_frmsizeenum size;
+    guint32 want_width = *width, want_height = *height;
+    guint32 best_width = 0, best_height = 0;
+
+    memset(&size, 0, sizeof(size));
+    size.pixel_format = pixelformat;
+    if (xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == -1)
+        return;                 // Keep the size of the standard
+
+    if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+        const struct v4l2_frmsize_stepwise *sw = &size.stepwise;
+
+        if (!want_width || !want_height) {
+            *width = sw->max_width;
+            *height = sw->max_height;
+            return;
+        }
+        *width = CLAMP(want_width, sw->min_width, sw->max_width);
+        *height = CLAMP(want_height, sw->min_height, sw->max_height);
+        if (sw->step_width > 1)
+            *width -= (*width - sw->min_width) % sw->step_width;
+        if (sw->step_height > 1)
+            *height -= (*height - sw->min_height) % sw->step_height;
+        return;
+    }
+
+    do {
+        if (size.discrete.width == want_width && size.discrete.height == want_height)
+            return;
+        if (size.discrete.width * size.discrete.height > best_width * best_height) {
+            best_width = size.discrete.width;
+            best_height = size.discrete.height;
+        }
+        size.index++;
+    } while (xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0);
+    *width = best_width;
+    *height = best_height;
+}
+
+static int init_device(struct Camera *camera)
+{
+    struct v4l2_format fmt;
+    struct v4l2_streamparm parm;
+    v4l2_std_id std;
+    gboolean has_std;
+    char format_code[5];
+
+    camera->fd = open(camera->device, O_RDWR);
+    if (camera->fd < 0) {
+        perror(camera->device);
+        return -1;
+    }
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.pixelformat = choose_pixelformat(camera->fd, camera->owner->format);
+    if (!fmt.fmt.pix.pixelformat) {
+        fprintf(stderr, "%s: no supported capture format\n", camera->device);
+        goto fail;
+    }
+
+    // Analog standard gives the frame size, rate and field order
+    has_std = xioctl(camera->fd, VIDIOC_G_STD, &std) == 0 && std;
+    if (has_std && (std & V4L2_STD_525_60)) {
+        fmt.fmt.pix.width = 720;
+        fmt.fmt.pix.height = 480;
+        camera->fps_n = 30000;
+        camera->fps_d = 1001;
+    } else if (has_std) {
+        fmt.fmt.pix.width = 720;
+        fmt.fmt.pix.height = 576;
+        camera->fps_n = 25;
+        camera->fps_d = 1;
+    } else {
+        struct v4l2_format cur;
+
+        memset(&cur, 0, sizeof(cur));
+        cur.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (xioctl(camera->fd, VIDIOC_G_FMT, &cur) == 0) {
+            fmt.fmt.pix.width = cur.fmt.pix.width;
+            fmt.fmt.pix.height = cur.fmt.pix.height;
+        }
+        memset(&parm, 0, sizeof(parm));
+        parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (xioctl(camera->fd, VIDIOC_G_PARM, &parm) == 0 &&
+            parm.parm.capture.timeperframe.numerator && parm.parm.capture.timeperframe.denominator) {
+            camera->fps_n = parm.parm.capture.timeperframe.denominator;
+            camera->fps_d = parm.parm.capture.timeperframe.numerator;
+        } else {
+            camera->fps_n = 25;
+            camera->fps_d = 1;
+        }
+    }
+    camera->top_field_first = !(has_std && (std & V4L2_STD_525_60));
+    choose_frame_size(camera->fd, fmt.fmt.pix.pixelformat, &fmt.fmt.pix.width, &fmt.fmt.pix.height);
+    fmt.fmt.pix.field = has_std ? V4L2_FIELD_INTERLACED : V4L2_FIELD_ANY;
+
+    if (xioctl(camera->fd, VIDIOC_S_FMT, &fmt) == -1) {
+        perror("VIDIOC_S_FMT");
+        goto fail;
+    }
+    camera->capture_format = capture_video_format(fmt.fmt.pix.pixelformat);
+    if (camera->capture_format == GST_VIDEO_FORMAT_UNKNOWN) {
+        fprintf(stderr, "%s: driver switched to an unsupported format\n", camera->device);
+        goto fail;
+    }
+    camera->pix = fmt.fmt.pix;
+
+    struct v4l2_event_subscription sub;
+    memset(&sub, 0, sizeof(sub));
+    sub.type = V4L2_EVENT_SOURCE_CHANGE;
+    camera->source_events = xioctl(camera->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == 0;
+
+    // Layout of the capture buffers as GStreamer sees it
+    gst_video_info_set_format(&camera->capture_info, camera->capture_format,
+                              camera->pix.width, camera->pix.height);
+    if (!camera->pix.bytesperline) {
+        camera->pix.bytesperline = GST_VIDEO_INFO_PLANE_STRIDE(&camera->capture_info, 0);
+        camera->pix.sizeimage = GST_VIDEO_INFO_SIZE(&camera->capture_info);
+    } else {
+        GstVideoInfo *info = &camera->capture_info;
+        gsize offset = 0;
+
+        for (guint i = 0; i < GST_VIDEO_INFO_N_PLANES(info); i++) {
+            // Chroma planes of planar formats are subsampled in both directions
+            gint stride = i && GST_VIDEO_INFO_N_PLANES(info) == 3 ? camera->pix.bytesperline / 2
+                                                                  : camera->pix.bytesperline;
+
+            GST_VIDEO_INFO_PLANE_OFFSET(info, i) = offset;
+            GST_VIDEO_INFO_PLANE_STRIDE(info, i) = stride;
+            offset += stride * GST_VIDEO_FORMAT_INFO_SCALE_HEIGHT(info->finfo, i, camera->pix.height);
+        }
+        GST_VIDEO_INFO_SIZE(info) = MAX(offset, (gsize)camera->pix.sizeimage);
+    }
+
+    memcpy(format_code, &fmt.fmt.pix.pixelformat, 4);
+    format_code[4] = 0;
+    printf(
+        "Set format:\n"
+        " Width: %d\n"
+        " Height: %d\n"
+        " Bytes per line: %d\n"
+        " Pixel format: %s\n"
+        " Field: %d\n"
+        " Frame rate: %d/%d\n\n",
+        fmt.fmt.pix.width,
+        fmt.fmt.pix.height,
+        fmt.fmt.pix.bytesperline,
+        format_code,
+        fmt.fmt.pix.field,
+        camera->fps_n, camera->fps_d);
+
+    if (init_mmap(camera) == -1)
+        goto fail;
+    return camera->fd;
+
+fail:
+    close(camera->fd);
+    camera->fd = -1;
+    return -1;
+}
+
+static int queue_buffer(struct Camera *camera, unsigned int index)
+{
+    struct v4l2_buffer buffer;
+
+    /* Note that we set bytesused = 0, which will set it to the buffer length
+     * See
+     * - https://www.linuxtv.org/downloads/v4l-dvb-apis-new/uapi/v4l/vidioc-qbuf.html?highlight=vidioc_qbuf#description
+     * - https://www.linuxtv.org/downloads/v4l-dvb-apis-new/uapi/v4l/buffer.html#c.v4l2_buffer
+     */
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    buffer.index = index;
+
+    return xioctl(camera->fd, VIDIOC_QBUF, &buffer);
+}
+
+static int start_capturing(struct Camera *camera)
+{
+    enum v4l2_buf_type type;
+
+    printf("%s\n", __func__);
+    for (unsigned int i = 0; i < camera->set->count; i++) {
+        // Enqueue the buffer with VIDIOC_QBUF
+        if (queue_buffer(camera, i) == -1) {
+            perror("VIDIOC_QBUF");
+            return -1;
+        }
+        camera->set->buffers[i].queued = TRUE;
+    }
+
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (xioctl(camera->fd, VIDIOC_STREAMON, &type) == -1) {
+        perror("VIDIOC_STREAMON");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Restart streaming on the same fd and buffers. STREAMOFF takes back every
+ * queued buffer, the ones out of the driver come back through requeue_buffer().
+ */
+static int restream(struct Camera *camera)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int ret = 0;
+
+    g_mutex_lock(&camera->queue_lock);
+    if (xioctl(camera->fd, VIDIOC_STREAMOFF, &type) == -1) {
+        perror("VIDIOC_STREAMOFF");
+        ret = -1;
+    }
+    for (unsigned int i = 0; !ret && i < camera->set->count; i++) {
+        if (camera->set->buffers[i].queued && queue_buffer(camera, i) == -1) {
+            perror("VIDIOC_QBUF");
+            ret = -1;
+        }
+    }
+    if (!ret && xioctl(camera->fd, VIDIOC_STREAMON, &type) == -1) {
+        perror("VIDIOC_STREAMON");
+        ret = -1;
+    }
+    g_mutex_unlock(&camera->queue_lock);
+    return ret;
+}
+
+/* Stop and close the device. Buffers still in use are unmapped when they come back */
+static void close_device(struct Camera *camera)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    struct BufferSet *set = camera->set;
+
+    if (camera->fd < 0)
+        return;
+    xioctl(camera->fd, VIDIOC_STREAMOFF, &type);
+    g_mutex_lock(&camera->queue_lock);
+    camera->set = NULL;
+    for (unsigned int i = 0; set && i < set->count; i++) {
+        if (set->buffers[i].queued)
+            unmap_buffer(&set->buffers[i]);
+    }
+    g_mutex_unlock(&camera->queue_lock);
+    if (set)
+        buffer_set_unref(set);
+    close(camera->fd);
+    camera->fd = -1;
+}
+
+/* Caps and buffer pools are built for one capture layout, all devices must deliver it */
+static gboolean same_capture_format(const struct v4l2_pix_format *a, const struct v4l2_pix_format *b)
+{
+    return a->width == b->width && a->height == b->height && a->pixelformat == b->pixelformat &&
+           a->bytesperline == b->bytesperline;
+}
+
+static gboolean quit_main_loop(PipelineData *data)
+{
+    g_main_loop_quit(data->loop);
+    return G_SOURCE_REMOVE;
+}
+
+/* A capture thread can't go on: the main loop shuts everything down and the service restarts */
+static void stop_streaming(struct Camera *camera)
+{
+    PipelineData *pipeline = camera->owner;
+
+    close_device(camera);
+    g_atomic_int_set(&pipeline->exit_status, EXIT_FAILURE);
+    g_idle_add((GSourceFunc)quit_main_loop, pipeline);
+}
+
+/*
+ * Close and open the device again, the negotiated format must stay the
+ * same. Returns -1 to retry later and -2 if the capture has to stop.
+ */
+static int reopen_device(struct Camera *camera)
+{
+    struct v4l2_pix_format pix = camera->pix;
+
+    close_device(camera);
+    if (init_device(camera) < 0)
+        return -1;
+    if (!same_capture_format(&pix, &camera->pix)) {
+        // Caps and buffer pools are built for the old format, start over
+        fprintf(stderr, "%s: capture format changed, exiting\n", camera->device);
+        stop_streaming(camera);
+        return -2;
+    }
+    if (start_capturing(camera) == -1) {
+        close_device(camera);
+        return -1;
+    }
+    return 0;
+}
+
+/* Kernel capture timestamp, or the current time if it is not on CLOCK_MONOTONIC */
+static GstClockTime capture_timestamp(const struct v4l2_buffer *v4l2_buf)
+{
+    if ((v4l2_buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        return GST_TIMEVAL_TO_TIME(v4l2_buf->timestamp);
+    return latency_now();
+}
+
+/*
+ * Start of the frame on CLOCK_MONOTONIC. The pipeline runs on the default
+ * system clock, so the push stage only has to subtract the base time.
+ */
+static GstClockTime frame_start_time(struct Camera *camera, const struct v4l2_buffer *v4l2_buf)
+{
+    GstClockTime capture = capture_timestamp(v4l2_buf);
+
+    // Timestamp taken at the end of frame unless the driver says otherwise
+    if ((v4l2_buf->flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) != V4L2_BUF_FLAG_TSTAMP_SRC_SOE)
+        capture -= gst_util_uint64_scale_int(GST_SECOND, camera->fps_d, camera->fps_n);
+
+    return capture;
+}
+
+/* Hand the capture buffer back to the driver, buffers of a closed device are unmapped instead */
+static void requeue_buffer(struct Buffers *buf)
+{
+    struct Camera *camera = buf->camera;
+    struct BufferSet *set = buf->set;
+
+    g_mutex_lock(&camera->queue_lock);
+    if (set == camera->set) {
+        g_atomic_int_add(&camera->dequeued_buffers, -1);
+        buf->queued = TRUE;
+        if (queue_buffer(camera, buf->index) == -1)
+            perror("VIDIOC_QBUF");
+    } else {
+        unmap_buffer(buf);
+    }
+    g_mutex_unlock(&camera->queue_lock);
+    buffer_set_unref(set);
+}
+
+/**
+ * @param appsrc Елемент GstAppSrc.
+ * @param buffer Кадр для відправки.
+ * @param pts Мітка часу кадру.
+ * @param duration Тривалість кадру.
+ * @return GST_FLOW_OK або код помилки.
+ */
+static GstFlowReturn push_buffer_to_appsrc(GstElement *appsrc, GstBuffer *buffer,
+                                           GstClockTime pts, GstClockTime duration)
+{
+    GST_BUFFER_TIMESTAMP(buffer) = pts;
+    GST_BUFFER_DURATION(buffer) = duration;
+    return gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
+}
+
+static GstBuffer *mat_to_buffer(cv::Mat frame)
+{
+    if (frame.empty()) {
+        g_warning("Try to send empty frame.");
+        return NULL;
+    }
+
+    GstBuffer *buffer;
+    GstMapInfo map;
+
+    gsize data_size = frame.total() * frame.elemSize();
+    buffer = gst_buffer_new_allocate(NULL, data_size, NULL);
+
+    if (buffer == NULL) {
+        g_warning("Can't allocate GstBuffer.");
+        return NULL;
+    }
+
+    if (gst_buffer_map(buffer, &map, GST_MAP_WRITE)) {
+        memcpy(map.data, frame.data, data_size);
+        gst_buffer_unmap(buffer, &map);
+    } else {
+        g_warning("Can't show GstBuffer for writing.");
+        gst_buffer_unref(buffer);
+        return NULL;
+    }
+
+    return buffer;
+}
+
+/* Called by GStreamer when the last reference to a wrapped capture buffer is gone */
+static void release_capture_buffer(gpointer user_data)
+{
+    struct Buffers *buf = (struct Buffers *)user_data;
+
+    g_atomic_int_add(&buf->camera->owner->zero_copy_held, -1);
+    requeue_buffer(buf);
+}
+
+/* Describe the capture layout, bytesperline may differ from the default GStreamer stride */
+static void add_capture_meta(PipelineData *pipeline, GstBuffer *buffer)
+{
+    GstVideoInfo *info = &pipeline->capture_info;
+
+    gst_buffer_add_video_meta_full(buffer, GST_VIDEO_FRAME_FLAG_NONE, GST_VIDEO_INFO_FORMAT(info),
+                                   GST_VIDEO_INFO_WIDTH(info), GST_VIDEO_INFO_HEIGHT(info),
+                                   GST_VIDEO_INFO_N_PLANES(info), info->offset, info->stride);
+}
+
+/* Wrap a capture buffer into GstBuffer without copying the frame */
+static GstBuffer *wrap_capture_buffer(PipelineData *pipeline, struct Buffers *buf, gsize size)
+{
+    GstBuffer *buffer = gst_buffer_new();
+    GstMemory *mem;
+
+    if (pipeline->dmabuf) {
+        mem = gst_dmabuf_allocator_alloc_with_flags(pipeline->dmabuf_allocator, buf->dmabuf_fd,
+                                                    buf->length, GST_FD_MEMORY_FLAG_DONT_CLOSE);
+        gst_memory_resize(mem, 0, size);
+        gst_mini_object_set_qdata(GST_MINI_OBJECT(mem), g_quark_from_static_string("capture-buffer"),
+                                  buf, (GDestroyNotify)release_capture_buffer);
+    } else {
+        mem = gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY, buf->start, buf->length, 0, size,
+                                     buf, (GDestroyNotify)release_capture_buffer);
+    }
+    gst_buffer_append_memory(buffer, mem);
+    add_capture_meta(pipeline, buffer);
+    g_atomic_int_inc(&pipeline->zero_copy_held);
+    return buffer;
+}
+
+/* Denoise output lines [first, last) of the job which the band has just converted */
+static void denoise_band(struct ConvertJob *job, int first, int last)
+{
+    const struct frame_planes *planes = &job->planes;
+    const struct frame_planes *ref = &job->ref;
+    struct denoise_sums sums = {0, 0};
+    struct timespec start, end;
+    int chroma_planes = job->format == FRAME_FORMAT_NV12 ? 1 : 2;
+    int chroma_width = job->format == FRAME_FORMAT_NV12 ? job->out_width : job->out_width / 2;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    denoise_plane(planes->data[0] + first * planes->stride[0], planes->stride[0],
+                  ref->data[0] + first * ref->stride[0], ref->stride[0], job->out_width, last - first,
+                  job->strength, &sums);
+    for (int i = 1; job->denoise_chroma && i <= chroma_planes; i++) {
+        denoise_plane(planes->data[i] + first / 2 * planes->stride[i], planes->stride[i],
+                      ref->data[i] + first / 2 * ref->stride[i], ref->stride[i], chroma_width,
+                      (last - first) / 2, job->strength, &sums);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    __atomic_add_fetch(&job->denoise.cpu_ns,
+                       (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&job->denoise.sums.sad_in, sums.sad_in, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&job->denoise.sums.sad_out, sums.sad_out, __ATOMIC_RELAXED);
+}
+
+/* Convert a band of the job, bands are made of output line pairs to keep chroma lines whole */
+static void convert_band(void *arg, int band, int bands)
+{
+    struct ConvertJob *job = (struct ConvertJob *)arg;
+    int pairs = job->out_height / 2;
+    int first = pairs * band / bands;
+    int last = pairs * (band + 1) / bands;
+    const uint8_t *src = job->src + first * job->pair_lines * job->stride;
+    struct frame_planes planes = job->planes;
+    struct timespec start, end;
+
+    if (last <= first)
+        return;
+    planes.data[0] += 2 * first * planes.stride[0];
+    planes.data[1] += first * planes.stride[1];
+    planes.data[2] += first * planes.stride[2];
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    if (job->half)
+        convert_uyvy_half(src, job->stride, job->width, (last - first) * job->pair_lines, !job->double_lines,
+                          job->format, &planes);
+    else if (job->double_lines)
+        convert_uyvy_doubled(src, job->stride, job->width, last - first, job->format, &planes);
+    else
+        convert_uyvy(src, job->stride, job->width, 2 * (last - first), job->format, &planes);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    __atomic_add_fetch(&job->cpu_ns, (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec,
+                       __ATOMIC_RELAXED);
+    // While the band is still in the cache
+    if (job->ref.data[0])
+        denoise_band(job, 2 * first, 2 * last);
+}
+
+/*
+ * Denoise reference of frames or fields of one parity, NULL when the
+ * denoise is off. Sets fresh when it holds no frame yet.
+ */
+static guint8 *denoise_reference(PipelineData *pipeline, const GstVideoInfo *info, int parity, gboolean *fresh)
+{
+    gsize size = GST_VIDEO_INFO_SIZE(info);
+
+    if (!pipeline->denoise)
+        return NULL;
+    // The output size changed
+    if (pipeline->denoise_size != size) {
+        for (int i = 0; i < 2; i++) {
+            g_free(pipeline->denoise_ref[i]);
+            pipeline->denoise_ref[i] = (guint8 *)g_malloc(size);
+            pipeline->denoise_valid[i] = FALSE;
+        }
+        pipeline->denoise_size = size;
+    }
+    *fresh = !pipeline->denoise_valid[parity];
+    pipeline->denoise_valid[parity] = TRUE;
+    return pipeline->denoise_ref[parity];
+}
+
+/*
+ * Convert UYVY frame straight into a buffer from the pool, scaled as the target says.
+ * Height is the number of source lines, they are doubled when double_lines is set.
+ * Parity picks the denoise reference, fields of each parity have their own.
+ */
+static GstBuffer *convert_to_pool(PipelineData *pipeline, const struct OutputTarget *target,
+                                  const uint8_t *data, int stride, int height, gboolean double_lines, int parity)
+{
+    const GstVideoInfo *info = &target->info;
+    struct ConvertJob job;
+    GstBuffer *buffer;
+    GstMapInfo map;
+    guint8 *ref;
+    gboolean fresh = FALSE;
+
+    if (gst_buffer_pool_acquire_buffer(target->pool, &buffer, NULL) != GST_FLOW_OK)
+        return NULL;
+
+    if (!gst_buffer_map(buffer, &map, GST_MAP_WRITE)) {
+        g_warning("Can't map GstBuffer for writing.");
+        gst_buffer_unref(buffer);
+        return NULL;
+    }
+    job.src = data;
+    job.stride = stride;
+    job.width = target->mode.width;
+    job.height = height;
+    job.double_lines = double_lines;
+    job.half = target->mode.scale == 2;
+    job.out_width = GST_VIDEO_INFO_WIDTH(info);
+    job.out_height = GST_VIDEO_INFO_HEIGHT(info);
+    // Halving takes two lines per output line unless the field lines would be doubled
+    if (job.half)
+        job.pair_lines = double_lines ? 2 : 4;
+    else
+        job.pair_lines = double_lines ? 1 : 2;
+    job.cpu_ns = 0;
+    job.format = pipeline->format == GST_VIDEO_FORMAT_NV12 ? FRAME_FORMAT_NV12 : FRAME_FORMAT_I420;
+    for (int i = 0; i < 3; i++) {
+        job.planes.data[i] = map.data + GST_VIDEO_INFO_PLANE_OFFSET(info, i);
+        job.planes.stride[i] = GST_VIDEO_INFO_PLANE_STRIDE(info, i);
+    }
+    ref = denoise_reference(pipeline, info, parity, &fresh);
+    job.strength = fresh ? 0 : pipeline->denoise;
+    job.denoise_chroma = pipeline->denoise_chroma;
+    memset(&job.denoise, 0, sizeof(job.denoise));
+    for (int i = 0; i < 3; i++) {
+        job.ref.data[i] = ref ? ref + GST_VIDEO_INFO_PLANE_OFFSET(info, i) : NULL;
+        job.ref.stride[i] = job.planes.stride[i];
+    }
+    band_pool_run(pipeline->bands, convert_band, &job);
+    gst_buffer_unmap(buffer, &map);
+    g_mutex_lock(&pipeline->lock);
+    pipeline->converted.frames[job.half]++;
+    pipeline->converted.cpu_ns[job.half] += job.cpu_ns;
+    if (ref) {
+        pipeline->denoised.frames++;
+        pipeline->denoised.cpu_ns += job.denoise.cpu_ns;
+        pipeline->denoised.sums.sad_in += job.denoise.sums.sad_in;
+        pipeline->denoised.sums.sad_out += job.denoise.sums.sad_out;
+    }
+    g_mutex_unlock(&pipeline->lock);
+
+    return buffer;
+}
+
+/* Queue the frame for the push stage, it is dropped if the push stage is behind */
+static void output_frame(PipelineData *pipeline, const struct OutputTarget *target, GstBuffer *buffer,
+                         const struct CaptureFrame *frame, GstClockTime time, GstClockTime duration)
+{
+    struct OutputFrame out;
+
+    if (!buffer)
+        return;
+    out.buffer = buffer;
+    out.time = time;
+    out.duration = duration;
+    out.discont = frame->discont;
+    out.generation = target->generation;
+    out.camera = frame->camera;
+    out.trace = frame->trace;
+    out.trace.t[TRACE_CONVERT] = latency_now();
+    if (!pipeline->push_ring->push(out))
+        gst_buffer_unref(buffer);
+}
+
+/* Thumbnails of the frames or fields compared for skipping, FALSE if they can't be allocated */
+static gboolean skip_thumbs(PipelineData *pipeline, int width, int height)
+{
+    struct frame_thumb *cur = &pipeline->skip_cur;
+
+    // Follow the input format and the crop
+    if (cur->cells && cur->cols == width / FRAME_DIFF_CELL && cur->rows == height / FRAME_DIFF_CELL)
+        return TRUE;
+    frame_thumb_free(cur);
+    for (int i = 0; i < 2; i++) {
+        frame_thumb_free(&pipeline->skip_sent[i]);
+        pipeline->skip_valid[i] = FALSE;
+    }
+    return frame_thumb_init(cur, width, height) == 0 &&
+           frame_thumb_init(&pipeline->skip_sent[0], width, height) == 0 &&
+           frame_thumb_init(&pipeline->skip_sent[1], width, height) == 0;
+}
+
+/*
+ * Static scene and repeated field detection, TRUE if the frame or field
+ * can be dropped. Each parity is compared with the last one of its own
+ * parity which was sent, second_field is set for the second field of a
+ * frame whose first field was sent, it is also compared with that one.
+ * Nothing is skipped while a key frame is pending, the encoder makes it
+ * from the next frame it gets and the receiver would wait up to 1 / min_fps.
+ */
+static gboolean skip_frame(PipelineData *pipeline, const uint8_t *data, int stride, int width, int height,
+                           int parity, gboolean second_field, GstClockTime time)
+{
+    struct frame_thumb sent;
+    gboolean forced;
+
+    if (!pipeline->skip_threshold)
+        return FALSE;
+    if (!skip_thumbs(pipeline, width, height)) {
+        g_printerr("Can't allocate the frame thumbnails, skipping disabled\n");
+        pipeline->skip_threshold = 0;
+        return FALSE;
+    }
+    g_atomic_int_inc(&pipeline->skip_checked);
+    frame_thumb_build(&pipeline->skip_cur, data, stride, pipeline->skip_layout);
+    forced = g_atomic_int_compare_and_exchange(&pipeline->keyframe_pending, TRUE, FALSE);
+    if (!forced && second_field &&
+        frame_thumb_diff(&pipeline->skip_cur, &pipeline->skip_sent[!parity]) < pipeline->skip_threshold) {
+        g_atomic_int_inc(&pipeline->skipped_fields);
+        return TRUE;
+    }
+    // The receiver gets a frame every 1 / min_fps whatever happens
+    if (!forced && pipeline->skip_valid[parity] && time < pipeline->skip_last_sent + GST_SECOND / pipeline->min_fps &&
+        frame_thumb_diff(&pipeline->skip_cur, &pipeline->skip_sent[parity]) < pipeline->skip_threshold) {
+        g_atomic_int_inc(&pipeline->skipped_still);
+        return TRUE;
+    }
+    sent = pipeline->skip_sent[parity];
+    pipeline->skip_sent[parity] = pipeline->skip_cur;
+    pipeline->skip_cur = sent;
+    pipeline->skip_valid[parity] = TRUE;
+    pipeline->skip_last_sent = time;
+    return FALSE;
+}
+
+/*
+ * Split interlaced frame into two fields and output them in temporal order,
+ * each one with its own timestamp.
+ */
+static void convert_fields(PipelineData *pipeline, const struct OutputTarget *target, const uint8_t *data,
+                           int stride, const struct CaptureFrame *frame)
+{
+    const struct OutputMode *mode = &target->mode;
+    GstClockTime field_duration = frame->duration / 2;
+    gboolean top_first;
+    gboolean sent = FALSE;      // The previous field went out
+
+    if (frame->field == V4L2_FIELD_INTERLACED_TB)
+        top_first = TRUE;
+    else if (frame->field == V4L2_FIELD_INTERLACED_BT)
+        top_first = FALSE;
+    else
+        top_first = pipeline->top_field_first;
+
+    for (int i = 0; i < 2; i++) {
+        // Top field is made of even lines
+        int line = (i == 0) == top_first ? 0 : 1;
+
+        if (skip_frame(pipeline, data + line * stride, 2 * stride, mode->width, mode->height / 2, line,
+                       i == 1 && sent, frame->time + i * field_duration)) {
+            sent = FALSE;
+            continue;
+        }
+        sent = TRUE;
+        output_frame(pipeline, target,
+                     convert_to_pool(pipeline, target, data + line * stride, 2 * stride, mode->height / 2,
+                                     pipeline->field_mode == FIELD_MODE_BOB, line),
+                     frame, frame->time + i * field_duration, field_duration);
+    }
+}
+
+/* Copy the frame as captured into a buffer from the pool */
+static GstBuffer *copy_to_pool(PipelineData *pipeline, GstBufferPool *pool, const uint8_t *data, gsize size)
+{
+    GstBuffer *buffer;
+
+    if (gst_buffer_pool_acquire_buffer(pool, &buffer, NULL) != GST_FLOW_OK)
+        return NULL;
+    gst_buffer_fill(buffer, 0, data, MIN(size, gst_buffer_get_size(buffer)));
+    add_capture_meta(pipeline, buffer);
+    return buffer;
+}
+
+/* Black frame in the format pushed to appsrc. Flat, so it encodes to almost nothing */
+static GstBuffer *create_idle_frame(PipelineData *pipeline, const GstVideoInfo *info)
+{
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, GST_VIDEO_INFO_SIZE(info), NULL);
+    static const guint8 uyvy_black[4] = {0x80, 0x10, 0x80, 0x10};
+    static const guint8 yuy2_black[4] = {0x10, 0x80, 0x10, 0x80};
+    const guint8 *pattern = NULL;
+    GstMapInfo map;
+
+    if (!buffer || !gst_buffer_map(buffer, &map, GST_MAP_WRITE)) {
+        if (buffer)
+            gst_buffer_unref(buffer);
+        return NULL;
+    }
+    switch (GST_VIDEO_INFO_FORMAT(info)) {
+    case GST_VIDEO_FORMAT_NV12:
+    case GST_VIDEO_FORMAT_I420:
+        memset(map.data, 128, map.size);
+        memset(map.data + GST_VIDEO_INFO_PLANE_OFFSET(info, 0), 16,
+               GST_VIDEO_INFO_PLANE_STRIDE(info, 0) * GST_VIDEO_INFO_HEIGHT(info));
+        break;
+    case GST_VIDEO_FORMAT_UYVY:
+        pattern = uyvy_black;
+        break;
+    case GST_VIDEO_FORMAT_YUY2:
+        pattern = yuy2_black;
+        break;
+    default:
+        // RGB formats
+        memset(map.data, 0, map.size);
+        break;
+    }
+    for (gsize i = 0; pattern && i + 4 <= map.size; i += 4)
+        memcpy(map.data + i, pattern, 4);
+    gst_buffer_unmap(buffer, &map);
+    if (pipeline->path == FRAME_PATH_COPY || pipeline->path == FRAME_PATH_ZERO_COPY)
+        add_capture_meta(pipeline, buffer);
+    return buffer;
+}
+
+/* No-signal frame, all of them share the memory of the cached one */
+static void output_idle_frame(PipelineData *pipeline, const struct OutputTarget *target,
+                              const struct CaptureFrame *frame)
+{
+    // The encoder imports DMABUF only, it can't take a frame from system memory
+    if (pipeline->dmabuf || !target->generation)
+        return;
+    // The output mode changed the size
+    if (pipeline->idle_frame &&
+        (GST_VIDEO_INFO_WIDTH(&pipeline->idle_info) != GST_VIDEO_INFO_WIDTH(&target->info) ||
+         GST_VIDEO_INFO_HEIGHT(&pipeline->idle_info) != GST_VIDEO_INFO_HEIGHT(&target->info))) {
+        gst_buffer_unref(pipeline->idle_frame);
+        pipeline->idle_frame = NULL;
+    }
+    if (!pipeline->idle_frame) {
+        pipeline->idle_frame = create_idle_frame(pipeline, &target->info);
+        pipeline->idle_info = target->info;
+    }
+    if (pipeline->idle_frame)
+        output_frame(pipeline, target, gst_buffer_copy(pipeline->idle_frame), frame, frame->time, frame->duration);
+}
+
+/* Pool, layout and mode of the current pipeline */
+static void get_output_target(PipelineData *pipeline, struct OutputTarget *target)
+{
+    g_mutex_lock(&pipeline->lock);
+    target->pool = pipeline->pool ? (GstBufferPool *)gst_object_ref(pipeline->pool) : NULL;
+    target->info = pipeline->info;
+    target->mode = pipeline->mode;
+    target->generation = pipeline->generation;
+    g_mutex_unlock(&pipeline->lock);
+}
+
+/* Captured frame to GstBuffer(s), the crop only moves the start of the lines */
+static void convert_captured(PipelineData *pipeline, const struct OutputTarget *target,
+                             const struct CaptureFrame *frame)
+{
+    const int lineSize = pipeline->pix.bytesperline;
+    const struct OutputMode *mode = &target->mode;
+    struct Buffers *buf = frame->buf;
+    const uint8_t *dataBuf = (const uint8_t *)buf->start + mode->top * lineSize + mode->left * 2;
+    static Mat image;
+
+    // Don't blend or skip across a break in the input or a change of the output
+    if (frame->discont || memcmp(mode, &pipeline->convert_mode, sizeof(*mode))) {
+        pipeline->denoise_valid[0] = pipeline->denoise_valid[1] = FALSE;
+        pipeline->skip_valid[0] = pipeline->skip_valid[1] = FALSE;
+        pipeline->convert_mode = *mode;
+    }
+    if (pipeline->field_mode == FIELD_MODE_FRAME &&
+        skip_frame(pipeline, dataBuf, lineSize, mode->width, mode->height, 0, FALSE, frame->time)) {
+        requeue_buffer(buf);
+        return;
+    }
+
+    if (pipeline->path == FRAME_PATH_ZERO_COPY) {
+        // The buffer goes back to the driver once the encoder has released it
+        output_frame(pipeline, target, wrap_capture_buffer(pipeline, buf, frame->bytesused),
+                     frame, frame->time, frame->duration);
+        return;
+    }
+
+    if (pipeline->path == FRAME_PATH_OPENCV) {
+        // OpenCV reads straight from the capture buffer, it is requeued afterwards
+        cvtColor(Mat(mode->height, mode->width, CV_8UC2, (void *)dataBuf, lineSize), image, COLOR_YUV2BGR_UYVY);
+        output_frame(pipeline, target, mat_to_buffer(image), frame, frame->time, frame->duration);
+    } else if (!target->pool) {
+        // Pipeline is being restarted
+    } else if (pipeline->path == FRAME_PATH_COPY) {
+        output_frame(pipeline, target, copy_to_pool(pipeline, target->pool, dataBuf, frame->bytesused),
+                     frame, frame->time, frame->duration);
+    } else if (pipeline->field_mode != FIELD_MODE_FRAME) {
+        convert_fields(pipeline, target, dataBuf, lineSize, frame);
+    } else {
+        output_frame(pipeline, target, convert_to_pool(pipeline, target, dataBuf, lineSize, mode->height, FALSE, 0),
+                     frame, frame->time, frame->duration);
+    }
+    requeue_buffer(buf);
+}
+
+/* Convert stage: turn captured frame into GstBuffer(s) for the push stage */
+static void convert_frame(PipelineData *pipeline, const struct CaptureFrame *frame)
+{
+    struct OutputTarget target;
+
+    get_output_target(pipeline, &target);
+    if (!frame->buf)
+        output_idle_frame(pipeline, &target, frame);
+    else if (target.generation)
+        convert_captured(pipeline, &target, frame);
+    else
+        requeue_buffer(frame->buf);   // No pipeline was ever built
+    if (target.pool)
+        gst_object_unref(target.pool);
+}
+
+static void *convert_thread(void *arg)
+{
+    PipelineData *pipeline = (PipelineData *)arg;
+    struct CaptureFrame frame;
+
+    while (!g_atomic_int_get(&pipeline->quit)) {
+        if (pipeline->capture_ring->pop(frame, RING_WAIT_MS))
+            convert_frame(pipeline, &frame);
+    }
+    return NULL;
+}
+
+/* Copy a frame to the shared memory tap for local consumers, never waits for them */
+static void tap_frame(PipelineData *pipeline, const GstVideoInfo *info, GstBuffer *buffer, GstClockTime time)
+{
+    struct frame_ring_format format;
+    GstMapInfo map;
+
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+        return;
+    // A larger format after a reopen needs larger slots, the readers of the old ring are told to reopen
+    if (pipeline->tap && map.size > frame_ring_slot_size(pipeline->tap)) {
+        frame_ring_destroy(pipeline->tap);
+        pipeline->tap = NULL;
+    }
+    if (!pipeline->tap) {
+        pipeline->tap = frame_ring_create(DEFAULT_FRAME_RING_NAME, pipeline->tap_slots, map.size);
+        if (!pipeline->tap) {
+            g_printerr("Can't create the frame tap %s, disabled\n", DEFAULT_FRAME_RING_NAME);
+            pipeline->tap_slots = 0;
+            gst_buffer_unmap(buffer, &map);
+            return;
+        }
+        g_print("Frame tap %s: %u slots of %u bytes\n", DEFAULT_FRAME_RING_NAME, pipeline->tap_slots,
+                (guint)map.size);
+    }
+    memset(&format, 0, sizeof(format));
+    format.fourcc = gst_video_format_to_fourcc(GST_VIDEO_INFO_FORMAT(info));
+    // Packed RGB has no fourcc in GStreamer
+    if (GST_VIDEO_INFO_FORMAT(info) == GST_VIDEO_FORMAT_BGR)
+        format.fourcc = V4L2_PIX_FMT_BGR24;
+    format.width = GST_VIDEO_INFO_WIDTH(info);
+    format.height = GST_VIDEO_INFO_HEIGHT(info);
+    format.planes = MIN(GST_VIDEO_INFO_N_PLANES(info), FRAME_RING_MAX_PLANES);
+    for (guint i = 0; i < format.planes; i++) {
+        format.offset[i] = GST_VIDEO_INFO_PLANE_OFFSET(info, i);
+        format.stride[i] = GST_VIDEO_INFO_PLANE_STRIDE(info, i);
+    }
+    if (frame_ring_publish(pipeline->tap, map.data, map.size, time, &format) == 0)
+        g_atomic_int_inc(&pipeline->tap_frames);
+    gst_buffer_unmap(buffer, &map);
+}
+
+/* Push stage: timestamp frames in pipeline running time and feed appsrc */
+static void *push_thread(void *arg)
+{
+    PipelineData *pipeline = (PipelineData *)arg;
+    struct OutputFrame out;
+    GstElement *src;
+    GstBuffer *tap;
+    GstVideoInfo info;
+    guint generation;
+    int camera = -1;
+
+    while (!g_atomic_int_get(&pipeline->quit)) {
+        if (!pipeline->push_ring->pop(out, RING_WAIT_MS))
+            continue;
+        if (pipeline->backpressure == BACKPRESSURE_LATEST) {
+            struct OutputFrame newer;
+
+            // Skip to the newest converted frame (both fields in field modes), keeping a break in the timeline
+            while (pipeline->push_ring->size() >= latest_depth(pipeline) && pipeline->push_ring->try_pop(newer)) {
+                newer.discont |= out.discont;
+                gst_buffer_unref(out.buffer);
+                out = newer;
+                g_atomic_int_inc(&pipeline->stale_frames);
+            }
+        }
+
+        g_mutex_lock(&pipeline->lock);
+        src = pipeline->src ? (GstElement *)gst_object_ref(pipeline->src) : NULL;
+        info = pipeline->info;
+        generation = pipeline->generation;
+        g_mutex_unlock(&pipeline->lock);
+        // Made for the pipeline before a rebuild, it may not fit the new caps
+        if (out.generation != generation) {
+            if (src)
+                gst_object_unref(src);
+            gst_buffer_unref(out.buffer);
+            continue;
+        }
+        if (!src) {
+            if (pipeline->tap_slots)
+                tap_frame(pipeline, &info, out.buffer, out.time);
+            gst_buffer_unref(out.buffer);
+            continue;
+        }
+        // The tap copies the frame once the encoder has it
+        tap = pipeline->tap_slots ? gst_buffer_ref(out.buffer) : NULL;
+
+        GstClockTime base_time = gst_element_get_base_time(src);
+        GstClockTime pts = out.time > base_time ? out.time - base_time : 0;
+
+        out.trace.t[TRACE_PUSH] = latency_now();
+        latency_begin(pipeline->tracer, pts, &out.trace);
+        if (out.discont)
+            GST_BUFFER_FLAG_SET(out.buffer, GST_BUFFER_FLAG_DISCONT);
+        // Nothing before the first frame of another camera predicts it. appsrc queues the event in
+        // order with the buffers, so the key frame is this one and not one still in the queue
+        if (out.camera != camera) {
+            if (camera >= 0)
+                gst_element_send_event(src, gst_video_event_new_downstream_force_key_unit(
+                                                pts, GST_CLOCK_TIME_NONE, pts, TRUE, 0));
+            camera = out.camera;
+        }
+        push_buffer_to_appsrc(src, out.buffer, pts, out.duration);
+        gst_object_unref(src);
+        if (tap) {
+            tap_frame(pipeline, &info, tap, out.time);
+            gst_buffer_unref(tap);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Hand a frame to the convert stage, FALSE if its camera is not the active
+ * one or the ring is full. The capture threads of all cameras share the
+ * ring, the lock keeps it to one producer and puts a switch between two
+ * whole frames.
+ */
+static gboolean push_capture_frame(struct Camera *camera, struct CaptureFrame *frame)
+{
+    PipelineData *pipeline = camera->owner;
+    gboolean pushed = FALSE;
+    gint64 switch_us = -1;
+
+    g_mutex_lock(&pipeline->capture_lock);
+    if (camera->index != pipeline->camera) {
+        // Frames of this camera are the next thing it sends once it is selected
+        camera->discont = TRUE;
+        g_mutex_unlock(&pipeline->capture_lock);
+        return FALSE;
+    }
+    frame->camera = camera->index;
+    // Each camera runs on its own clock, the timeline must not go back at a switch
+    if (camera->index != pipeline->capture_camera && frame->time < pipeline->capture_last)
+        frame->time = pipeline->capture_last;
+    pushed = pipeline->capture_ring->push(*frame);
+    if (pushed) {
+        pipeline->capture_camera = camera->index;
+        pipeline->capture_last = frame->buf ? frame->time + frame->duration : frame->time;
+        if (pipeline->switch_start) {
+            switch_us = g_get_monotonic_time() - pipeline->switch_start;
+            pipeline->switch_start = 0;
+        }
+    }
+    g_mutex_unlock(&pipeline->capture_lock);
+
+    if (switch_us >= 0) {
+        // The camera was streaming all along, its next frame is at most a frame interval away
+        if (switch_us > 1000000LL * camera->fps_d / camera->fps_n)
+            g_atomic_int_inc(&pipeline->switches_late);
+        g_atomic_int_set(&pipeline->last_switch_us, switch_us);
+        g_print("Switched to %s in %.1f ms\n", camera->device, switch_us / 1000.0);
+    }
+    return pushed;
+}
+
+/**
+ * Capture stage: readout a frame from the buffers and pass it to the convert stage.
+ * @return 1 for a frame, 0 if there was none and -1 on a device error.
+ */
+static int read_frame(struct Camera *camera)
+{
+    PipelineData *pipeline = camera->owner;
+    struct v4l2_buffer buffer;
+    struct CaptureFrame frame;
+    struct frame_clock_tick tick;
+    gboolean active;
+
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    // Dequeue a buffer
+    if (xioctl(camera->fd, VIDIOC_DQBUF, &buffer) == -1) {
+        switch (errno)
+        {
+        case EAGAIN:
+            // No buffer in the outgoing queue
+            return 0;
+        case EIO:
+            // fall through
+        default:
+            perror("VIDIOC_DQBUF");
+            return -1;
+        }
+    }
+
+    assert(buffer.index < camera->set->count);
+    frame.buf = &camera->set->buffers[buffer.index];
+    frame.buf->queued = FALSE;
+    g_atomic_int_inc(&camera->set->refs);
+    g_atomic_int_inc(&camera->dequeued_buffers);
+    if (buffer.flags & V4L2_BUF_FLAG_ERROR) {
+        // Corrupted frame, typically while the signal is unstable
+        requeue_buffer(frame.buf);
+        return 0;
+    }
+    frame.field = buffer.field;
+    frame.bytesused = buffer.bytesused ? buffer.bytesused : camera->pix.sizeimage;
+    frame_clock_update(&camera->clock, frame_start_time(camera, &buffer), buffer.sequence, &tick);
+    frame.time = tick.time;
+    frame.duration = tick.duration;
+    frame.discont = tick.lost || tick.resync || camera->discont;
+    if (tick.lost)
+        g_atomic_int_add(&camera->lost_frames, tick.lost);
+    if (tick.resync)
+        g_atomic_int_inc(&camera->clock_resyncs);
+    memset(&frame.trace, 0, sizeof(frame.trace));
+    frame.trace.t[TRACE_CAPTURE] = capture_timestamp(&buffer);
+    frame.trace.t[TRACE_DEQUEUE] = latency_now();
+
+    g_mutex_lock(&pipeline->lock);
+    active = pipeline->src != NULL && !g_atomic_int_get(&pipeline->standby);
+    g_mutex_unlock(&pipeline->lock);
+    if (!active) {
+        // Whatever comes next follows a gap
+        camera->discont = TRUE;
+        goto requeue;
+    }
+
+    // Keep enough buffers queued so the driver never runs dry
+    if (g_atomic_int_get(&camera->dequeued_buffers) > (gint)(camera->reqbuf.count - MIN_QUEUED_BUFFERS)) {
+        g_atomic_int_inc(&pipeline->starved_frames);
+        goto requeue;
+    }
+    if (push_capture_frame(camera, &frame)) {
+        camera->discont = FALSE;
+        return 1;
+    }
+
+requeue:
+    requeue_buffer(frame.buf);
+    return 1;
+}
+
+/* Signal status of the current input from VIDIOC_ENUMINPUT, VIDIOC_QUERYSTD as the fallback */
+static enum signal_state query_signal(int fd)
+{
+    const guint32 lost = V4L2_IN_ST_NO_POWER | V4L2_IN_ST_NO_SIGNAL | V4L2_IN_ST_NO_H_LOCK | V4L2_IN_ST_NO_SYNC;
+    struct v4l2_input input;
+    gboolean has_status;
+    v4l2_std_id std = 0;
 
-    /* Unref the pipeline to free all resources */
-    gst_object_unref(data->pipeline);
-    data->pipeline = NULL;
-    data->is_running = FALSE;
-    g_print("Pipeline stopped and resources released.\n");
+    if (fd < 0)
+        return SIGNAL_UNKNOWN;
+    memset(&input, 0, sizeof(input));
+    has_status = xioctl(fd, VIDIOC_G_INPUT, &input.index) == 0 && xioctl(fd, VIDIOC_ENUMINPUT, &input) == 0;
+    if (has_status && (input.status & lost))
+        return SIGNAL_LOST;
+
+    // A clean status may also mean the driver does not report it
+    if (xioctl(fd, VIDIOC_QUERYSTD, &std) == 0)
+        return std == V4L2_STD_UNKNOWN ? SIGNAL_LOST : SIGNAL_PRESENT;
+    if (errno == ENOLINK || errno == ENODATA)
+        return SIGNAL_LOST;
+    return has_status ? SIGNAL_PRESENT : SIGNAL_UNKNOWN;
 }
 
-/* Start pipeline */
-static void start_pipeline(PipelineData *data)
+/* Drain pending events, returns TRUE if the source has changed */
+static gboolean source_changed(struct Camera *camera)
 {
-    if (data->is_running) {
-        return;
+    struct v4l2_event event;
+    gboolean changed = FALSE;
+
+    memset(&event, 0, sizeof(event));
+    while (xioctl(camera->fd, VIDIOC_DQEVENT, &event) == 0) {
+        if (event.type == V4L2_EVENT_SOURCE_CHANGE)
+            changed = TRUE;
     }
+    return changed;
+}
 
-    g_print("Starting pipeline...\n");
-    data->pipeline = create_and_setup_pipeline(data);
+/* Ask the convert stage for a no-signal frame, if the camera is the active one */
+static void queue_idle_frame(struct Camera *camera)
+{
+    PipelineData *pipeline = camera->owner;
+    struct CaptureFrame frame;
 
-    if (data->pipeline) {
-        gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
-        data->last_buffer_time = g_get_monotonic_time();
-        data->is_running = TRUE;
-        data->watchdog_timer_id = g_timeout_add(WATCHDOG_CHECK_MS, (GSourceFunc)check_pipeline_activity, data);
-        g_print("Pipeline started.\n");
-    } else {
-        g_printerr("Failed to create pipeline. Retrying in 5 seconds...\n");
-        g_timeout_add_seconds(5, (GSourceFunc)start_pipeline, data);
+    if (g_atomic_int_get(&pipeline->standby))
+        return;
+    memset(&frame, 0, sizeof(frame));
+    frame.time = latency_now();
+    frame.duration = IDLE_FRAME_MS * GST_MSECOND;
+    frame.discont = camera->discont;
+    frame.trace.t[TRACE_CAPTURE] = frame.time;
+    frame.trace.t[TRACE_DEQUEUE] = frame.time;
+    if (push_capture_frame(camera, &frame)) {
+        camera->discont = FALSE;
+        g_atomic_int_inc(&pipeline->idle_frames);
     }
 }
 
-/* New signal handler that is a GLib callback */
-static gboolean signal_handler_restart(gpointer user_data)
+static void enter_no_signal(struct Camera *camera)
 {
-    PipelineData *data = (PipelineData *)user_data;
-    g_print("Received SIGUSR1. Restarting the pipeline...\n");
-    stop_pipeline(data);
-    start_pipeline(data);
-    return G_SOURCE_CONTINUE; // Continue monitoring for the signal
+    printf("%s: no signal, sending idle frames\n", camera->device);
+    g_atomic_int_set(&camera->no_signal, TRUE);
+    frame_clock_reset(&camera->clock);
+    camera->discont = TRUE;
+    queue_idle_frame(camera);
 }
 
-static gboolean signal_handler_stop(gpointer user_data)
+static void report_recovery(struct Camera *camera, const char *how, gint64 stalled, gint64 recovering)
 {
-    PipelineData *data = (PipelineData *)user_data;
-    g_print("Received SIGUSR2. Stoping the pipeline...\n");
-    stop_pipeline(data);
-    return G_SOURCE_CONTINUE; // Continue monitoring for the signal
+    gint64 now = g_get_monotonic_time();
+    int ms = (now - stalled) / 1000;
+
+    g_atomic_int_set(&camera->owner->last_recovery_ms, ms);
+    g_print("%s: capture recovered by %s in %.1f ms, %d ms without frames\n",
+            camera->device, how, (now - recovering) / 1000.0, ms);
 }
 
-static int xioctl(int fd, int request, void *arg)
+/*
+ * Capture loop with stall recovery. A stall first restarts streaming on the
+ * same fd and buffers, which is enough for a short signal dropout. Only if
+ * that does not bring frames back the device is reopened. While the input
+ * reports no signal nothing is restarted, idle frames are sent instead.
+ */
+static void main_loop(struct Camera *camera)
 {
-    int r;
+    PipelineData *pipeline = camera->owner;
+    enum capture_state state = CAPTURE_STREAMING;
+    int frame_ms = 1000 * camera->fps_d / camera->fps_n + 1;
+    int stall_ms = STALL_FRAMES * frame_ms + STALL_SLACK_MS;
+    int attempts = 0;
+    gint64 last_frame = g_get_monotonic_time();
+    gint64 recovering = 0;
 
-    do {
-        r = ioctl(fd, request, arg);
-    } while (r == -1 && errno == EINTR);
+    while (!g_atomic_int_get(&pipeline->quit)) {
+        struct pollfd fds[1];
+        int timeout;
+        int r;
 
-    return r;
-}
+        switch (state) {
+        case CAPTURE_STREAMING:
+            timeout = stall_ms;
+            break;
+        case CAPTURE_RESTREAMED:
+        case CAPTURE_RESUMING:
+            // Frames must be back within two frame periods
+            timeout = 2 * frame_ms;
+            break;
+        case CAPTURE_NO_SIGNAL:
+            timeout = IDLE_FRAME_MS;
+            break;
+        default:
+            timeout = REOPEN_RETRY_MS;
+            break;
+        }
 
-static void init_mmap(PipelineData *pipeline)
-{
-    pipeline->reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    pipeline->reqbuf.memory = V4L2_MEMORY_MMAP;
-    pipeline->reqbuf.count = 3;
-    if (xioctl(pipeline->fd, VIDIOC_REQBUFS, &pipeline->reqbuf) == -1)
-    {
-        perror("VIDIOC_REQBUFS");
-        exit(errno);
-    }
+        fds[0].fd = camera->fd;
+        fds[0].events = POLLIN | POLLPRI;
+        fds[0].revents = 0;
+        r = poll(fds, 1, timeout);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
 
-    // if (reqbuf.count < 2){
-    //   printf("Not enough buffer memory\n");
-    //   exit(EXIT_FAILURE);
-    // }
-    printf("buffers to be used %d\n", pipeline->reqbuf.count);
+            perror("poll");
+            stop_streaming(camera);
+            return;
+        }
 
-    pipeline->buffers = (Buffers *)calloc(pipeline->reqbuf.count, sizeof(Buffers));
-    assert(pipeline->buffers != NULL);
+        if (r > 0 && (fds[0].revents & POLLPRI) && source_changed(camera)) {
+            enum signal_state signal = query_signal(camera->fd);
 
-    // Create the buffer memory maps
-    struct v4l2_buffer buffer;
-    for (unsigned int i = 0; i < pipeline->reqbuf.count; i++) {
-        memset(&buffer, 0, sizeof(buffer));
-        buffer.type = pipeline->reqbuf.type;
-        buffer.memory = V4L2_MEMORY_MMAP;
-        buffer.index = i;
+            if (signal == SIGNAL_LOST && state != CAPTURE_NO_SIGNAL) {
+                enter_no_signal(camera);
+                state = CAPTURE_NO_SIGNAL;
+                attempts = 0;
+                continue;
+            }
+            if (signal != SIGNAL_LOST && state == CAPTURE_NO_SIGNAL) {
+                printf("Signal is back\n");
+                recovering = g_get_monotonic_time();
+                state = CAPTURE_RESUMING;
+                continue;
+            }
+        }
 
-        // Note: VIDIOC_QUERYBUF, not VIDIOC_QBUF, is used here!
-        if (xioctl(pipeline->fd, VIDIOC_QUERYBUF, &buffer) == -1) {
-            perror("VIDIOC_QUERYBUF");
-            exit(errno);
+        if (r > 0 && (fds[0].revents & POLLIN)) {
+            r = read_frame(camera);
+            if (r > 0) {
+                if (state == CAPTURE_RESTREAMED)
+                    report_recovery(camera, "stream restart", last_frame, recovering);
+                else if (state == CAPTURE_REOPENED)
+                    report_recovery(camera, "device reopen", last_frame, recovering);
+                else if (state == CAPTURE_RESUMING || state == CAPTURE_NO_SIGNAL)
+                    report_recovery(camera, "signal return", last_frame,
+                                    state == CAPTURE_RESUMING ? recovering : g_get_monotonic_time());
+                g_atomic_int_set(&camera->no_signal, FALSE);
+                state = CAPTURE_STREAMING;
+                attempts = 0;
+                last_frame = g_get_monotonic_time();
+            }
+            if (r >= 0)
+                continue;
+        } else if (r > 0 && !(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))) {
+            // Only an event
+            continue;
         }
 
-        pipeline->buffers[i].length = buffer.length;
-        printf("Mapping %d bytes to %d (offset %d)\n", buffer.length, pipeline->fd, buffer.m.offset);
-        pipeline->buffers[i].start = mmap(NULL, buffer.length, PROT_READ | PROT_WRITE,
-                                          MAP_SHARED, pipeline->fd, buffer.m.offset);
+        // Timeout or device error
+        if (state == CAPTURE_NO_SIGNAL) {
+            if (r != 0)
+                g_usleep(IDLE_FRAME_MS * 1000); // Device keeps failing without signal, do not spin
+            if (query_signal(camera->fd) == SIGNAL_LOST) {
+                queue_idle_frame(camera);
+                continue;
+            }
+            printf("Signal is back\n");
+            recovering = g_get_monotonic_time();
+            state = CAPTURE_RESUMING;
+            continue;
+        }
+        if (query_signal(camera->fd) == SIGNAL_LOST) {
+            enter_no_signal(camera);
+            state = CAPTURE_NO_SIGNAL;
+            attempts = 0;
+            continue;
+        }
 
-        if (pipeline->buffers[i].start == MAP_FAILED) {
-            perror("mmap");
-            exit(errno);
+        // Stalled with a signal, or the driver does not report it
+        if (state == CAPTURE_STREAMING)
+            printf("%s: no frames for %d ms, restarting capture\n", camera->device,
+                   (int)((g_get_monotonic_time() - last_frame) / 1000));
+        recovering = g_get_monotonic_time();
+        if (camera->fd >= 0 && attempts < RESTREAM_ATTEMPTS && restream(camera) == 0) {
+            attempts++;
+            g_atomic_int_inc(&pipeline->restreams);
+            state = CAPTURE_RESTREAMED;
+            continue;
         }
+        printf("Reopening %s\n", camera->device);
+        attempts = 0;
+        g_atomic_int_inc(&pipeline->reopens);
+        r = reopen_device(camera);
+        if (r == -2)
+            return;
+        if (r == -1)
+            printf("Reopen failed, retrying in %d ms\n", REOPEN_RETRY_MS);
+        state = CAPTURE_REOPENED;
     }
 }
 
-static int init_device(PipelineData *pipeline)
+static void *video_reader(void *arg)
 {
-    struct v4l2_fmtdesc fmtdesc = {0};
-    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    int min = 0;
-    // Get the format with the largest index and use it
-
-    pipeline->fd = open(DEVICE, O_RDWR);
-    if (pipeline->fd < 0) {
-        perror(DEVICE);
-        return errno;
+    struct Camera *camera = (struct Camera *)arg;
+    rt_setup_thread(&camera->owner->capture_rt, camera->device);
+    if (start_capturing(camera) == -1) {
+        stop_streaming(camera);
+        return NULL;
     }
+    main_loop(camera);
+    close_device(camera);
+    return NULL;
+}
 
-    while (xioctl(pipeline->fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
-        fmtdesc.index++;
+/* Change the rate of the running encoder */
+static void set_encoder_bitrate(PipelineData *data, guint rate)
+{
+    GstElement *encoder = gst_bin_get_by_name(GST_BIN(data->pipeline), "encoder");
+    GstStructure *controls;
+
+    data->bitrate = rate;
+    if (!encoder || data->quantizer) {
+        if (encoder)
+            gst_object_unref(encoder);
+        return;
     }
-    printf("\nUsing format: %s\n", fmtdesc.description);
+    switch (data->encoder) {
+    case ENCODER_X264:
+        g_object_set(encoder, "bitrate", rate / 1000, NULL);
+        break;
+    case ENCODER_OPENH264:
+        g_object_set(encoder, "bitrate", rate, NULL);
+        break;
+    default:
+        // Only the rate, the rest was applied when the device was opened
+        controls = gst_structure_new("controls", "video_bitrate", G_TYPE_INT, rate, NULL);
+        g_object_set(encoder, "extra-controls", controls, NULL);
+        gst_structure_free(controls);
+        break;
+    }
+    gst_object_unref(encoder);
+}
 
-    struct v4l2_format fmt = {0};
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+/*
+ * Halve the output while the rate control holds the bitrate below
+ * --auto-half, a quarter of the pixels at the same rate looks better than
+ * a starved full frame. Full size comes back with some headroom and not
+ * sooner than AUTO_HALF_HOLD_S after the last change, every change costs
+ * a pipeline rebuild.
+ */
+static void check_auto_half(PipelineData *data)
+{
+    gint64 now = g_get_monotonic_time();
+    gboolean halve;
 
-    fmt.fmt.pix.width = WIDTH;
-    fmt.fmt.pix.height = HEIGTH;
-    fmt.fmt.pix.pixelformat = fmtdesc.pixelformat;
-    fmt.fmt.pix.field = V4L2_FIELD_INTERLACED; // V4L2_FIELD_ANY;
+    if (!data->auto_half || now - data->auto_half_time < AUTO_HALF_HOLD_S * G_USEC_PER_SEC)
+        return;
+    if (data->auto_halved)
+        halve = data->bitrate < data->auto_half * AUTO_HALF_HYSTERESIS;
+    else
+        halve = data->bitrate < data->auto_half;
+    if (halve == data->auto_halved)
+        return;
+    g_print("Rate %u kbit/s, %s\n", data->bitrate / 1000, halve ? "halving the output" : "output back to full size");
+    data->auto_halved = halve;
+    data->auto_half_time = now;
+    apply_output_mode(data, "the rate control");
+}
 
-    if (xioctl(pipeline->fd, VIDIOC_S_FMT, &fmt) == -1) {
-        perror("VIDIOC_S_FMT");
-        exit(errno);
+/*
+ * Feed new RTCP receiver reports about our stream to the rate control. The
+ * session keeps the last report block of any receiver with our source, so
+ * with several destinations all of them drive the one rate: it follows
+ * whichever reported last and a lossy one pulls the others down. Equal
+ * --min-bitrate and --max-bitrate pin it when the receivers differ.
+ */
+static gboolean check_receiver_reports(PipelineData *data)
+{
+    GstElement *rtpbin;
+    GObject *session = NULL;
+    GstStructure *stats = NULL;
+    const GValue *value;
+    GValueArray *sources;
+
+    if (!data->pipeline || g_atomic_int_get(&data->standby))
+        return G_SOURCE_CONTINUE;
+    rtpbin = gst_bin_get_by_name(GST_BIN(data->pipeline), "rtpbin");
+    if (!rtpbin)
+        return G_SOURCE_CONTINUE;
+    g_signal_emit_by_name(rtpbin, "get-internal-session", 0, &session);
+    gst_object_unref(rtpbin);
+    if (!session)
+        return G_SOURCE_CONTINUE;
+    g_object_get(session, "stats", &stats, NULL);
+    g_object_unref(session);
+    if (!stats)
+        return G_SOURCE_CONTINUE;
+
+    value = gst_structure_get_value(stats, "source-stats");
+    sources = value ? (GValueArray *)g_value_get_boxed(value) : NULL;
+    for (guint i = 0; sources && i < sources->n_values; i++) {
+        const GstStructure *source = gst_value_get_structure(&sources->values[i]);
+        gboolean internal = FALSE, have_rb = FALSE;
+        guint fraction, jitter, rtt, seq;
+        guint rate;
+
+        // Reports from the receiver are kept with our own source
+        if (!gst_structure_get_boolean(source, "internal", &internal) || !internal ||
+            !gst_structure_get_boolean(source, "have-rb", &have_rb) || !have_rb ||
+            !gst_structure_get_uint(source, "rb-fractionlost", &fraction) ||
+            !gst_structure_get_uint(source, "rb-jitter", &jitter) ||
+            !gst_structure_get_uint(source, "rb-round-trip", &rtt) ||
+            !gst_structure_get_uint(source, "rb-exthighestseq", &seq))
+            continue;
+        if (seq == data->rr_seq)
+            continue;
+        data->rr_seq = seq;
+        data->rr.loss = fraction / 256.0;
+        data->rr.jitter = jitter / 90;                    // 90 kHz RTP clock
+        data->rr.rtt = (guint)((guint64)rtt * 1000 / 65536); // 16.16 fixed point seconds
+        data->rr.time_ms = g_get_monotonic_time() / 1000;
+        rate = rate_control_update(&data->rate, &data->rr);
+        if (rate != data->bitrate)
+            set_encoder_bitrate(data, rate);
     }
+    gst_structure_free(stats);
+    check_auto_half(data);
+    return G_SOURCE_CONTINUE;
+}
 
-    char format_code[5];
-    strncpy(format_code, (char *)&fmt.fmt.pix.pixelformat, 5);
-    printf(
-        "Set format:\n"
-        " Width: %d\n"
-        " Height: %d\n"
-        " Pixel format: %s\n"
-        " Field: %d\n\n",
-        fmt.fmt.pix.width,
-        fmt.fmt.pix.height,
-        format_code,
-        fmt.fmt.pix.field);
+/* Media packets covered by FEC so far */
+static guint fec_protected(PipelineData *data)
+{
+    GstElement *fec;
+    guint count = 0;
 
-    init_mmap(pipeline);
-    return pipeline->fd;
+    if (!data->pipeline || !data->fec_percentage)
+        return 0;
+    fec = gst_bin_get_by_name(GST_BIN(data->pipeline), "fec");
+    if (fec) {
+        g_object_get(fec, "protected", &count, NULL);
+        gst_object_unref(fec);
+    }
+    return count;
 }
 
-static void start_capturing(PipelineData *pipeline)
+/* Frames waiting in appsrc and dropped by it */
+static void appsrc_stats(PipelineData *data, guint64 *level, guint64 *dropped)
 {
-    enum v4l2_buf_type type;
+    GstElement *src;
 
-    struct v4l2_buffer buffer;
-    printf("%s\n", __func__);
-    for (unsigned int i = 0; i < pipeline->reqbuf.count; i++) {
-        /* Note that we set bytesused = 0, which will set it to the buffer length
-         * See
-         * - https://www.linuxtv.org/downloads/v4l-dvb-apis-new/uapi/v4l/vidioc-qbuf.html?highlight=vidioc_qbuf#description
-         * - https://www.linuxtv.org/downloads/v4l-dvb-apis-new/uapi/v4l/buffer.html#c.v4l2_buffer
-         */
-        memset(&buffer, 0, sizeof(buffer));
-        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buffer.memory = V4L2_MEMORY_MMAP;
-        buffer.index = i;
+    *level = 0;
+    *dropped = 0;
+    g_mutex_lock(&data->lock);
+    src = data->src ? (GstElement *)gst_object_ref(data->src) : NULL;
+    g_mutex_unlock(&data->lock);
+    if (!src)
+        return;
+    *level = gst_app_src_get_current_level_buffers(GST_APP_SRC(src));
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(src), "dropped"))
+        g_object_get(G_OBJECT(src), "dropped", dropped, NULL);
+    gst_object_unref(src);
+}
 
-        // Enqueue the buffer with VIDIOC_QBUF
-        if (xioctl(pipeline->fd, VIDIOC_QBUF, &buffer) == -1) {
-            perror("VIDIOC_QBUF");
-            exit(errno);
-        }
+static const char *udp_mode_name(PipelineData *data, const struct SendReport *send)
+{
+    switch (data->udp_mode) {
+    case UDP_MODE_MMSG:
+        return "sendmmsg";
+    case UDP_MODE_GSO:
+        return send->gso ? "gso" : "sendmmsg (no gso)";
+    default:
+        return "udpsink";
     }
+}
 
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+static void send_report(PipelineData *data, struct SendReport *report)
+{
+    struct SendCounters now;
+    double frames, seconds;
 
-    if (xioctl(pipeline->fd, VIDIOC_STREAMON, &type) == -1) {
-        perror("VIDIOC_STREAMON");
-        exit(errno);
+    memset(report, 0, sizeof(*report));
+    // Totals over the destinations, including the ones removed
+    g_mutex_lock(&data->dest_lock);
+    now.batch = data->dests_removed;
+    now.batch.packets += data->send_packets;
+    report->gso = data->dest_count > 0;
+    for (int i = 0; i < data->dest_count; i++) {
+        struct udp_batch_stats stats;
+
+        udp_batch_get_stats(data->dests[i].batch, &stats);
+        now.batch.packets += stats.packets;
+        now.batch.sends += stats.sends;
+        now.batch.gso_sends += stats.gso_sends;
+        now.batch.errors += stats.errors;
+        report->gso = report->gso && udp_batch_gso(data->dests[i].batch);
+    }
+    now.batch.errors += data->send_dropped;
+    now.frames = data->send_frames;
+    now.cpu_ns = data->send_cpu_ns;
+    now.pace_ns = data->pace_ns;
+    report->pace_max_ms = data->pace_max_ns / 1e6;
+    data->pace_max_ns = 0;
+    report->pace_dropped = data->pace_ring ? data->pace_ring->dropped() : 0;
+    g_mutex_unlock(&data->dest_lock);
+    now.time = g_get_monotonic_time();
+    frames = now.frames - data->send_prev.frames;
+    seconds = (now.time - data->send_prev.time) / 1e6;
+    if (frames > 0) {
+        report->sends_per_frame = (now.batch.sends - data->send_prev.batch.sends) / frames;
+        report->cpu_us_per_frame = (now.cpu_ns - data->send_prev.cpu_ns) / frames / 1000;
+        report->pace_ms = (now.pace_ns - data->send_prev.pace_ns) / frames / 1e6;
     }
+    if (data->send_prev.time && seconds > 0)
+        report->packets_per_s = (now.batch.packets - data->send_prev.batch.packets) / seconds;
+    report->gso_sends = now.batch.gso_sends - data->send_prev.batch.gso_sends;
+    report->errors = now.batch.errors - data->send_prev.batch.errors;
+    data->send_prev = now;
 }
 
-static void stop_capturing(PipelineData *pipeline)
+/* RTP packets sent to a destination so far */
+static guint64 destination_packets(PipelineData *data, const struct Destination *dest)
 {
-    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    GstElement *sink;
+    GstStructure *stats = NULL;
+    guint64 packets = 0;
 
-    if (xioctl(pipeline->fd, VIDIOC_STREAMOFF, &type) == -1) {
-        perror("VIDIOC_STREAMOFF");
-        exit(errno);
+    if (dest->batch) {
+        struct udp_batch_stats batch;
+
+        udp_batch_get_stats(dest->batch, &batch);
+        return batch.packets;
+    }
+    if (!data->pipeline)
+        return 0;
+    sink = gst_bin_get_by_name(GST_BIN(data->pipeline), "sink");
+    if (!sink)
+        return 0;
+    g_signal_emit_by_name(sink, "get-stats", dest->host, dest->port, &stats);
+    gst_object_unref(sink);
+    if (stats) {
+        gst_structure_get_uint64(stats, "packets-sent", &packets);
+        gst_structure_free(stats);
     }
+    return packets;
 }
 
-/**
- * @param appsrc Елемент GstAppSrc.
- * @param frame Вхідний кадр OpenCV.
- * @param timestamp Поточна мітка часу (GST_CLOCK_TIME_NONE, якщо не використовується).
- * @return GST_FLOW_OK або код помилки.
- */
-GstFlowReturn push_mat_to_appsrc(GstElement *appsrc, cv::Mat frame)
+/* CPU use of the whole process since the previous report, in % of one core */
+static double cpu_report(PipelineData *data)
 {
-    if (frame.empty()) {
-        g_warning("Try to send empty frame.");
-        return GST_FLOW_ERROR;
-    }
+    struct rusage usage;
+    struct CpuUsage now;
+    double percent = 0;
 
-    GstFlowReturn ret;
-    GstBuffer *buffer;
-    GstMapInfo map;
+    getrusage(RUSAGE_SELF, &usage);
+    now.cpu = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL +
+              usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    now.time = g_get_monotonic_time();
+    if (data->cpu_prev.time && now.time > data->cpu_prev.time)
+        percent = 100.0 * (now.cpu - data->cpu_prev.cpu) / (now.time - data->cpu_prev.time);
+    data->cpu_prev = now;
+    return percent;
+}
 
-    gsize data_size = frame.total() * frame.elemSize();
-    buffer = gst_buffer_new_allocate(NULL, data_size, NULL);
+/*
+ * min_delta is the smallest P frame sent. A skipped frame barely differs
+ * from the one before, so it would have cost about that much; the mean of
+ * all frames would count key frames and motion and overstate the saving.
+ */
+static void skip_report(PipelineData *data, guint min_delta, struct SkipReport *report)
+{
+    struct SkipCounters now;
+    double seconds;
 
-    if (buffer == NULL) {
-        g_warning("Can't allocate GstBuffer.");
-        return GST_FLOW_ERROR;
-    }
+    now.checked = g_atomic_int_get(&data->skip_checked);
+    now.still = g_atomic_int_get(&data->skipped_still);
+    now.fields = g_atomic_int_get(&data->skipped_fields);
+    now.time = g_get_monotonic_time();
+    memset(report, 0, sizeof(*report));
+    report->checked = now.checked - data->skip_prev.checked;
+    report->still = now.still - data->skip_prev.still;
+    report->fields = now.fields - data->skip_prev.fields;
+    seconds = (now.time - data->skip_prev.time) / 1e6;
+    if (report->checked)
+        report->ratio = (double)(report->still + report->fields) / report->checked;
+    if (data->skip_prev.time && seconds > 0)
+        report->saved_kbps = (report->still + report->fields) * min_delta * 8.0 / seconds / 1000;
+    data->skip_prev = now;
+}
 
-    if (gst_buffer_map(buffer, &map, GST_MAP_WRITE)) {
-        memcpy(map.data, frame.data, data_size);
-        gst_buffer_unmap(buffer, &map);
-    } else {
-        g_warning("Can't show GstBuffer for writing.");
-        gst_buffer_unref(buffer);
-        return GST_FLOW_ERROR;
+static void convert_report(PipelineData *data, struct ConvertReport *report)
+{
+    struct ConvertCounters now;
+
+    g_mutex_lock(&data->lock);
+    now = data->converted;
+    g_mutex_unlock(&data->lock);
+    memset(report, 0, sizeof(*report));
+    for (int i = 0; i < 2; i++) {
+        report->frames[i] = now.frames[i] - data->convert_prev.frames[i];
+        if (report->frames[i])
+            report->cpu_us_per_frame[i] = (now.cpu_ns[i] - data->convert_prev.cpu_ns[i]) / 1000.0 / report->frames[i];
     }
+    data->convert_prev = now;
+}
 
-    GST_BUFFER_TIMESTAMP(buffer) = timestamp;
-    GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale_int(1, GST_SECOND, FPS);
-    ret = gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
+static void denoise_report(PipelineData *data, struct DenoiseReport *report)
+{
+    struct DenoiseCounters now;
+    guint64 frames, sad_in;
 
-    return ret;
+    g_mutex_lock(&data->lock);
+    now = data->denoised;
+    g_mutex_unlock(&data->lock);
+    frames = now.frames - data->denoise_prev.frames;
+    sad_in = now.sums.sad_in - data->denoise_prev.sums.sad_in;
+    memset(report, 0, sizeof(*report));
+    report->frames = frames;
+    if (frames)
+        report->cpu_us_per_frame = (now.cpu_ns - data->denoise_prev.cpu_ns) / 1000.0 / frames;
+    if (sad_in)
+        report->removed = 100.0 - 100.0 * (now.sums.sad_out - data->denoise_prev.sums.sad_out) / sad_in;
+    data->denoise_prev = now;
 }
 
-static void process_image(PipelineData *pipeline, int index, int fieldType)
+/* Mean and standard deviation of the encoded frame sizes */
+static void frame_size_stats(const struct FrameSizes *sizes, guint *mean, guint *stddev)
 {
-    const int lineSize = 1440;
-    char *dataBuf = (char *)pipeline->buffers->start;
-    static Mat frame, image;
-    
-    memcpy(incImage, dataBuf, HEIGTH * lineSize);
-    frame = Mat(HEIGTH, WIDTH, CV_8UC2, incImage);
-    cvtColor(frame, image, COLOR_YUV2BGR_UYVY);
-    push_mat_to_appsrc(pipeline->src, image.clone());
-}
+    double avg = sizes->frames ? (double)sizes->sum / sizes->frames : 0;
+    double var = sizes->frames ? (double)sizes->sum2 / sizes->frames - avg * avg : 0;
 
+    *mean = (guint)avg;
+    *stddev = var > 0 ? (guint)sqrt(var) : 0;
+}
 
-/**
- * Readout a frame from the buffers.
- */
-static int read_frame(PipelineData *pipeline)
+/* Camera feeding the encoder */
+static struct Camera *active_camera(PipelineData *data)
 {
-    static int fieldNum = V4L2_FIELD_ANY;
-    struct v4l2_buffer buffer;
-//    static int fCnt = 0;
-    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buffer.memory = V4L2_MEMORY_MMAP;
-    // Dequeue a buffer
-    if (xioctl(pipeline->fd, VIDIOC_DQBUF, &buffer) == -1) {
-        switch (errno)
-        {
-        case EAGAIN:
-            // No buffer in the outgoing queue
-            return 0;
-        case EIO:
-            // fall through
-        default:
-            perror("VIDIOC_DQBUF");
-            exit(errno);
-        }
-    }
+    return &data->cameras[g_atomic_int_get(&data->camera)];
+}
 
-    assert(buffer.index < pipeline->reqbuf.count);
-    process_image(pipeline, buffer.index, buffer.field);
+/* Stats as JSON, replaced atomically so readers never see a partial file */
+static void write_stats_file(PipelineData *data, const struct latency_summary *summary, unsigned int lost,
+                             guint64 level, guint64 dropped, const struct FrameSizes *sizes,
+                             const struct SendReport *send, const struct ConvertReport *convert,
+                             const struct DenoiseReport *denoise, const struct SkipReport *skip, double cpu)
+{
+    guint mean, stddev;
+    int width, height;
+    struct Camera *camera = active_camera(data);
+    GString *json = g_string_new(NULL);
+    GError *err = NULL;
 
-    // Enqueue the buffer again
-    if (xioctl(pipeline->fd, VIDIOC_QBUF, &buffer) == -1) {
-        perror("VIDIOC_QBUF");
-        exit(errno);
+    frame_size_stats(sizes, &mean, &stddev);
+    output_size(data, &data->mode, &width, &height);
+    g_string_append_printf(json,
+                           "{\"capture\":{\"queued\":%u,\"capacity\":%u,\"dropped\":%llu,\"starved\":%d},"
+                           "\"push\":{\"queued\":%u,\"capacity\":%u,\"dropped\":%llu,\"stale\":%d},"
+                           "\"appsrc\":{\"queued\":%llu,\"dropped\":%llu},"
+                           "\"output\":{\"width\":%d,\"height\":%d,\"crop\":[%d,%d,%d,%d],\"scale\":%d,"
+                           "\"auto_halved\":%s,\"full\":{\"frames\":%llu,\"cpu_us_per_frame\":%.1f},"
+                           "\"half\":{\"frames\":%llu,\"cpu_us_per_frame\":%.1f}},"
+                           "\"denoise\":{\"strength\":%d,\"chroma\":%s,\"frames\":%llu,\"cpu_us_per_frame\":%.1f,"
+                           "\"removed_percent\":%.1f},"
+                           "\"skip\":{\"threshold\":%u,\"min_fps\":%u,\"checked\":%u,\"static\":%u,\"fields\":%u,"
+                           "\"ratio\":%.3f,\"saved_kbps\":%.0f},"
+                           "\"encoder\":{\"backend\":\"%s\",\"threads\":%u,\"process_cpu_percent\":%.1f},"
+                           "\"encoded\":{\"frames\":%u,\"keyframes\":%u,\"mean\":%u,\"stddev\":%u,\"max\":%u},"
+                           "\"rtcp\":{\"bitrate\":%u,\"loss\":%.3f,\"jitter_ms\":%u,\"rtt_ms\":%u,"
+                           "\"keyframe_requests\":%d,\"keyframes_limited\":%d},"
+                           "\"fec\":{\"percentage\":%u,\"protected\":%u},"
+                           "\"send\":{\"mode\":\"%s\",\"packets_per_s\":%.0f,\"syscalls_per_frame\":%.2f,"
+                           "\"cpu_us_per_frame\":%.1f,\"gso_sends\":%llu,\"errors\":%llu,"
+                           "\"pace\":%u,\"pace_ms\":%.2f,\"pace_max_ms\":%.2f,\"pace_dropped\":%llu},"
+                           "\"source\":{\"lost\":%d,\"resyncs\":%d,\"drift_ppm\":%.1f},"
+                           "\"camera\":{\"active\":%d,\"device\":\"%s\",\"count\":%d,\"switches\":%d,\"late\":%d,"
+                           "\"last_switch_ms\":%.1f},"
+                           "\"recovery\":{\"restreams\":%d,\"reopens\":%d,\"last_ms\":%d},"
+                           "\"signal\":%s,\"idle_frames\":%d,\"standby\":%s,\"resume_ms\":%d,"
+                           "\"zero_copy_held\":%d,\"tap\":{\"slots\":%u,\"frames\":%d},"
+                           "\"lost_traces\":%u,\"latency_us\":{",
+                           data->capture_ring->size(), data->capture_ring->capacity(),
+                           data->capture_ring->dropped(), g_atomic_int_get(&data->starved_frames),
+                           data->push_ring->size(), data->push_ring->capacity(), data->push_ring->dropped(),
+                           g_atomic_int_get(&data->stale_frames),
+                           (unsigned long long)level, (unsigned long long)dropped,
+                           width, height, data->mode.left, data->mode.top, data->mode.width, data->mode.height,
+                           data->mode.scale, data->auto_halved ? "true" : "false",
+                           (unsigned long long)convert->frames[0], convert->cpu_us_per_frame[0],
+                           (unsigned long long)convert->frames[1], convert->cpu_us_per_frame[1],
+                           data->denoise, data->denoise_chroma ? "true" : "false",
+                           (unsigned long long)denoise->frames, denoise->cpu_us_per_frame, denoise->removed,
+                           data->skip_threshold, data->min_fps, skip->checked, skip->still, skip->fields,
+                           skip->ratio, skip->saved_kbps,
+                           encoder_backends[data->encoder].name, data->encoder_threads, cpu,
+                           sizes->frames, sizes->keyframes, mean, stddev, sizes->max,
+                           data->bitrate, data->rr.loss, data->rr.jitter, data->rr.rtt,
+                           g_atomic_int_get(&data->keyframe_requests), g_atomic_int_get(&data->keyframes_limited),
+                           data->fec_percentage, fec_protected(data),
+                           udp_mode_name(data, send), send->packets_per_s, send->sends_per_frame,
+                           send->cpu_us_per_frame, send->gso_sends, send->errors,
+                           data->pace, send->pace_ms, send->pace_max_ms, send->pace_dropped,
+                           g_atomic_int_get(&camera->lost_frames), g_atomic_int_get(&camera->clock_resyncs),
+                           frame_clock_drift_ppm(&camera->clock),
+                           camera->index, camera->device, data->camera_count,
+                           g_atomic_int_get(&data->switches), g_atomic_int_get(&data->switches_late),
+                           g_atomic_int_get(&data->last_switch_us) / 1000.0,
+                           g_atomic_int_get(&data->restreams), g_atomic_int_get(&data->reopens),
+                           g_atomic_int_get(&data->last_recovery_ms),
+                           g_atomic_int_get(&camera->no_signal) ? "false" : "true",
+                           g_atomic_int_get(&data->idle_frames),
+                           g_atomic_int_get(&data->standby) ? "true" : "false",
+                           g_atomic_int_get(&data->last_resume_ms),
+                           g_atomic_int_get(&data->zero_copy_held), data->tap_slots,
+                           g_atomic_int_get(&data->tap_frames), lost);
+    for (int i = 0; i < TRACE_STAGES; i++) {
+        g_string_append_printf(json, "%s\"%s\":{\"count\":%u,\"p50\":%u,\"p95\":%u,\"p99\":%u,\"max\":%u}",
+                               i ? "," : "", latency_stage_name(i), summary[i].count,
+                               summary[i].p50, summary[i].p95, summary[i].p99, summary[i].max);
     }
+    g_string_append(json, "},\"destinations\":[");
+    for (int i = 0; i < data->dest_count; i++) {
+        const struct Destination *dest = &data->dests[i];
 
-    return 1;
+        g_string_append_printf(json, "%s{\"host\":\"%s\",\"port\":%d,\"dscp\":%d,\"packets\":%llu}",
+                               i ? "," : "", dest->host, dest->port, dest->dscp,
+                               (unsigned long long)destination_packets(data, dest));
+    }
+    g_string_append(json, "]}\n");
+    if (!g_file_set_contents(data->stats_file, json->str, json->len, &err)) {
+        g_printerr("Can't write %s: %s\n", data->stats_file, err->message);
+        g_clear_error(&err);
+    }
+    g_string_free(json, TRUE);
 }
 
-static void main_loop(PipelineData *pipeline)
+/* Periodic report of the stage queues and frame latency */
+static gboolean print_stats(PipelineData *data)
 {
-    while (true) {
-
-        struct pollfd fds[2];
-        int r;
-        for (;;) {
-            fds[0].fd = pipeline->fd;                                                                                                                                                                                
-            fds[0].events = POLLIN;
-            r = poll(fds, 1, 200);
+    struct latency_summary summary[TRACE_STAGES];
+    unsigned int lost = latency_collect(data->tracer, summary);
+    guint64 level, dropped;
+    struct FrameSizes sizes;
+    struct SendReport send;
+    struct ConvertReport convert;
+    struct DenoiseReport denoise;
+    struct SkipReport skip;
+    guint mean, stddev;
+    double cpu = cpu_report(data);
+    struct Camera *camera = active_camera(data);
 
-            if (r == -1) {
-                if (errno == EINTR)
-                    continue;
+    appsrc_stats(data, &level, &dropped);
+    send_report(data, &send);
+    convert_report(data, &convert);
+    denoise_report(data, &denoise);
+    g_mutex_lock(&data->lock);
+    sizes = data->encoded;
+    memset(&data->encoded, 0, sizeof(data->encoded));
+    g_mutex_unlock(&data->lock);
+    frame_size_stats(&sizes, &mean, &stddev);
+    skip_report(data, sizes.min_delta, &skip);
+    g_print("%ssource: %s lost %d resyncs %d drift %+.1f ppm restreams %d reopens %d idle %d resume %d ms"
+            " | capture: queued %u/%u dropped %llu starved %d | push: queued %u/%u dropped %llu stale %d"
+            " | appsrc: queued %llu dropped %llu | zero-copy held %d | tap %u slots %d frames\n",
+            g_atomic_int_get(&data->standby) ? "standby | " : "",
+            g_atomic_int_get(&camera->no_signal) ? "no signal" : "ok",
+            g_atomic_int_get(&camera->lost_frames), g_atomic_int_get(&camera->clock_resyncs),
+            frame_clock_drift_ppm(&camera->clock),
+            g_atomic_int_get(&data->restreams), g_atomic_int_get(&data->reopens),
+            g_atomic_int_get(&data->idle_frames), g_atomic_int_get(&data->last_resume_ms),
+            data->capture_ring->size(), data->capture_ring->capacity(), data->capture_ring->dropped(),
+            g_atomic_int_get(&data->starved_frames),
+            data->push_ring->size(), data->push_ring->capacity(), data->push_ring->dropped(),
+            g_atomic_int_get(&data->stale_frames), (unsigned long long)level, (unsigned long long)dropped,
+            g_atomic_int_get(&data->zero_copy_held), data->tap_slots, g_atomic_int_get(&data->tap_frames));
+    g_print("encoder: %s threads %u, process cpu %.0f%%"
+            " | encoded: %u frames, %u key, size mean %u stddev %u max %u bytes"
+            " | rate %u kbit/s, receiver: loss %.1f%% jitter %u ms rtt %u ms key frame requests %d limited %d"
+            " | fec %u%% protected %u\n",
+            encoder_backends[data->encoder].name, data->encoder_threads, cpu,
+            sizes.frames, sizes.keyframes, mean, stddev, sizes.max,
+            data->bitrate / 1000, data->rr.loss * 100, data->rr.jitter, data->rr.rtt,
+            g_atomic_int_get(&data->keyframe_requests), g_atomic_int_get(&data->keyframes_limited),
+            data->fec_percentage, fec_protected(data));
+    if (data->camera_count > 1) {
+        g_print("camera: %d %s of %d | switches %d, %d slower than a frame interval (%.1f ms), last %.1f ms\n",
+                camera->index, camera->device, data->camera_count, g_atomic_int_get(&data->switches),
+                g_atomic_int_get(&data->switches_late), 1000.0 * data->fps_d / data->fps_n,
+                g_atomic_int_get(&data->last_switch_us) / 1000.0);
+    }
+    if (data->path == FRAME_PATH_CONVERT) {
+        int width, height;
 
-                perror("poll");
-                exit(errno);
-            }
+        output_size(data, &data->mode, &width, &height);
+        g_print("output: %dx%d from %dx%d at %d,%d%s | convert cpu/frame: full %.1f us (%llu frames),"
+                " half %.1f us (%llu frames)\n",
+                width, height, data->mode.width, data->mode.height, data->mode.left, data->mode.top,
+                data->auto_halved ? " auto halved" : "",
+                convert.cpu_us_per_frame[0], (unsigned long long)convert.frames[0],
+                convert.cpu_us_per_frame[1], (unsigned long long)convert.frames[1]);
+    }
+    if (data->skip_threshold) {
+        g_print("skip: %.0f%% of %u frames, %u static, %u repeated fields, about %.0f kbit/s saved\n",
+                skip.ratio * 100, skip.checked, skip.still, skip.fields, skip.saved_kbps);
+    }
+    if (data->denoise) {
+        g_print("denoise: strength %d %s, %llu frames, %.1f us cpu/frame, %.0f%% of the frame difference removed\n",
+                data->denoise, data->denoise_chroma ? "luma+chroma" : "luma", (unsigned long long)denoise.frames,
+                denoise.cpu_us_per_frame, denoise.removed);
+    }
+    if (data->udp_mode != UDP_MODE_UDPSINK) {
+        g_print("send: %s, %.0f packets/s, %.2f syscalls/frame, %.1f us cpu/frame, %llu gso sends, %llu errors"
+                " | pace %u%%, delay mean %.2f max %.2f ms, %llu frames dropped\n",
+                udp_mode_name(data, &send), send.packets_per_s, send.sends_per_frame, send.cpu_us_per_frame,
+                send.gso_sends, send.errors, data->pace, send.pace_ms, send.pace_max_ms, send.pace_dropped);
+    } else {
+        // multiudpsink doesn't tell its syscalls and errors
+        g_print("send: %s, %.0f packets/s, %.1f us cpu/frame\n",
+                udp_mode_name(data, &send), send.packets_per_s, send.cpu_us_per_frame);
+    }
+    g_print("destinations:");
+    for (int i = 0; i < data->dest_count; i++) {
+        g_print(" %s:%d dscp %d %llu packets", data->dests[i].host, data->dests[i].port, data->dests[i].dscp,
+                (unsigned long long)destination_packets(data, &data->dests[i]));
+    }
+    g_print("\n");
+    // p50/p95/p99/max in ms
+    g_print("latency ms (%u frames, %u lost):", summary[TRACE_CAPTURE].count, lost);
+    for (int i = 0; i < TRACE_STAGES; i++) {
+        g_print(" %s %.1f/%.1f/%.1f/%.1f", latency_stage_name(i),
+                summary[i].p50 / 1000.0, summary[i].p95 / 1000.0, summary[i].p99 / 1000.0, summary[i].max / 1000.0);
+    }
+    g_print("\n");
+    if (data->stats_file && *data->stats_file)
+        write_stats_file(data, summary, lost, level, dropped, &sizes, &send, &convert, &denoise, &skip, cpu);
+    return G_SOURCE_CONTINUE;
+}
 
-            if (!r) {
-                printf("poll timeout. Restart\n");
-                stop_capturing(pipeline);
-                init_device(pipeline);
-                start_capturing(pipeline);
-                continue;
-            }
-            read_frame(pipeline);
-            break;
-        }
+/* Pick the cheapest way from the negotiated capture format to the encoder */
+static gboolean choose_frame_path(PipelineData *data)
+{
+    if (data->zero_copy) {
+        data->path = FRAME_PATH_ZERO_COPY;
+        data->format = data->capture_format;
+    } else if (data->capture_format == GST_VIDEO_FORMAT_UYVY && data->format == GST_VIDEO_FORMAT_BGR) {
+        data->path = FRAME_PATH_OPENCV;
+    } else if (data->capture_format == GST_VIDEO_FORMAT_UYVY) {
+        data->path = FRAME_PATH_CONVERT;
+    } else {
+        if (data->format != data->capture_format)
+            g_print("No converter from %s, videoconvert will do it\n",
+                    gst_video_format_to_string(data->capture_format));
+        data->path = FRAME_PATH_COPY;
+        data->format = data->capture_format;
+    }
+    if (data->field_mode != FIELD_MODE_FRAME && data->path != FRAME_PATH_CONVERT) {
+        g_printerr("Field modes need UYVY capture and nv12 or i420 format\n");
+        return FALSE;
+    }
+    if (data->denoise && data->path != FRAME_PATH_CONVERT) {
+        g_printerr("Denoise needs UYVY capture and nv12 or i420 format, disabled\n");
+        data->denoise = 0;
     }
+    if ((data->mode_arg.width || data->mode_arg.scale > 1 || data->mode_file || data->auto_half) &&
+        data->path != FRAME_PATH_CONVERT) {
+        g_printerr("Crop and scale need UYVY capture and nv12 or i420 format, disabled\n");
+        data->auto_half = 0;
+    }
+    // Skipping looks at the captured luma
+    switch (data->capture_format) {
+    case GST_VIDEO_FORMAT_UYVY:
+        data->skip_layout = LUMA_UYVY;
+        break;
+    case GST_VIDEO_FORMAT_YUY2:
+        data->skip_layout = LUMA_YUYV;
+        break;
+    case GST_VIDEO_FORMAT_NV12:
+    case GST_VIDEO_FORMAT_I420:
+        data->skip_layout = LUMA_PLANAR;
+        break;
+    default:
+        if (data->skip_threshold)
+            g_printerr("Frame skipping needs YUV capture, disabled\n");
+        data->skip_threshold = 0;
+        break;
+    }
+    return TRUE;
 }
 
-static void release_reader(PipelineData *pipeline)
+/* Comma separated CPUs and ranges, e.g. 0,2-3 */
+static gboolean parse_cpu_list(const char *list, cpu_set_t *cpus)
 {
-    for (unsigned int i = 0; i < pipeline->reqbuf.count; i++)
-        munmap(pipeline->buffers[i].start, pipeline->buffers[i].length);
-    free(pipeline->buffers);
-    close(pipeline->fd);
+    gchar **parts = g_strsplit(list, ",", -1);
+    gboolean ok = TRUE;
+
+    CPU_ZERO(cpus);
+    for (int i = 0; ok && parts[i]; i++) {
+        char *end;
+        long first = strtol(parts[i], &end, 10);
+        long last = first;
+
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        ok = end != parts[i] && !*end && first >= 0 && first <= last && last < CPU_SETSIZE;
+        for (long cpu = first; ok && cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+    }
+    g_strfreev(parts);
+    return ok && CPU_COUNT(cpus);
 }
 
-static void *video_reader(void *arg)
+static void help(const char *name)
 {
-    PipelineData *data = (PipelineData *)arg;
-    init_device(data);
-    start_capturing(data);
-    main_loop(data);
-    stop_capturing(data);
-    release_reader(data);
-    return NULL;
+    g_print("Usage: %s [options] <destination_ip> [port]\n", name);
+    g_print("Options:\n");
+    g_print("  -i, --device <path>       V4L2 capture device, may be repeated for up to %d cameras which all\n",
+            MAX_CAMERAS);
+    g_print("                            keep streaming; they must capture the same format (default: %s)\n",
+            DEFAULT_DEVICE);
+    g_print("  -I, --camera <index>      Camera sent to the encoder, counted in the order of --device; a\n");
+    g_print("                            switch takes effect at the next frame with a key frame (default: 0)\n");
+    g_print("  -f, --format <format>     Format passed to the encoder: nv12, i420 or bgr (default: nv12)\n");
+    g_print("  -F, --field-mode <mode>   frame, bob (line-doubled fields) or half (half-height fields)\n");
+    g_print("                            Field modes send twice the capture frame rate (default: frame)\n");
+    g_print("  -z, --zero-copy           Pass capture buffers to the encoder without copying\n");
+    g_print("  -d, --dmabuf              Export capture buffers as DMABUF (implies --zero-copy)\n");
+    g_print("  -b, --buffers <count>     Number of capture buffers (default: %d, %d for zero-copy)\n",
+            CAPTURE_BUFFERS, CAPTURE_BUFFERS_ZERO_COPY);
+    g_print("  -t, --threads <count>     Threads converting each frame in bands (default: 1)\n");
+    g_print("  -B, --backpressure <mode> What to do when the encoder or network falls behind:\n");
+    g_print("                            latest (keep only the newest frame or field pair), drop-oldest or block\n");
+    g_print("                            (default: latest)\n");
+    g_print("  -Q, --queue <frames>      appsrc queue for drop-oldest and block (default: %d)\n", QUEUE_FRAMES);
+    g_print("  -N, --denoise <strength>  Motion-adaptive temporal denoise before the encoder, 1-%d, about 8 for\n",
+            DENOISE_MAX_STRENGTH);
+    g_print("                            analog video; needs UYVY capture and nv12 or i420 (default: 0, off)\n");
+    g_print("  -l, --denoise-luma        Denoise luma only, a third less CPU\n");
+    g_print("  -x, --skip-static <level> Drop frames and repeated fields which differ from the last one sent by\n");
+    g_print("                            less than this mean luma level in every 32x32 block, about 3 for\n");
+    g_print("                            analog video, 0 disables (default: 0)\n");
+    g_print("  -X, --min-fps <fps>       Frames sent per second at least while frames are skipped (default: %d)\n",
+            MIN_FPS);
+    g_print("  -c, --crop <left,top,width,height> Send only this part of the capture, in capture pixels and\n");
+    g_print("                            frame lines, e.g. 8,4,704,568 to drop the overscan, none for the\n");
+    g_print("                            whole frame; needs UYVY capture and nv12 or i420 (default: none)\n");
+    g_print("  -Z, --scale <scale>       full, or half for half width and height by a 2x2 box filter\n");
+    g_print("                            (default: full)\n");
+    g_print("  -O, --mode-file <path>    File of crop=..., scale=... and camera=... lines overriding --crop,\n");
+    g_print("                            --scale and --camera, reloaded on SIGHUP; a change of the size\n");
+    g_print("                            rebuilds the pipeline, a camera switch does not\n");
+    g_print("  -A, --auto-half <bit/s>   Halve the output while the rate control is below this rate and go\n");
+    g_print("                            back above %.1f times it, 0 disables (default: 0)\n", AUTO_HALF_HYSTERESIS);
+    g_print("  -L, --low-latency         Encoder profile without IDR bursts: constrained baseline, CBR with\n");
+    g_print("                            a one-frame CPB, intra refresh or short closed GOPs, sliced frames\n");
+    g_print("  -n, --slices <count>      Slices per frame with --low-latency (default: %d)\n", SLICES);
+    g_print("  -E, --encoder <backend>   H.264 encoder: auto (v4l2, then x264, then openh264, also when one\n");
+    g_print("                            keeps failing), v4l2, x264 or openh264 (default: auto)\n");
+    g_print("  -j, --encoder-threads <count> Threads of the software encoders, 0 lets them choose (default: 0)\n");
+    g_print("  -q, --quantizer <qp>      Constant quantiser of x264 instead of the bitrate, for comparing\n");
+    g_print("                            e.g. --denoise on and off on the same clip, 0 disables (default: 0)\n");
+    g_print("  -C, --encoder-cpus <list> CPUs of the software encoders, e.g. 2,3 or 2-3, not v4l2 (default: any)\n");
+    g_print("  -R, --rt-capture <spec>   Scheduling of the capture thread, e.g. fifo=60,cpus=1,mlock,stack=256k:\n");
+    g_print("                            fifo=<priority> or other=<nice>, cpus=<list> ('+' separated),\n");
+    g_print("                            mlock, stack=<bytes> to prefault, jitter to measure the wakeup\n");
+    g_print("                            latency (default: inherited)\n");
+    g_print("  -r, --bitrate <bit/s>     Starting encoder bitrate (default: %d)\n", BITRATE);
+    g_print("  -m, --min-bitrate <bit/s> Lowest rate the RTCP rate control may set (default: %d)\n", MIN_BITRATE);
+    g_print("  -M, --max-bitrate <bit/s> Highest rate the RTCP rate control may set (default: %d)\n", MAX_BITRATE);
+    g_print("  -P, --probe               Find the starting rate from the first receiver reports\n");
+    g_print("  -e, --fec <percent>       ULPFEC overhead, payload type %d, 0 disables (default: 0)\n", FEC_PT);
+    g_print("  -w, --fec-window <window> Packets one parity packet covers: frame (all packets of a frame)\n");
+    g_print("                            or packet (one packet each) (default: frame)\n");
+    g_print("  -u, --udp <mode>          How RTP packets are sent: udpsink (one syscall per packet), mmsg\n");
+    g_print("                            (sendmmsg per frame) or gso (UDP GSO, sendmmsg without it)\n");
+    g_print("                            (default: udpsink)\n");
+    g_print("  -p, --pace <percent>      Spread the packets of a frame over this share of the frame interval,\n");
+    g_print("                            0 sends them at once; needs mmsg or gso, picks mmsg otherwise\n");
+    g_print("                            (default: 0)\n");
+    g_print("  -a, --add <host[:port[:dscp]]> Another destination of the same stream, may be repeated;\n");
+    g_print("                            [ipv6]:port[:dscp] with a port, the receiver reports of all\n");
+    g_print("                            destinations feed the one rate control\n");
+    g_print("  -T, --dscp <value>        DSCP of the packets to <destination_ip> (default: unset)\n");
+    g_print("  -D, --destinations <path> File of host[:port[:dscp]] lines, reloaded on SIGHUP to add and\n");
+    g_print("                            remove destinations; DSCP per destination needs mmsg or gso\n");
+    g_print("  -k, --tap <slots>         Publish the frames fed to the encoder to the shared memory ring %s\n",
+            DEFAULT_FRAME_RING_NAME);
+    g_print("                            for local consumers, 0 disables (default: 0)\n");
+    g_print("  -s, --stats <seconds>     Interval of the stage queue report, 0 disables (default: %d)\n",
+            STATS_INTERVAL_S);
+    g_print("  -S, --stats-file <path>   JSON copy of the report, empty disables (default: %s)\n", STATS_FILE);
+    g_print("  -h, --help                Show this help message\n");
 }
 
 int main(int argc, char *argv[])
@@ -605,17 +4070,393 @@ int main(int argc, char *argv[])
     FILE *pid_file;
     GSource *signal_source_restart; // Restart
     GSource *signal_source_stop; // Stop
+    GSource *signal_source_reload; // Destinations and mode files
+    int opt;
+    int threads = 1;
+    int stats_interval = STATS_INTERVAL_S;
+    int bitrate = BITRATE, min_bitrate = MIN_BITRATE, max_bitrate = MAX_BITRATE;
+    gboolean probe = FALSE;
+    pthread_t convert_tid, push_tid, pace_tid;
+    struct Destination dests[MAX_DESTINATIONS];
+    int dest_count = 1;         // The first one is <destination_ip> [port]
+    int dscp = -1;
+    const char *camera_spec = NULL;
+
+    static struct option long_options[] = {
+        {"device", required_argument, NULL, 'i'},
+        {"camera", required_argument, NULL, 'I'},
+        {"format", required_argument, NULL, 'f'},
+        {"field-mode", required_argument, NULL, 'F'},
+        {"zero-copy", no_argument, NULL, 'z'},
+        {"dmabuf", no_argument, NULL, 'd'},
+        {"buffers", required_argument, NULL, 'b'},
+        {"threads", required_argument, NULL, 't'},
+        {"backpressure", required_argument, NULL, 'B'},
+        {"queue", required_argument, NULL, 'Q'},
+        {"denoise", required_argument, NULL, 'N'},
+        {"denoise-luma", no_argument, NULL, 'l'},
+        {"skip-static", required_argument, NULL, 'x'},
+        {"min-fps", required_argument, NULL, 'X'},
+        {"crop", required_argument, NULL, 'c'},
+        {"scale", required_argument, NULL, 'Z'},
+        {"mode-file", required_argument, NULL, 'O'},
+        {"auto-half", required_argument, NULL, 'A'},
+        {"low-latency", no_argument, NULL, 'L'},
+        {"slices", required_argument, NULL, 'n'},
+        {"encoder", required_argument, NULL, 'E'},
+        {"encoder-threads", required_argument, NULL, 'j'},
+        {"quantizer", required_argument, NULL, 'q'},
+        {"encoder-cpus", required_argument, NULL, 'C'},
+        {"rt-capture", required_argument, NULL, 'R'},
+        {"bitrate", required_argument, NULL, 'r'},
+        {"min-bitrate", required_argument, NULL, 'm'},
+        {"max-bitrate", required_argument, NULL, 'M'},
+        {"probe", no_argument, NULL, 'P'},
+        {"fec", required_argument, NULL, 'e'},
+        {"fec-window", required_argument, NULL, 'w'},
+        {"udp", required_argument, NULL, 'u'},
+        {"pace", required_argument, NULL, 'p'},
+        {"add", required_argument, NULL, 'a'},
+        {"dscp", required_argument, NULL, 'T'},
+        {"destinations", required_argument, NULL, 'D'},
+        {"tap", required_argument, NULL, 'k'},
+        {"stats", required_argument, NULL, 's'},
+        {"stats-file", required_argument, NULL, 'S'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
 
     /* Initialize GStreamer */
     gst_init(&argc, &argv);
 
     /* Parse arguments */
-    if (argc < 2) {
-        g_print("Usage: %s <destination_ip> [port]\n", argv[0]);
+    data.format = GST_VIDEO_FORMAT_NV12;
+    data.stats_file = STATS_FILE;
+    data.queue_frames = QUEUE_FRAMES;
+    data.slices = SLICES;
+    data.encoder_auto = TRUE;
+    data.fec_multipacket = TRUE;
+    data.denoise_chroma = TRUE;
+    data.min_fps = MIN_FPS;
+    data.mode_arg.scale = 1;
+    data.mode.scale = 1;
+    rt_config_init(&data.capture_rt);
+    while ((opt = getopt_long(argc, argv, "i:I:f:F:zdb:t:B:Q:N:lx:X:c:Z:O:A:Ln:E:j:q:C:R:r:m:M:Pe:w:u:p:a:T:D:k:s:S:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                if (data.camera_count == MAX_CAMERAS) {
+                    g_printerr("At most %d devices\n", MAX_CAMERAS);
+                    return 1;
+                }
+                data.cameras[data.camera_count++].device = optarg;
+                break;
+            case 'I':
+                camera_spec = optarg;   // Checked once all devices are known
+                break;
+            case 'f':
+                if (!g_ascii_strcasecmp(optarg, "nv12")) {
+                    data.format = GST_VIDEO_FORMAT_NV12;
+                } else if (!g_ascii_strcasecmp(optarg, "i420")) {
+                    data.format = GST_VIDEO_FORMAT_I420;
+                } else if (!g_ascii_strcasecmp(optarg, "bgr")) {
+                    data.format = GST_VIDEO_FORMAT_BGR;
+                } else {
+                    g_printerr("Unsupported format %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                if (!g_ascii_strcasecmp(optarg, "frame")) {
+                    data.field_mode = FIELD_MODE_FRAME;
+                } else if (!g_ascii_strcasecmp(optarg, "bob")) {
+                    data.field_mode = FIELD_MODE_BOB;
+                } else if (!g_ascii_strcasecmp(optarg, "half")) {
+                    data.field_mode = FIELD_MODE_HALF;
+                } else {
+                    g_printerr("Unsupported field mode %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                data.dmabuf = TRUE;
+                // fall through
+            case 'z':
+                data.zero_copy = TRUE;
+                break;
+            case 'b':
+                data.num_buffers = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'B':
+                if (!g_ascii_strcasecmp(optarg, "latest")) {
+                    data.backpressure = BACKPRESSURE_LATEST;
+                } else if (!g_ascii_strcasecmp(optarg, "drop-oldest")) {
+                    data.backpressure = BACKPRESSURE_DROP_OLDEST;
+                } else if (!g_ascii_strcasecmp(optarg, "block")) {
+                    data.backpressure = BACKPRESSURE_BLOCK;
+                } else {
+                    g_printerr("Unsupported backpressure mode %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'Q':
+                data.queue_frames = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'N':
+                data.denoise = CLAMP(atoi(optarg), 0, DENOISE_MAX_STRENGTH);
+                break;
+            case 'l':
+                data.denoise_chroma = FALSE;
+                break;
+            case 'x':
+                data.skip_threshold = MAX(atoi(optarg), 0);
+                break;
+            case 'X':
+                data.min_fps = MAX(atoi(optarg), 1);
+                break;
+            case 'c':
+                if (!parse_crop(optarg, &data.mode_arg)) {
+                    g_printerr("Bad crop %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'Z':
+                if (!parse_scale(optarg, &data.mode_arg)) {
+                    g_printerr("Unsupported scale %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'O':
+                data.mode_file = optarg;
+                break;
+            case 'A':
+                data.auto_half = MAX(atoi(optarg), 0);
+                break;
+            case 'L':
+                data.low_latency = TRUE;
+                break;
+            case 'n':
+                data.slices = atoi(optarg);
+                break;
+            case 'E':
+                data.encoder_auto = FALSE;
+                if (!g_ascii_strcasecmp(optarg, "auto")) {
+                    data.encoder_auto = TRUE;
+                    data.encoder = ENCODER_V4L2;
+                } else if (!g_ascii_strcasecmp(optarg, "v4l2")) {
+                    data.encoder = ENCODER_V4L2;
+                } else if (!g_ascii_strcasecmp(optarg, "x264")) {
+                    data.encoder = ENCODER_X264;
+                } else if (!g_ascii_strcasecmp(optarg, "openh264")) {
+                    data.encoder = ENCODER_OPENH264;
+                } else {
+                    g_printerr("Unsupported encoder %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'j':
+                data.encoder_threads = MAX(atoi(optarg), 0);
+                break;
+            case 'q':
+                data.quantizer = CLAMP(atoi(optarg), 0, 51);
+                break;
+            case 'C':
+                if (!parse_cpu_list(optarg, &data.encoder_cpus)) {
+                    g_printerr("Bad CPU list %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'R':
+                if (rt_config_parse(&data.capture_rt, optarg))
+                    return 1;
+                break;
+            case 'r':
+                if (!parse_bitrate(optarg, &bitrate)) {
+                    g_printerr("Bad bitrate %s, %d to %d bit/s\n", optarg, BITRATE_LOWEST, BITRATE_HIGHEST);
+                    return 1;
+                }
+                break;
+            case 'm':
+                if (!parse_bitrate(optarg, &min_bitrate)) {
+                    g_printerr("Bad bitrate %s, %d to %d bit/s\n", optarg, BITRATE_LOWEST, BITRATE_HIGHEST);
+                    return 1;
+                }
+                break;
+            case 'M':
+                if (!parse_bitrate(optarg, &max_bitrate)) {
+                    g_printerr("Bad bitrate %s, %d to %d bit/s\n", optarg, BITRATE_LOWEST, BITRATE_HIGHEST);
+                    return 1;
+                }
+                break;
+            case 'P':
+                probe = TRUE;
+                break;
+            case 'e':
+                data.fec_percentage = CLAMP(atoi(optarg), 0, 100);
+                break;
+            case 'w':
+                if (!g_ascii_strcasecmp(optarg, "frame")) {
+                    data.fec_multipacket = TRUE;
+                } else if (!g_ascii_strcasecmp(optarg, "packet")) {
+                    data.fec_multipacket = FALSE;
+                } else {
+                    g_printerr("Unsupported FEC window %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'u':
+                if (!g_ascii_strcasecmp(optarg, "udpsink")) {
+                    data.udp_mode = UDP_MODE_UDPSINK;
+                } else if (!g_ascii_strcasecmp(optarg, "mmsg")) {
+                    data.udp_mode = UDP_MODE_MMSG;
+                } else if (!g_ascii_strcasecmp(optarg, "gso")) {
+                    data.udp_mode = UDP_MODE_GSO;
+                } else {
+                    g_printerr("Unsupported UDP mode %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                data.pace = CLAMP(atoi(optarg), 0, 100);
+                break;
+            case 'a':
+                if (dest_count == MAX_DESTINATIONS) {
+                    g_printerr("At most %d destinations\n", MAX_DESTINATIONS);
+                    return 1;
+                }
+                if (!parse_destination(optarg, &dests[dest_count])) {
+                    g_printerr("Bad destination %s\n", optarg);
+                    return 1;
+                }
+                dest_count++;
+                break;
+            case 'T':
+                dscp = CLAMP(atoi(optarg), 0, 63);
+                break;
+            case 'D':
+                data.dest_file = optarg;
+                break;
+            case 'k':
+                data.tap_slots = MAX(atoi(optarg), 0);
+                break;
+            case 's':
+                stats_interval = atoi(optarg);
+                break;
+            case 'S':
+                data.stats_file = optarg;
+                break;
+            case 'h':
+                help(argv[0]);
+                return 0;
+            default:
+                help(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        help(argv[0]);
+        return 1;
+    }
+    if (!data.camera_count)
+        data.cameras[data.camera_count++].device = DEFAULT_DEVICE;
+    if (data.quantizer && (data.encoder != ENCODER_X264 || data.encoder_auto)) {
+        g_printerr("--quantizer needs --encoder x264\n");
+        return 1;
+    }
+    if (camera_spec && !parse_camera(camera_spec, data.camera_count, &data.camera_arg)) {
+        g_printerr("Bad camera %s\n", camera_spec);
+        return 1;
+    }
+    data.address = argv[optind];
+    data.port = (argc > optind + 1) ? g_ascii_strtod(argv[optind + 1], NULL) : DEFAULT_PORT;
+    if (!data.num_buffers)
+        data.num_buffers = data.zero_copy ? CAPTURE_BUFFERS_ZERO_COPY : CAPTURE_BUFFERS;
+    if (data.dmabuf)
+        data.dmabuf_allocator = gst_dmabuf_allocator_new();
+    if (min_bitrate > max_bitrate) {
+        g_printerr("--min-bitrate %d is above --max-bitrate %d\n", min_bitrate, max_bitrate);
+        return 1;
+    }
+    rate_control_init(&data.rate, min_bitrate, max_bitrate, bitrate, probe);
+    if (data.pace && data.udp_mode == UDP_MODE_UDPSINK) {
+        g_print("Pacing sends through sendmmsg\n");
+        data.udp_mode = UDP_MODE_MMSG;
+    }
+    pacer_init(&data.pacer, PACE_BURST_PACKETS * MTU);
+    if (data.pace)
+        data.pace_ring = new SpscRing<struct PacedSample, PACE_RING_SIZE>();
+    g_mutex_init(&data.dest_lock);
+    memset(&dests[0], 0, sizeof(dests[0]));
+    dests[0].host = g_strdup(data.address);
+    dests[0].port = data.port;
+    dests[0].dscp = dscp;
+    for (int i = 0; i < dest_count; i++) {
+        if (!add_destination(&data, &dests[i]))
+            return 1;
+    }
+    if (data.udp_mode == UDP_MODE_GSO && !udp_batch_gso(data.dests[0].batch))
+        g_print("No UDP GSO in the kernel, sending with sendmmsg\n");
+    if (data.dest_file)
+        load_destinations(&data);
+    data.bitrate = data.rate.rate;
+    g_mutex_init(&data.lock);
+    g_mutex_init(&data.capture_lock);
+    for (int i = 0; i < data.camera_count; i++) {
+        struct Camera *camera = &data.cameras[i];
+
+        camera->index = i;
+        camera->owner = &data;
+        camera->fd = -1;
+        g_mutex_init(&camera->queue_lock);
+    }
+    data.capture_ring = new SpscRing<struct CaptureFrame, CAPTURE_RING_SIZE>();
+    data.push_ring = new SpscRing<struct OutputFrame, PUSH_RING_SIZE>();
+    data.bands = band_pool_new(threads);
+    if (!data.bands) {
+        g_printerr("Can't create the conversion threads\n");
         return 1;
     }
-    data.address = argv[1];
-    data.port = (argc > 2) ? g_ascii_strtod(argv[2], NULL) : 5600;
+    data.tracer = latency_tracer_new();
+
+    /* Negotiate the capture format, the pipeline caps follow it */
+    for (int i = 0; i < data.camera_count; i++) {
+        struct Camera *camera = &data.cameras[i];
+        const struct Camera *first = &data.cameras[0];
+
+        if (init_device(camera) < 0)
+            return 1;
+        // A switch keeps the pipeline, so all cameras must fit its caps
+        if (!same_capture_format(&first->pix, &camera->pix) ||
+            camera->fps_n * first->fps_d != first->fps_n * camera->fps_d) {
+            g_printerr("%s: capture format differs from the one of %s\n", camera->device, first->device);
+            return 1;
+        }
+        frame_clock_init(&camera->clock, gst_util_uint64_scale_int(GST_SECOND, camera->fps_d, camera->fps_n));
+    }
+    data.capture_format = data.cameras[0].capture_format;
+    data.pix = data.cameras[0].pix;
+    data.capture_info = data.cameras[0].capture_info;
+    data.fps_n = data.cameras[0].fps_n;
+    data.fps_d = data.cameras[0].fps_d;
+    data.top_field_first = data.cameras[0].top_field_first;
+    if (!choose_frame_path(&data))
+        return 1;
+    data.mode_wanted = data.mode_arg;
+    data.camera_wanted = data.camera_arg;
+    if (data.mode_file)
+        load_output_mode(&data);
+    data.camera = data.camera_wanted;
+    data.capture_camera = data.camera;
+    if (data.camera_count > 1)
+        g_print("%d cameras, streaming from %d, %s\n", data.camera_count, data.camera,
+                data.cameras[data.camera].device);
+    g_print("Frame format %s -> %s, converter %s, %d band(s)\n", gst_video_format_to_string(data.capture_format),
+            gst_video_format_to_string(data.format), convert_impl_name(), band_pool_bands(data.bands));
+    if (data.denoise)
+        g_print("Denoise strength %d %s, %s\n", data.denoise, data.denoise_chroma ? "luma+chroma" : "luma",
+                denoise_impl_name());
 
     /* Create the main loop */
     data.loop = g_main_loop_new(NULL, FALSE);
@@ -641,20 +4482,75 @@ int main(int argc, char *argv[])
     g_source_attach(signal_source_stop, g_main_loop_get_context(data.loop));
     g_source_unref(signal_source_stop);
 
+    if (data.dest_file || data.mode_file) {
+        signal_source_reload = g_unix_signal_source_new(SIGHUP);
+        g_source_set_callback(signal_source_reload, signal_handler_reload, &data, NULL);
+        g_source_attach(signal_source_reload, g_main_loop_get_context(data.loop));
+        g_source_unref(signal_source_reload);
+    }
+
     /* Start the initial pipeline */
     g_print("Initializing pipeline and starting main loop...\n");
+    start_resume_timer(&data, "start");
     start_pipeline(&data);
-    pthread_t reader_thread;
-    pthread_create(&reader_thread, NULL, &video_reader, (void *)&data);
+    pthread_create(&push_tid, NULL, &push_thread, (void *)&data);
+    if (data.pace)
+        pthread_create(&pace_tid, NULL, &pace_thread, (void *)&data);
+    pthread_create(&convert_tid, NULL, &convert_thread, (void *)&data);
+    for (int i = 0; i < data.camera_count; i++)
+        pthread_create(&data.cameras[i].thread, NULL, &video_reader, (void *)&data.cameras[i]);
+    if (stats_interval > 0)
+        g_timeout_add_seconds(stats_interval, (GSourceFunc)print_stats, &data);
+    g_timeout_add(RTCP_POLL_MS, (GSourceFunc)check_receiver_reports, &data);
 
     /* Run the main loop */
     g_main_loop_run(data.loop);
 
     /* Clean up on exit */
     g_print("Exiting...\n");
+    g_atomic_int_set(&data.quit, 1);
+    for (int i = 0; i < data.camera_count; i++)
+        pthread_join(data.cameras[i].thread, NULL);
+    pthread_join(convert_tid, NULL);
+    pthread_join(push_tid, NULL);
+    if (data.pace)
+        pthread_join(pace_tid, NULL);
+    {
+        struct OutputFrame out;
+
+        while (data.push_ring->try_pop(out))
+            gst_buffer_unref(out.buffer);
+    }
     stop_pipeline(&data);
-    pthread_join(reader_thread, NULL);
+    if (data.pace) {
+        struct PacedSample paced;
+
+        while (data.pace_ring->try_pop(paced))
+            gst_sample_unref(paced.sample);
+        delete data.pace_ring;
+    }
+    band_pool_free(data.bands);
+    if (data.idle_frame)
+        gst_buffer_unref(data.idle_frame);
+    latency_tracer_free(data.tracer);
+    frame_ring_destroy(data.tap);
+    g_free(data.denoise_ref[0]);
+    g_free(data.denoise_ref[1]);
+    frame_thumb_free(&data.skip_cur);
+    frame_thumb_free(&data.skip_sent[0]);
+    frame_thumb_free(&data.skip_sent[1]);
+    while (data.dest_count)
+        remove_destination(&data, data.dest_count - 1);
+    delete data.capture_ring;
+    delete data.push_ring;
     g_main_loop_unref(data.loop);
+    if (data.dmabuf_allocator)
+        gst_object_unref(data.dmabuf_allocator);
+    g_mutex_clear(&data.lock);
+    g_mutex_clear(&data.capture_lock);
+    for (int i = 0; i < data.camera_count; i++)
+        g_mutex_clear(&data.cameras[i].queue_lock);
+    g_mutex_clear(&data.dest_lock);
 
-    return 0;
+    return data.exit_status;
 }